@@ -53,6 +53,11 @@ public:
         return _Size;
     }
 
+    // The `byte_size()` bytes written into a binary file.
+    const CharT *data() const noexcept {
+        return table.data();
+    }
+
 private:
     // The std-like stream operator overloads.
     template <typename Traits>
@@ -2,6 +2,7 @@
 #define MEMTABLE_CLASS
 
 #include <fstream>
+#include <set>
 #include "BloomFilter.hpp"
 #include "SkipList.hpp"
 #include "sst.hpp"
@@ -16,80 +17,100 @@ public:
     using key_type = lsm::key_type;
     using val_type = lsm::value_type;
     using size_type = lsm::size_type;
-    using kv_type = std::pair<key_type, val_type>;
+    using kv_type = std::pair<key_type, lsm::record>;
     using offset_type = lsm::offset_type;
 
-    explicit MemTable()
-        : _time_stamp(1), _count(0), _byte(HEADER_SIZE + lsm::BLF_SIZE) {}
+    using snapshot_list = std::multiset<lsm::seq_type>;
+    // Versions of each key, from the newest
+    using table_type = basic_ds::SkipList<key_type, std::vector<lsm::record>>;
 
-    explicit MemTable(uint64_t ts)
-        : _time_stamp(ts), _count(0), _byte(HEADER_SIZE + lsm::BLF_SIZE) {}
+    explicit MemTable() : _time_stamp(1), _count(0), _byte(EMPTY_SIZE), snapshots(nullptr) {}
 
-    ~MemTable() = default;  // nothing todo
-
-    // This method is a little dangerous, since it throw an exception
-    sst::sst_cache to_binary(const std::string &bin_name, int level) const {
-        std::ofstream bin_out{bin_name, std::ios::binary};  // Trunc
-        if (!bin_out) {
-            throw std::runtime_error {
-                "Cannot write sst " + bin_name + ". Please check if the directory exists."
-            };
-        }
-
-        auto kv_list = this->dst.get_kv();
-        std::pair<uint64_t, uint64_t> range{kv_list.front().first, kv_list.back().first};
-
-        // Write the header
-        bin_out
-            .write(reinterpret_cast<const char *>(&this->_time_stamp),
-                   sizeof this->_time_stamp)
-            .write(reinterpret_cast<const char *>(&this->_count), sizeof this->_count)
-            .write(reinterpret_cast<const char *>(&range), sizeof range);
+    // An overwritten version is kept as long as one of the `snapshots` sees it.
+    explicit MemTable(uint64_t ts, const snapshot_list *snapshots = nullptr)
+        : _time_stamp(ts), _count(0), _byte(EMPTY_SIZE), snapshots(snapshots) {}
 
-        // Write the bloom filter
-        bin_out << this->bft;
+    MemTable(const MemTable &) = default;
 
+    ~MemTable() = default;  // nothing todo
 
-        // The below implements are value_type-dependent
-
-        // Write the index table
-        decltype(sst::sst_cache{}.indices) indices;
-        indices.reserve(this->_count);
-
-        offset_type offset = HEADER_SIZE + lsm::BLF_SIZE +
-                             this->_count * (sizeof(key_type) + sizeof(offset_type));
-        for (kv_type &kv : kv_list) {
-            bin_out.write(reinterpret_cast<const char *>(&kv.first), sizeof(key_type))
-                .write(reinterpret_cast<const char *>(&offset), sizeof(offset_type));
-            indices.emplace_back(kv.first, offset);
-            offset += kv.second.length() + 1;  // null-terminated
+    // This method is a little dangerous, since it throw an exception
+    // The values of at least `min_separated_size` bytes are written to a new segment of
+    // `values`, if given, and the sst holds where they lie instead.
+    sst::sst_cache to_binary(const std::string &bin_name, int level,
+                             io::rate_limiter *limiter = nullptr,
+                             const lsm::index_options &index_opts = {},
+                             lsm::value_log *values = nullptr,
+                             size_type min_separated_size = 0) const {
+        auto range_dels = this->range_dels;
+        std::sort(range_dels.begin(), range_dels.end(),
+                  [](const lsm::range_tombstone &r1, const lsm::range_tombstone &r2) -> bool {
+                      return r1.begin < r2.begin;
+                  });
+        auto is_separated = [&](const lsm::record &rec) -> bool {
+            return values && min_separated_size > 0 && rec.type == lsm::record_type::PUT &&
+                   rec.value.size() >= min_separated_size;
+        };
+        // The segment is written out before the sst points to it, and joins the log once the
+        // sst is written. It is removed if the sst cannot be.
+        std::vector<lsm::value_type> pointers;
+        std::unique_ptr<lsm::value_log::writer> writer;
+        if (values && min_separated_size > 0) {
+            writer = values->new_writer(limiter);
+            this->for_each_record([&](key_type key, const lsm::record &rec) {
+                if (is_separated(rec)) {
+                    pointers.push_back(writer->append(key, rec.seq, rec.value).encode());
+                }
+            });
+            writer->finish();
         }
-
-        // Write the value data
-        for (kv_type &kv : kv_list) {
-            bin_out.write(kv.second.c_str(), kv.second.length() + 1);
+        // The records are written straight from the skip list
+        auto cache = sst::write_sst_records(
+            bin_name, level, this->_time_stamp,
+            [&](auto &&f) {
+                std::size_t separated = 0;
+                this->for_each_record([&](key_type key, const lsm::record &rec) {
+                    if (is_separated(rec)) {
+                        f(key, lsm::record{lsm::record_type::VALUE_POINTER,
+                                           pointers[separated++], rec.seq});
+                    } else {
+                        f(key, rec);
+                    }
+                });
+            },
+            std::move(range_dels), this->bft, limiter, index_opts);
+        if (writer) {
+            values->install(*writer);
         }
-
-        return {
-            level,
-            {this->_time_stamp, this->_count, range.first, range.second},
-            this->bft,
-            std::move(indices),
-            {bin_name}};
+        return cache;
     }
 
-    void put(const key_type &key, const val_type &val) noexcept {
-
-        size_type future_size = this->predict_byte_size(key, val);
+    void put(const key_type &key, const val_type &val, lsm::seq_type seq = 0) noexcept {
+        this->insert(key, {lsm::record_type::PUT, val, seq});
+    }
 
-        bool is_inserted = dst.insert_or_assign(key, val).second;
-        bft.insert(key);
+    // Write a version whose value is in the value log, at the encoded `lsm::value_pointer`.
+    void put_pointer(const key_type &key, const val_type &pointer, lsm::seq_type seq) noexcept {
+        this->insert(key, {lsm::record_type::VALUE_POINTER, pointer, seq});
+    }
 
-        // Update byte
-        this->_byte = future_size;
+    // Write a tombstone of the key.
+    void del(const key_type &key, lsm::seq_type seq = 0) noexcept {
+        this->insert(key, {lsm::record_type::DELETE, {}, seq});
+    }
 
-        // Update count
-        this->_count += static_cast<int>(is_inserted);
+    // Write a range tombstone of [begin, end], which replaces the records it covers unless a
+    // snapshot sees them.
+    void del_range(const key_type &begin, const key_type &end, lsm::seq_type seq = 0) noexcept {
+        for (const auto &kv : this->dst.get_kv(begin, end)) {
+            auto *versions = this->dst.find_value(kv.first);
+            this->prune(*versions, seq);
+            if (versions->empty()) {
+                this->dst.erase(kv.first);
+            }
+        }
+        this->range_dels.push_back({begin, end, seq});
+        this->_byte += sst::RANGE_TOMBSTONE_SIZE;
     }
 
     size_type byte_size() const noexcept {
@@ -97,12 +118,18 @@ public:
     }
 
     // Predict the byte size after insert/merge the given (key, value).
+    // A tombstone is predicted as an empty value.
     size_type predict_byte_size(const key_type &key, const val_type &val) const noexcept {
-        auto get_result = this->get(key);
-        if (!get_result.second) {
+        auto p = this->find(key);
+        if (!p || this->is_visible(p->val.front().seq, lsm::MAX_SEQ)) {
             return this->_byte + MemTable::predict_insert_size(key, val);
         }
-        return this->_byte + MemTable::predict_update_size(key, val, get_result.first);
+        return this->_byte + MemTable::predict_update_size(key, val, p->val.front().value);
+    }
+
+    // Predict the byte size after adding a range tombstone (at most).
+    size_type predict_range_size() const noexcept {
+        return this->_byte + sst::RANGE_TOMBSTONE_SIZE;
     }
 
     bool in_range(key_type key) const noexcept {
@@ -113,31 +140,54 @@ public:
 
 
     /**
-     * @brief Get the value from the memory table.
+     * @brief Get the record from the memory table.
      *
      * @param key
-     * @return std::pair<val_type, bool> consisting of the value found in the memory table and
-     *         a bool flag denotes whether the found result is valid (whether the key exists).
+     * @param snapshot only the versions up to this sequence number are visible.
+     * @return std::pair<lsm::record, bool> consisting of the record found in the memory table
+     *         and a bool flag denotes whether the found result is valid (whether the key exists).
+     *         A key covered by a range tombstone is found as a tombstone.
      */
-    std::pair<val_type, bool> get(const key_type &key) const noexcept {
-        val_type found = val_type{};  // Use the default initialization.
-        if (!this->in_range(key) || !bft.contains(key)) {
-            return {found, false};
+    std::pair<lsm::record, bool> get(const key_type &key,
+                                     lsm::seq_type snapshot = lsm::MAX_SEQ) const noexcept {
+        std::pair<lsm::record, bool> res{{lsm::record_type::PUT, {}, 0}, false};
+        auto p = this->find(key);
+        if (p) {
+            for (const auto &rec : p->val) {
+                if (rec.seq <= snapshot) {
+                    res = {rec, true};
+                    break;
+                }
+            }
         }
-        auto p = this->dst.find(key);
-        if (!p) {
-            return {found, false};
+        for (const auto &range : this->range_dels) {
+            if (range.covers(key) && range.seq <= snapshot &&
+                (!res.second || range.seq > res.first.seq)) {
+                res = {{lsm::record_type::DELETE, {}, range.seq}, true};
+            }
         }
-        found = p->val;
-        return {found, true};
+        return res;
     }
 
+    // The number of versions, excluding range tombstones.
     size_type size() const noexcept {
         return this->_count;
     }
 
+    bool empty() const noexcept {
+        return this->_count == 0 && this->range_dels.empty();
+    }
+
+    const table_type &table() const noexcept {
+        return this->dst;
+    }
+
+    const std::vector<lsm::range_tombstone> &range_tombstones() const noexcept {
+        return this->range_dels;
+    }
+
 private:
-    static constexpr size_type HEADER_SIZE = 32;
+    static constexpr size_type EMPTY_SIZE = sst::HEADER_SIZE + lsm::BLF_SIZE + sst::FOOTER_SIZE;
 
     /** 32 bytes in the header */
     uint64_t _time_stamp;
@@ -147,13 +197,74 @@ private:
     size_type _byte;
 
     /** Basic data structure */
-    basic_ds::SkipList<key_type, val_type> dst;  // dynamic search table
-    basic_ds::BloomFilter<lsm::BLF_SIZE> bft;    // bloom filter
+    // dynamic search table, holding the versions of each key from the newest
+    table_type dst;
+    basic_ds::BloomFilter<lsm::BLF_SIZE> bft;      // bloom filter
+    std::vector<lsm::range_tombstone> range_dels;  // only cover the versions seen by snapshots
+    const snapshot_list *snapshots;                // Not owned, may be null
+
+    void insert(const key_type &key, lsm::record rec) noexcept {
+        auto *versions = dst.find_value(key);
+        if (!versions) {
+            dst.insert_or_assign(key, {});
+            versions = dst.find_value(key);
+        }
+        this->prune(*versions, rec.seq);
+        this->_byte += sst::record_size(rec.value);
+        ++this->_count;
+        versions->insert(versions->begin(), std::move(rec));
+        bft.insert(key);
+    }
+
+    // Whether a snapshot sees the version of `seq`, which is shadowed since `next_seq`.
+    bool is_visible(lsm::seq_type seq, lsm::seq_type next_seq) const noexcept {
+        if (!snapshots) {
+            return false;
+        }
+        auto it = snapshots->lower_bound(seq);
+        return it != snapshots->end() && *it < next_seq;
+    }
+
+    // Drop the versions no snapshot sees any more, once a version or a range tombstone of
+    // `seq` shadows them.
+    void prune(std::vector<lsm::record> &versions, lsm::seq_type seq) noexcept {
+        auto kept = versions.begin();
+        for (auto &rec : versions) {
+            if (this->is_visible(rec.seq, seq)) {
+                seq = rec.seq;
+                if (&*kept != &rec) {
+                    *kept = std::move(rec);
+                }
+                ++kept;
+            } else {
+                this->_byte -= sst::record_size(rec.value);
+                --this->_count;
+            }
+        }
+        versions.erase(kept, versions.end());
+    }
+
+    // Call `f` with the key and the record of each version, ordered by key and then from the
+    // newest.
+    template <typename F>
+    void for_each_record(F &&f) const {
+        for (auto *node = this->dst.begin(); node != this->dst.end(); node = node->next()) {
+            for (const auto &rec : node->val) {
+                f(node->key, rec);
+            }
+        }
+    }
+
+    auto find(const key_type &key) const noexcept -> decltype(dst.find(key)) {
+        if (!this->in_range(key) || !bft.contains(key)) {
+            return nullptr;
+        }
+        return this->dst.find(key);
+    }
 
     inline static size_type predict_insert_size(const key_type &key,
                                                 const val_type &val) noexcept {
-        return (sizeof(key_type) + sizeof(offset_type) +
-                (val.length() + 1 /* null-terminated */) * sizeof(char));
+        return sst::record_size(val);
     }
 
     inline static size_type predict_update_size(const key_type &key, const val_type &val,
@@ -161,7 +272,6 @@ private:
         return (val.length() - pre_val.length()) * sizeof(char);
     }
 };
-// const lsm::value_type MemTable::DeleteNote = "~DELETED~"s;
 // constexpr typename MemTable::size_type MemTable::HEADER_SIZE;
 
 }  // namespace mtb
@@ -32,6 +32,8 @@ inline uint64_t rotl64 ( uint64_t x, int8_t r )
 
 #endif // !defined(_MSC_VER)
 
+#include <string.h>
+
 FORCE_INLINE uint64_t getblock64 ( const uint64_t * p, int i )
 {
   return p[i];
@@ -126,6 +128,8 @@ static inline void MurmurHash3_x64_128 ( const void * key, const int len,
   h1 += h2;
   h2 += h1;
 
-  ((uint64_t*)out)[0] = h1;
-  ((uint64_t*)out)[1] = h2;
+  // `out` usually points to uint32_t storage, write through memcpy to stay
+  // clear of strict aliasing.
+  memcpy((uint8_t*)out, &h1, sizeof h1);
+  memcpy((uint8_t*)out + sizeof h1, &h2, sizeof h2);
 }
\ No newline at end of file
@@ -31,6 +31,14 @@ class SkipList {
                      SkipListNode *p4 = nullptr)
             : key(k), val(v), _pre(p1), _next(p2), _above(p3), _below(p4) {}
 
+        // Neighbours in the bottom level, see `SkipList::end` and `SkipList::rend`.
+        const SkipListNode *next() const noexcept {
+            return _next;
+        }
+        const SkipListNode *prev() const noexcept {
+            return _pre;
+        }
+
     private:
         SkipListNode *_pre, *_next, *_above, *_below;
     };
@@ -39,6 +47,7 @@ class SkipList {
 
 public:
     using kv_type = std::pair<key_type, value_type>;
+    using node_type = SkipListNode;
 
     explicit SkipList() : h{0} {
         std::srand(std::time(nullptr));
@@ -47,6 +56,12 @@ public:
         head[0]->_next = tail[0];
         tail[0]->_pre = head[0];
     }
+    SkipList(const SkipList &other) : SkipList() {
+        for (Node *p = other.head[0]->_next; p != other.tail[0]; p = p->_next) {
+            this->insertUntil(p->key, p->val, tail[0]->_pre);
+        }
+    }
+    SkipList &operator=(const SkipList &) = delete;
     ~SkipList() {
         for (int i = 0; i <= h; ++i) {
             Node *p = head[i];
@@ -76,15 +91,11 @@ public:
     std::pair<const Node *, bool> insert_or_assign(const key_type &key,
                                                    const value_type &val) noexcept {
         Node *t;
-        /* update the value */
+        /* update the value, which is only kept in the bottom node */
         if (this->searchUtil(key, &t)) {
             assert(t->key == key);
-            auto res = std::make_pair(t, false);
-            do {
-                t->val = val;
-                t = t->_above;
-            } while (t);
-            return res;
+            t->val = val;
+            return {t, false};
         }
         // if (!this->searchUtil(key, &t) && t->key == key && t != head[0]) {
         //     do {
@@ -107,6 +118,47 @@ public:
         return nullptr;
     }
 
+    // Returns: the value of the target node if found, otherwise null.
+    value_type *find_value(const key_type &key) {
+        Node *p;
+        if (this->searchUtil(key, &p)) {
+            return &p->val;
+        }
+        return nullptr;
+    }
+
+    // Returns: whether the key existed and is erased.
+    bool erase(const key_type &key) noexcept {
+        Node *t;
+        if (!this->searchUtil(key, &t)) {
+            return false;
+        }
+        // Unlink the tower from the bottom up.
+        while (t) {
+            Node *above = t->_above;
+            t->_pre->_next = t->_next;
+            t->_next->_pre = t->_pre;
+            delete t;
+            t = above;
+        }
+        return true;
+    }
+
+    // Returns: the key-value pairs in [lower, upper], in ascending order.
+    std::vector<kv_type> get_kv(const key_type &lower, const key_type &upper) const noexcept {
+        std::vector<kv_type> res{};
+        Node *p;
+        if (!this->searchUtil(lower, &p)) {
+            p = p->_next;
+        }
+        Node *sentinel = tail[0];
+        while (p != sentinel && p->key <= upper) {
+            res.emplace_back(p->key, p->val);
+            p = p->_next;
+        }
+        return res;
+    }
+
     std::vector<kv_type> get_kv() const noexcept {
         std::vector<kv_type> res{};
         Node *p = head[0]->_next;
@@ -118,6 +170,37 @@ public:
         return res;
     }
 
+    // The bottom level runs from `begin()` to `rbegin()`. The sentinel `end()` follows the last
+    // node, and `rend()` precedes the first one.
+    const Node *begin() const noexcept {
+        return head[0]->_next;
+    }
+    const Node *end() const noexcept {
+        return tail[0];
+    }
+    const Node *rbegin() const noexcept {
+        return tail[0]->_pre;
+    }
+    const Node *rend() const noexcept {
+        return head[0];
+    }
+
+    // Returns: the first node not less than the key, or `end()`.
+    const Node *lower_bound(const key_type &key) const {
+        Node *p;
+        if (this->searchUtil(key, &p)) {
+            return p;
+        }
+        return p->_next;
+    }
+
+    // Returns: the last node not greater than the key, or `rend()`.
+    const Node *floor(const key_type &key) const {
+        Node *p;
+        this->searchUtil(key, &p);
+        return p;
+    }
+
     std::pair<key_type, key_type> get_range() const noexcept {
         if (head[0] == tail[0]) {
             return {1, 0};
@@ -232,7 +315,8 @@ private:
             }
             pLeft = pLeft->_above;
             pRight = pRight->_above;
-            t->_above = new Node(key, val, pLeft, pRight, nullptr, t);
+            // Only the bottom node holds the value
+            t->_above = new Node(key, value_type{}, pLeft, pRight, nullptr, t);
             t = t->_above;
             pLeft->_next = t;
             pRight->_pre = t;
@@ -0,0 +1,344 @@
+/**
+ * @file io.hpp
+ * @brief File I/O of the ssts: buffered sequential reads and writes, and positional reads.
+ */
+#ifndef LSM_IO
+#define LSM_IO
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+
+#include "perf_context.hpp"
+#include "rate_limiter.hpp"
+
+namespace io {
+
+constexpr std::size_t ALIGNMENT = 4096;
+constexpr std::size_t DEFAULT_BUFFER_SIZE = 1024 * 1024; /* 1 MB */
+
+struct free_deleter {
+    void operator()(char *p) const noexcept {
+        std::free(p);
+    }
+};
+
+// A buffer aligned to the page size, so that whole pages move between it and the page cache.
+using aligned_buffer = std::unique_ptr<char[], free_deleter>;
+
+inline aligned_buffer make_aligned_buffer(std::size_t size) {
+    void *p = nullptr;
+    if (posix_memalign(&p, ALIGNMENT, size) != 0) {
+        throw std::bad_alloc{};
+    }
+    return aligned_buffer{static_cast<char *>(p)};
+}
+
+/**
+ * @brief Read up to `n` bytes at the file offset, retrying interrupted and partial reads.
+ * @return the bytes read, fewer than `n` only at the end of the file, or -1 on error.
+ */
+inline ssize_t read_full(int fd, char *dst, std::size_t n, uint64_t offset) noexcept {
+    std::size_t done = 0;
+    while (done < n) {
+        ssize_t res = ::pread(fd, dst + done, n - done, offset + done);
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+        if (res < 0) {
+            return -1;
+        }
+        if (res == 0) {
+            break;
+        }
+        done += res;
+    }
+    return done;
+}
+
+// A file opened for reading, closed when destroyed.
+class file {
+public:
+    file() noexcept : fd(-1) {}
+    explicit file(const std::string &path) : fd(::open(path.c_str(), O_RDONLY)) {}
+
+    file(file &&other) noexcept : fd(other.fd) {
+        other.fd = -1;
+    }
+    file &operator=(file &&other) noexcept {
+        std::swap(fd, other.fd);
+        return *this;
+    }
+    file(const file &) = delete;
+    file &operator=(const file &) = delete;
+
+    ~file() {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    explicit operator bool() const noexcept {
+        return fd >= 0;
+    }
+
+    int descriptor() const noexcept {
+        return fd;
+    }
+
+    // Read [offset, offset + n). Returns: false on error or if the file ends before.
+    bool read_at(char *dst, std::size_t n, uint64_t offset) const noexcept {
+        return read_full(fd, dst, n, offset) == static_cast<ssize_t>(n);
+    }
+
+private:
+    int fd;
+};
+
+/**
+ * @brief Reads a file through a large buffer with few system calls. The kernel is told the
+ *        file is read sequentially, and the window after the buffer is prefetched while the
+ *        buffer is consumed. Each refill is paced by the rate limiter, if any.
+ */
+class sequential_reader {
+public:
+    explicit sequential_reader(const std::string &path,
+                               std::size_t buffer_size = DEFAULT_BUFFER_SIZE,
+                               rate_limiter *limiter = nullptr)
+        : fd(::open(path.c_str(), O_RDONLY)),
+          buf(make_aligned_buffer(buffer_size)),
+          capacity(buffer_size),
+          buf_offset(0),
+          pos(0),
+          len(0),
+          limiter(limiter) {
+        lsm::perf_add(&lsm::perf_context::file_opens);
+#ifdef __linux__
+        if (fd >= 0) {
+            ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+#endif
+    }
+
+    sequential_reader(const sequential_reader &) = delete;
+    sequential_reader &operator=(const sequential_reader &) = delete;
+
+    ~sequential_reader() {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    explicit operator bool() const noexcept {
+        return fd >= 0;
+    }
+
+    // Start reading [offset, offset + length) into the page cache.
+    void will_need(uint64_t offset, std::size_t length) const noexcept {
+#ifdef __linux__
+        ::readahead(fd, offset, length);
+#endif
+    }
+
+    uint64_t tell() const noexcept {
+        return buf_offset + pos;
+    }
+
+    void seek(uint64_t offset) {
+        if (buf_offset <= offset && offset <= buf_offset + len) {
+            pos = offset - buf_offset;
+            return;
+        }
+        if (offset < buf_offset) {
+            // Going backwards: keep the bytes before the offset in the buffer as well
+            uint64_t start = offset > capacity / 2 ? offset - capacity / 2 : 0;
+            start -= start % ALIGNMENT;
+            if (offset - start >= capacity) {
+                start = offset - offset % ALIGNMENT;
+            }
+            fill(start);
+            pos = std::min<std::size_t>(offset - start, len);
+            return;
+        }
+        // Filled on the next read
+        buf_offset = offset;
+        pos = len = 0;
+    }
+
+    // Returns: the next byte, or -1 at the end of the file.
+    int get() {
+        if (pos == len && !fill(buf_offset + len)) {
+            return -1;
+        }
+        return static_cast<unsigned char>(buf[pos++]);
+    }
+
+    // Returns: false if the file ends before `n` bytes are read.
+    bool read(char *dst, std::size_t n) {
+        while (n > 0) {
+            if (pos == len && !fill(buf_offset + len)) {
+                return false;
+            }
+            std::size_t chunk = std::min(n, len - pos);
+            std::memcpy(dst, buf.get() + pos, chunk);
+            dst += chunk;
+            pos += chunk;
+            n -= chunk;
+        }
+        return true;
+    }
+
+    // Read until `delim`, which is consumed but not stored, like `std::getline`.
+    friend bool getline(sequential_reader &in, std::string &str, char delim) {
+        str.clear();
+        while (true) {
+            if (in.pos == in.len && !in.fill(in.buf_offset + in.len)) {
+                return false;
+            }
+            const char *begin = in.buf.get() + in.pos;
+            const char *found =
+                static_cast<const char *>(std::memchr(begin, delim, in.len - in.pos));
+            if (found) {
+                str.append(begin, found);
+                in.pos += found - begin + 1;
+                return true;
+            }
+            str.append(begin, in.len - in.pos);
+            in.pos = in.len;
+        }
+    }
+
+private:
+    int fd;
+    aligned_buffer buf;
+    std::size_t capacity;
+    uint64_t buf_offset;  // File offset of `buf[0]`
+    std::size_t pos, len;  // The buffer holds `len` bytes, of which `pos` are consumed
+    rate_limiter *limiter;
+
+    // Refill the buffer from the file offset. Returns: false if nothing is left to read.
+    bool fill(uint64_t offset) {
+        buf_offset = offset;
+        pos = len = 0;
+        if (fd < 0) {
+            return false;
+        }
+        ssize_t n;
+        {
+            lsm::perf_timer timer{&lsm::perf_context::read_nanos};
+            n = read_full(fd, buf.get(), capacity, offset);
+        }
+        len = n > 0 ? n : 0;
+        lsm::perf_add(&lsm::perf_context::bytes_read, len);
+        if (limiter && len > 0) {
+            limiter->request(len);
+        }
+        if (len == capacity) {
+            will_need(offset + len, capacity);
+        }
+        return len > 0;
+    }
+};
+
+/**
+ * @brief Writes a file through a large aligned buffer, so that the file is written in a few
+ *        large system calls. Each flush is paced by the rate limiter, if any.
+ */
+class sequential_writer {
+public:
+    // Creates or truncates the file.
+    explicit sequential_writer(const std::string &path,
+                               std::size_t buffer_size = DEFAULT_BUFFER_SIZE,
+                               rate_limiter *limiter = nullptr)
+        : fd(::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)),
+          buf(make_aligned_buffer(buffer_size)),
+          capacity(buffer_size),
+          len(0),
+          written(0),
+          is_good(fd >= 0),
+          limiter(limiter) {}
+
+    sequential_writer(const sequential_writer &) = delete;
+    sequential_writer &operator=(const sequential_writer &) = delete;
+
+    ~sequential_writer() {
+        close();
+    }
+
+    // Whether every write so far succeeded.
+    explicit operator bool() const noexcept {
+        return is_good;
+    }
+
+    uint64_t tell() const noexcept {
+        return written + len;
+    }
+
+    sequential_writer &write(const char *src, std::size_t n) {
+        while (n > 0 && is_good) {
+            if (len == capacity) {
+                flush();
+            }
+            std::size_t chunk = std::min(n, capacity - len);
+            std::memcpy(buf.get() + len, src, chunk);
+            src += chunk;
+            len += chunk;
+            n -= chunk;
+        }
+        return *this;
+    }
+
+    sequential_writer &put(char c) {
+        return write(&c, 1);
+    }
+
+    // Flush and close the file. Returns: whether every write succeeded.
+    bool close() {
+        if (fd >= 0) {
+            flush();
+            is_good &= ::close(fd) == 0;
+            fd = -1;
+        }
+        return is_good;
+    }
+
+private:
+    int fd;
+    aligned_buffer buf;
+    std::size_t capacity, len;
+    uint64_t written;  // Bytes flushed to the file
+    bool is_good;
+    rate_limiter *limiter;
+
+    void flush() {
+        if (limiter && len > 0) {
+            limiter->request(len);
+        }
+        std::size_t done = 0;
+        while (is_good && done < len) {
+            ssize_t n = ::write(fd, buf.get() + done, len - done);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                is_good = false;
+                break;
+            }
+            done += n;
+        }
+        written += len;
+        len = 0;
+    }
+};
+
+}  // namespace io
+
+#endif
@@ -0,0 +1,488 @@
+/**
+ * @file iterator.hpp
+ * @brief Ordered iteration over the memory table and the ssts of a `KVStore`.
+ */
+#ifndef LSM_ITERATOR
+#define LSM_ITERATOR
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "MemTable.hpp"
+#include "io.hpp"
+#include "sst.hpp"
+#include "types.hpp"
+#include "value_log.hpp"
+
+namespace lsm {
+
+// Buffer of each sst cursor of an iterator
+constexpr size_type SCAN_BUFFER_SIZE = 256 * 1024; /* 256 KB */
+
+// A cursor over the versions of a sorted source, ordered by key and then from the newest.
+class cursor {
+public:
+    virtual ~cursor() = default;
+
+    virtual bool valid() const = 0;
+    virtual key_type key() const = 0;
+    virtual seq_type seq() = 0;
+    virtual record_type type() = 0;
+    virtual value_type value() = 0;
+
+    virtual void next() = 0;
+    virtual void prev() = 0;
+    // Move to the newest version of the first key not less than `key`.
+    virtual void seek(key_type key) = 0;
+    // Move to the oldest version of the last key not greater than `key`.
+    virtual void seek_for_prev(key_type key) = 0;
+    virtual void seek_to_first() = 0;
+    virtual void seek_to_last() = 0;
+};
+
+// A cursor over the skip list of a memory table. The table must not be modified while the
+// cursor is alive.
+class mem_cursor final : public cursor {
+public:
+    explicit mem_cursor(std::shared_ptr<const mtb::MemTable> mtb)
+        : mtb(std::move(mtb)), node(this->mtb->table().end()), version(0) {}
+
+    bool valid() const override {
+        return node != mtb->table().end() && node != mtb->table().rend();
+    }
+    key_type key() const override {
+        return node->key;
+    }
+    seq_type seq() override {
+        return node->val[version].seq;
+    }
+    record_type type() override {
+        return node->val[version].type;
+    }
+    value_type value() override {
+        return node->val[version].value;
+    }
+
+    void next() override {
+        if (++version == node->val.size()) {
+            node = node->next();
+            version = 0;
+        }
+    }
+    void prev() override {
+        if (version > 0) {
+            --version;
+            return;
+        }
+        node = node->prev();
+        version = valid() ? node->val.size() - 1 : 0;
+    }
+    void seek(key_type key) override {
+        node = mtb->table().lower_bound(key);
+        version = 0;
+    }
+    void seek_for_prev(key_type key) override {
+        node = mtb->table().floor(key);
+        version = valid() ? node->val.size() - 1 : 0;
+    }
+    void seek_to_first() override {
+        node = mtb->table().begin();
+        version = 0;
+    }
+    void seek_to_last() override {
+        node = mtb->table().rbegin();
+        version = valid() ? node->val.size() - 1 : 0;
+    }
+
+private:
+    std::shared_ptr<const mtb::MemTable> mtb;
+    const mtb::MemTable::table_type::node_type *node;
+    std::size_t version;
+};
+
+// A cursor over a sorted run: ssts with disjoint key ranges. Only the sst under the cursor is
+// kept open with its index, and a record is read when the cursor asks for it. The records are read through a
+// sequential buffer, since a cursor mostly moves to the next record.
+class run_cursor final : public cursor {
+    using cache_ref = std::shared_ptr<const sst::sst_cache>;
+
+public:
+    // The ssts without records are skipped.
+    explicit run_cursor(std::vector<cache_ref> run)
+        : file(0), pos(npos), open_file(SIZE_MAX), meta_file(SIZE_MAX), is_loaded(false) {
+        for (auto &cache : run) {
+            if (cache->header.count > 0) {
+                files.push_back(std::move(cache));
+            }
+        }
+        std::sort(files.begin(), files.end(), [](const cache_ref &c1, const cache_ref &c2) {
+            return c1->header.lower < c2->header.lower;
+        });
+        file = files.size();
+    }
+
+    bool valid() const override {
+        return file < files.size();
+    }
+    key_type key() const override {
+        return index().key(pos);
+    }
+    seq_type seq() override {
+        return load().seq;
+    }
+    record_type type() override {
+        return load().type;
+    }
+    value_type value() override {
+        open();
+        in->seek(index().offset(pos));
+        return sst::sst_cache::read_record(*in).value;
+    }
+
+    void next() override {
+        is_loaded = false;
+        pos = index().next(pos);
+        if (pos == npos) {
+            ++file;
+            pos = first_pos();
+        }
+    }
+    void prev() override {
+        is_loaded = false;
+        pos = index().prev(pos);
+        if (pos != npos) {
+            return;
+        }
+        if (file == 0) {
+            file = files.size();
+        } else {
+            --file;
+            pos = index().last();
+        }
+    }
+    void seek(key_type key) override {
+        is_loaded = false;
+        // The first sst ending at or after the key
+        file = std::partition_point(
+                   files.begin(), files.end(),
+                   [key](const cache_ref &cache) { return cache->header.upper < key; }) -
+               files.begin();
+        if (!valid()) {
+            return;
+        }
+        pos = index().lower_bound(key);
+        if (pos == npos) {
+            ++file;
+            pos = first_pos();
+        }
+    }
+    void seek_for_prev(key_type key) override {
+        is_loaded = false;
+        // The last sst starting at or before the key
+        std::size_t n = std::partition_point(
+                            files.begin(), files.end(),
+                            [key](const cache_ref &cache) { return cache->header.lower <= key; }) -
+                        files.begin();
+        if (n == 0) {
+            file = files.size();
+            return;
+        }
+        file = n - 1;
+        const auto &indices = index();
+        auto after = indices.upper_bound(key);
+        pos = after == npos ? indices.last() : indices.prev(after);
+        if (pos == npos) {
+            // Only range tombstones of this sst reach down to the key
+            file = file == 0 ? files.size() : file - 1;
+            pos = valid() ? index().last() : npos;
+        }
+    }
+    void seek_to_first() override {
+        is_loaded = false;
+        file = 0;
+        pos = first_pos();
+    }
+    void seek_to_last() override {
+        is_loaded = false;
+        if (files.empty()) {
+            file = 0;
+            return;
+        }
+        file = files.size() - 1;
+        pos = index().last();
+    }
+
+private:
+    static constexpr sst::key_index::position npos = sst::key_index::npos;
+
+    std::vector<cache_ref> files;  // Ordered by key range
+    std::size_t file;
+    sst::key_index::position pos;  // The index entry `pos` of `files[file]`
+    std::unique_ptr<io::sequential_reader> in;
+    std::size_t open_file;  // The sst `in` reads
+    mutable sst::meta_ptr meta;  // The metadata of `files[meta_file]`
+    mutable std::size_t meta_file;
+    lsm::record head;       // Type and sequence number of the record under the cursor
+    bool is_loaded;
+
+    void open() {
+        if (open_file == file) {
+            return;
+        }
+        in = std::make_unique<io::sequential_reader>(files[file]->sst_path, SCAN_BUFFER_SIZE);
+        if (!*in) {
+            throw std::runtime_error{"Cannot open sst file " + files[file]->sst_path};
+        }
+        open_file = file;
+    }
+
+    // The index of `files[file]`, loaded as the cursor reaches the sst.
+    const sst::key_index &index() const {
+        if (meta_file != file) {
+            meta = files[file]->metadata();
+            meta_file = file;
+        }
+        return meta->indices;
+    }
+
+    // The first entry of `files[file]`, if the cursor is valid.
+    sst::key_index::position first_pos() const {
+        return valid() ? index().first() : npos;
+    }
+
+    const lsm::record &load() {
+        if (!is_loaded) {
+            open();
+            in->seek(index().offset(pos));
+            head = sst::sst_cache::read_head(*in);
+            is_loaded = true;
+        }
+        return head;
+    }
+};
+
+/**
+ * @brief Iterates the live key-value pairs visible at a sequence number, in key order, within
+ *        the bounds [lower, upper]. It reads a consistent view: the sources it is built on must
+ *        not change under it. Values are read when `value()` is called.
+ */
+class iterator {
+public:
+    /**
+     * @param cursors one per sorted source, from the newest source: of two versions with the
+     *        same sequence number, the one of the newer source is read.
+     * @param range_dels range tombstones of all the sources.
+     * @param snapshot only the versions up to this sequence number are visible.
+     * @param lower, upper the keys out of [lower, upper] are never visited, so that the cursors
+     *        may leave out the sources holding none in it.
+     * @param values the segments of the value log the sources point to, if any.
+     */
+    iterator(std::vector<std::unique_ptr<cursor>> cursors,
+             std::vector<range_tombstone> range_dels, seq_type snapshot, key_type lower = 0,
+             key_type upper = UINT64_MAX, value_log::version values = nullptr)
+        : cursors(std::move(cursors)), snapshot(snapshot), lower(lower), upper(upper),
+          values(std::move(values)), current(nullptr), cur_key(0), is_forward(true) {
+        for (const auto &range : range_dels) {
+            if (range.seq <= snapshot) {
+                this->range_dels.push_back(range);
+            }
+        }
+        std::sort(this->range_dels.begin(), this->range_dels.end(),
+                  [](const range_tombstone &r1, const range_tombstone &r2) -> bool {
+                      return r1.begin < r2.begin;
+                  });
+    }
+
+    bool valid() const noexcept {
+        return current != nullptr;
+    }
+
+    key_type key() const noexcept {
+        return cur_key;
+    }
+
+    value_type value() const {
+        if (current->type() != record_type::VALUE_POINTER) {
+            return current->value();
+        }
+        record rec{record_type::VALUE_POINTER, current->value(), current->seq()};
+        value_log::resolve(*values, cur_key, rec);
+        return std::move(rec.value);
+    }
+
+    // Move to the first key not less than `key`.
+    void seek(key_type key) {
+        key = std::max(key, lower);
+        for (auto &c : cursors) {
+            c->seek(key);
+        }
+        is_forward = true;
+        find_next_visible();
+    }
+
+    // Move to the last key not greater than `key`.
+    void seek_for_prev(key_type key) {
+        key = std::min(key, upper);
+        for (auto &c : cursors) {
+            c->seek_for_prev(key);
+        }
+        is_forward = false;
+        find_prev_visible();
+    }
+
+    void seek_to_first() {
+        if (lower > 0) {
+            seek(lower);
+            return;
+        }
+        for (auto &c : cursors) {
+            c->seek_to_first();
+        }
+        is_forward = true;
+        find_next_visible();
+    }
+
+    void seek_to_last() {
+        if (upper < UINT64_MAX) {
+            seek_for_prev(upper);
+            return;
+        }
+        for (auto &c : cursors) {
+            c->seek_to_last();
+        }
+        is_forward = false;
+        find_prev_visible();
+    }
+
+    void next() {
+        if (!is_forward) {
+            // The cursors may lie anywhere before the current key
+            for (auto &c : cursors) {
+                c->seek(cur_key);
+            }
+            is_forward = true;
+        }
+        skip(cur_key);
+        find_next_visible();
+    }
+
+    void prev() {
+        if (cur_key == lower) {
+            current = nullptr;
+            return;
+        }
+        for (auto &c : cursors) {
+            c->seek_for_prev(cur_key - 1);
+        }
+        is_forward = false;
+        find_prev_visible();
+    }
+
+private:
+    std::vector<std::unique_ptr<cursor>> cursors;
+    std::vector<range_tombstone> range_dels;  // Visible at `snapshot`, ordered by `begin`
+    seq_type snapshot;
+    key_type lower, upper;
+    value_log::version values;
+    cursor *current;  // The cursor on the version of `cur_key`, null if invalid
+    key_type cur_key;
+    bool is_forward;  // Whether the cursors not on `cur_key` lie after it
+
+    // Move the cursors past the versions of the key.
+    void skip(key_type key) {
+        for (auto &c : cursors) {
+            while (c->valid() && c->key() == key) {
+                c->next();
+            }
+        }
+    }
+
+    // Whether a range tombstone deletes the version of the key.
+    bool is_covered(key_type key, seq_type seq) const noexcept {
+        for (const auto &range : range_dels) {
+            if (range.begin > key) {
+                break;
+            }
+            if (range.covers(key) && range.seq > seq) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Move the cursors on the key to its newest version visible at the snapshot.
+    // Return the cursor of the newest one, if it is alive.
+    cursor *resolve(key_type key) {
+        cursor *newest = nullptr;
+        for (auto &c : cursors) {
+            if (!c->valid() || c->key() != key) {
+                continue;
+            }
+            if (!is_forward) {
+                c->seek(key);  // Backwards, the cursor is on the oldest version
+            }
+            while (c->valid() && c->key() == key && c->seq() > snapshot) {
+                c->next();
+            }
+            if (c->valid() && c->key() == key && (!newest || c->seq() > newest->seq())) {
+                newest = c.get();
+            }
+        }
+        if (!newest || !has_value(newest->type()) || is_covered(key, newest->seq())) {
+            return nullptr;
+        }
+        return newest;
+    }
+
+    void find_next_visible() {
+        while (true) {
+            cursor *smallest = nullptr;
+            for (auto &c : cursors) {
+                if (c->valid() && (!smallest || c->key() < smallest->key())) {
+                    smallest = c.get();
+                }
+            }
+            if (!smallest || smallest->key() > upper) {
+                current = nullptr;
+                return;
+            }
+            key_type key = smallest->key();
+            if ((current = resolve(key))) {
+                cur_key = key;
+                return;
+            }
+            skip(key);
+        }
+    }
+
+    void find_prev_visible() {
+        while (true) {
+            cursor *largest = nullptr;
+            for (auto &c : cursors) {
+                if (c->valid() && (!largest || c->key() > largest->key())) {
+                    largest = c.get();
+                }
+            }
+            if (!largest || largest->key() < lower) {
+                current = nullptr;
+                return;
+            }
+            key_type key = largest->key();
+            if ((current = resolve(key))) {
+                cur_key = key;
+                return;
+            }
+            if (key == lower) {
+                return;
+            }
+            for (auto &c : cursors) {
+                c->seek_for_prev(key - 1);
+            }
+        }
+    }
+};
+
+}  // namespace lsm
+
+#endif
@@ -1,16 +1,34 @@
 #pragma once
 
 #include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <set>
+#include <thread>
 #include "MemTable.hpp"
+#include "iterator.hpp"
 #include "kvstore_api.h"
+#include "options.hpp"
+#include "perf_context.hpp"
+#include "read_engine.hpp"
+#include "row_cache.hpp"
 #include "sst.hpp"
+#include "statistics.hpp"
+#include "value_log.hpp"
 
+/**
+ * The methods may be called from several threads, and take turns on a mutex except while a
+ * compaction merges or a scan reads. With `options::background_compaction`, a thread owned by
+ * the store compacts alongside them.
+ */
 class KVStore final : public KVStoreAPI {
     // You can add your implementation here
 public:
     using key_type = uint64_t;
     using value_type = std::string;
     KVStore(const std::string &dir);
+    KVStore(const std::string &dir, const lsm::options &opts);
     KVStore() = delete;
 
     ~KVStore();
@@ -21,17 +39,121 @@ public:
 
     bool del(uint64_t key) override;
 
+    /**
+     * Delete all the key-value pairs in [key1, key2] with a single range tombstone.
+     */
+    void del_range(uint64_t key1, uint64_t key2);
+
     void reset() override;
 
     void scan(uint64_t key1, uint64_t key2,
               std::list<std::pair<uint64_t, std::string>> &list) override;
 
+    // A consistent view of the store, holding the sequence number of the last write it sees.
+    // Compaction keeps the versions it sees until it is destroyed.
+    using snapshot_type = std::shared_ptr<const lsm::seq_type>;
+
+    snapshot_type snapshot();
+
+    value_type get(uint64_t key, const snapshot_type &snap);
+
+    void scan(uint64_t key1, uint64_t key2, std::list<std::pair<uint64_t, std::string>> &list,
+              const snapshot_type &snap);
+
+    /**
+     * Get the values of a batch of keys, in the same order. The sst reads of the batch are
+     * issued together, so that up to `options::read_queue_depth` of them are in flight.
+     */
+    std::vector<value_type> multi_get(const std::vector<key_type> &keys);
+
+    std::vector<value_type> multi_get(const std::vector<key_type> &keys,
+                                      const snapshot_type &snap);
+
+    /**
+     * An iterator over the live key-value pairs, unpositioned until a seek. It keeps reading
+     * the store as it was when created, while later writes and compactions go on. It must not
+     * outlive the store or a `reset`.
+     */
+    lsm::iterator new_iterator();
+
+    lsm::iterator new_iterator(const snapshot_type &snap);
+
+    // Counters of the compactions run by this store since it was opened.
+    struct compaction_stats {
+        uint64_t bytes_flushed = 0;       // Bytes of sst written by memory table flushes
+        uint64_t compactions = 0;         // Compactions which merge and rewrite their inputs
+        uint64_t split_compactions = 0;   // Those split into key ranges merged in parallel
+        uint64_t bytes_read = 0;          // Bytes of sst read by merges
+        uint64_t bytes_written = 0;       // Bytes of sst written by merges
+        uint64_t trivial_moves = 0;       // Files moved to the next level without a rewrite
+        uint64_t trivial_move_bytes = 0;  // Bytes that trivial moves saved from being rewritten
+        uint64_t write_slowdowns = 0;     // Writes delayed as compaction fell behind
+        uint64_t write_stops = 0;         // Writes blocked until compaction caught up
+        uint64_t write_stall_us = 0;      // Time the writes were delayed or blocked
+    };
+
+    compaction_stats get_compaction_stats() const;
+
+    // Counters of the rate limiter of flushes and compactions, all zero without a limit.
+    io::rate_limiter::stats get_rate_limiter_stats() const;
+
+    // The bloom filters and indices of the ssts in the memory.
+    struct metadata_usage {
+        lsm::size_type bytes = 0;         // Pinned and cached
+        lsm::size_type pinned_bytes = 0;  // All of it without `options::metadata_cache_bytes`
+        sst::meta_cache::stats cache;     // All zero without `options::metadata_cache_bytes`
+        lsm::size_type range_filter_bytes = 0;  // Always in the memory, not in `bytes`
+    };
+
+    metadata_usage get_metadata_usage() const;
+
+    // Counters and the size of the row cache, all zero without `options::row_cache_bytes`.
+    lsm::row_cache::stats get_row_cache_stats() const;
+
+    // Size and garbage of the value log, and the counters of its writes and collections.
+    lsm::value_log::stats get_value_log_stats() const;
+
+    struct level_summary {
+        int level;
+        lsm::size_type files = 0;
+        lsm::size_type bytes = 0;   // Total size of the ssts in the level
+        lsm::size_type target = 0;  // Target of `bytes`, or of `files` for level-0
+        double score = 0;           // How far the level is over its target, compacted above 1
+        bool is_base = false;       // Whether level-0 compacts into this level
+    };
+
+    // The size of each level against its target.
+    std::vector<level_summary> get_level_summary() const;
+
+    // Bytes compaction has to rewrite to bring every level within its target, estimated.
+    lsm::size_type get_pending_compaction_bytes() const;
+
+    // A sorted run of universal compaction: the level-0 files sharing a time stamp.
+    struct sorted_run {
+        uint64_t time_stamp;
+        lsm::size_type files;
+        lsm::size_type bytes;
+    };
+
+    // Sorted runs from the newest to the oldest. Only meaningful for universal compaction.
+    std::vector<sorted_run> get_sorted_runs() const;
+
+    // Block until no compaction is due, and rethrow the error of a background compaction.
+    // It must not be called while the background work is paused.
+    void wait_for_compaction();
+
+    // Hold the background compactions once the running one completes, until
+    // `continue_background_work`. The writes meanwhile slow down and stop as level-0 grows.
+    void pause_background_work();
+
+    void continue_background_work();
+
 private:
     using mtb_type = mtb::MemTable;
     enum class level_type { TIERING, LEVELING };
     struct lsm_config {
         int level;  // Not used
-        uint32_t max_file = UINT32_MAX;
+        uint32_t max_file = UINT32_MAX;  // Only level-0 is sized by its file count
 // #define PROB4
 #ifdef PROB4
         enum level_type type = level_type::TIERING;
@@ -62,21 +184,141 @@ private:
 
     const std::string data_dir;  // No ending '/'
     uint64_t cur_ts;             // Current time stamp.
-    std::unique_ptr<mtb_type> mtb_ptr;
-    std::vector<sst::sst_cache> caches; // Ordered by timestamp (ascending)
+    std::shared_ptr<mtb_type> mtb_ptr;  // Shared with the iterators reading it
+    std::vector<sst::cache_ptr> caches;  // Ordered by timestamp (ascending)
+    // Compacted caches whose ssts are removed once no iterator reads them
+    std::vector<sst::cache_ptr> obsolete;
     std::vector<lsm_config> strategy;
+    const lsm::options opts;
+    std::vector<key_type> compact_cursor;  // Per level, where the next round-robin pick starts
+    compaction_stats stats;
+    lsm::seq_type last_seq;  // Sequence number of the last write
+    // Sequence numbers of the live snapshots, shared with their handles
+    std::shared_ptr<mtb_type::snapshot_list> snapshots;
+    // Guards the changes of `snapshots`, which background compactions read
+    std::shared_ptr<std::mutex> snapshots_mutex;
+    std::unique_ptr<io::read_engine> reader;  // Serves the reads of `multi_get`
+    std::unique_ptr<io::rate_limiter> limiter;  // Paces flushes and compactions, if set
+    lsm::statistics *const statistics;          // `opts.statistics`, null if not set
+    // Holds the metadata of the deeper levels, if `opts.metadata_cache_bytes` is set
+    std::shared_ptr<sst::meta_cache> meta_cache;
+    // Values of the hot keys, if `opts.row_cache_bytes` is set. Guarded by `mutex`.
+    std::unique_ptr<lsm::row_cache> row_cache;
+    // The values moved out of the ssts, see `options::value_log_min_size`
+    std::unique_ptr<lsm::value_log> value_log;
+
+    // Guards the state shared with the background compaction. A compaction releases it while
+    // it merges, and keeps its inputs in `caches` until it installs the outputs.
+    mutable std::mutex mutex;
+    std::condition_variable compaction_cv;  // Wakes the background thread
+    std::condition_variable stall_cv;       // Signaled as compactions complete
+    bool needs_compaction;                  // A flush happened since the last check
+    bool is_compacting;
+    bool is_closing;
+    bool is_paused;               // See `pause_background_work`
+    std::exception_ptr bg_error;  // Thrown to the writes once a background compaction fails
+    uint64_t delay_debt_ns;       // Delay owed by slowed writes, slept once it adds up
+    // What `delay_write` reads, kept by `update_write_pressure` as `caches` change
+    std::size_t level0_runs;       // Level-0 files, or sorted runs under universal compaction
+    lsm::size_type pending_bytes;  // See `pending_compaction_bytes`
+    std::thread bg_thread;
 
     static constexpr std::size_t MEMORY_MAXSIZE = 2 * 1024 * 1024; /* 2 MB */
-    static const value_type DeleteNote;                            /* ~DELETE~ */
 
     /**
-     * @brief The flow to be implemented when `put` or `delete` (aka put `"~DELETED~"`)
+     * @brief The flow to be implemented when `put` or `delete` (aka write a tombstone)
      *        operation will overflow the memory table size.
      */
     void handle_sst();
 
-    void check_level(int level);
+    // Build the range filter of a new cache if the options ask for one, then pin its metadata
+    // or leave it to `meta_cache`, by its level.
+    void place_metadata(sst::sst_cache &cache);
+
+    // Copy the memory table before a write if an iterator reads it.
+    void own_memtable();
+
+    static bool cache_less(const sst::cache_ptr &c1, const sst::cache_ptr &c2) {
+        return *c1 < *c2;
+    }
+
+    void sort_caches();
+
+    // Remove the ssts of the retired caches, or keep them until no iterator reads them.
+    void remove_files(std::vector<sst::cache_ptr> &retired);
+
+    // An iterator over the keys in [lower, upper], which leaves out the ssts holding none.
+    lsm::iterator new_iterator(lsm::seq_type snapshot, key_type lower = 0,
+                               key_type upper = UINT64_MAX);
+
+    // Compact the level with the highest score until every level is within its target.
+    void check_level();
+
+    void background_work();
+
+    // Collect the segments of the value log with enough garbage, see `value_log`. Only the
+    // newest version of a key is moved: its pointer is written again with its sequence number,
+    // which shadows the old one. The store is unlocked while the segments are read and written.
+    void collect_value_log();
+
+    // The sequence number of the oldest live snapshot, `lsm::MAX_SEQ` if there is none.
+    lsm::seq_type oldest_snapshot() const;
+
+    // Delay or block a write of `bytes` while compaction is behind, see `options`.
+    void delay_write(std::unique_lock<std::mutex> &lock, lsm::size_type bytes);
+
+    // Recount the write pressure once a flush or a compaction has changed `caches`.
+    void update_write_pressure();
+
+    std::vector<level_summary> summarize_levels() const;
+
+    std::vector<sorted_run> collect_sorted_runs() const;
+
+    lsm::size_type pending_compaction_bytes() const;
 
     void compact(int l1, int l2);
 
+    // Merge the selected caches into `level` and account the compaction in `stats`. The store
+    // is unlocked while the merge reads and writes, and the inputs stay in `caches` meanwhile.
+    void merge(std::vector<sst::cache_ptr> &selected, int level,
+               const sst::overlap_predicate &overlaps_older,
+               const std::vector<sst::file_boundary> &grandparents = {});
+
+    // Whether any cache `is_older` than the compaction inputs may hold keys in a range.
+    // The predicate holds its own list of those caches.
+    sst::overlap_predicate overlaps_older(std::function<bool(const sst::sst_cache &)> is_older,
+                                          const std::vector<sst::cache_ptr> &inputs) const;
+
+    // Find the newest record of the key visible at `snapshot`. The flag is false if no record
+    // exists.
+    std::pair<lsm::record, bool> lookup(key_type key,
+                                        lsm::seq_type snapshot = lsm::MAX_SEQ) const;
+
+    // `lookup` for a batch of keys, reading from each sst level by level in one batch.
+    std::vector<std::pair<lsm::record, bool>> multi_lookup(const std::vector<key_type> &keys,
+                                                           lsm::seq_type snapshot);
+
+    /**
+     * @brief Pick the runs `[first, last)` (newest first) of a universal compaction.
+     * @return false if no compaction is needed.
+     */
+    bool pick_sorted_runs(const std::vector<sorted_run> &runs, std::size_t &first,
+                          std::size_t &last) const;
+
+    void compact_sorted_runs(const std::vector<sorted_run> &runs, std::size_t first,
+                             std::size_t last);
+
+    /**
+     * @brief Pick the single file of leveled level `l1` to be compacted into `l2`.
+     * @return the iterator of the picked cache in `caches`.
+     */
+    std::vector<sst::cache_ptr>::iterator pick_file(int l1, int l2);
+
+    /**
+     * @brief Whether the selected l1 inputs, overlapping nothing in l2, can be moved into l2
+     *        as they are. Sorts `selected` by key range.
+     */
+    bool is_trivial_move(std::vector<sst::cache_ptr> &selected,
+                         const std::vector<sst::file_boundary> &grandparents) const;
+
 };
@@ -0,0 +1,233 @@
+/**
+ * @file meta_cache.hpp
+ * @brief The bloom filters and indices of the ssts, held under a memory budget.
+ */
+#ifndef SST_META_CACHE
+#define SST_META_CACHE
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+#include "BloomFilter.hpp"
+#include "sst_index.hpp"
+#include "statistics.hpp"
+#include "types.hpp"
+
+namespace sst {
+
+// The bloom filter and the index of an sst.
+struct table_meta {
+    basic_ds::BloomFilter<lsm::BLF_SIZE> bft;
+    key_index indices;
+
+    // Bytes held in the memory.
+    lsm::size_type charge() const noexcept {
+        return bft.byte_size() + indices.memory_usage();
+    }
+};
+
+using meta_ptr = std::shared_ptr<const table_meta>;
+
+/**
+ * @brief Holds the metadata of ssts within `capacity` bytes, evicting the least recently used.
+ *        The pinned metadata is charged too, and is never evicted: the cached one makes room
+ *        for it. The methods may be called from several threads.
+ */
+class meta_cache {
+public:
+    struct stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;  // Metadata read again from the ssts
+        uint64_t evictions = 0;
+    };
+
+    /**
+     * @param index_opts how the indices read again are laid out.
+     * @param statistics counts the hits and the misses, if not null.
+     */
+    meta_cache(lsm::size_type capacity, const lsm::index_options &index_opts,
+               lsm::statistics *statistics = nullptr)
+        : capacity(capacity),
+          index_opts(index_opts),
+          statistics(statistics),
+          pinned_bytes(0),
+          cached_bytes(0),
+          next_id(0) {}
+
+    meta_cache(const meta_cache &) = delete;
+    meta_cache &operator=(const meta_cache &) = delete;
+
+    const lsm::index_options &index_options() const noexcept {
+        return index_opts;
+    }
+
+    // A fresh id for the metadata of an sst.
+    uint64_t new_id() noexcept {
+        return ++next_id;
+    }
+
+    // The metadata of the id, null if it was evicted.
+    meta_ptr lookup(uint64_t id) {
+        std::lock_guard<std::mutex> lock{mutex};
+        auto it = index.find(id);
+        if (it == index.end()) {
+            ++counters.misses;
+            count(lsm::METADATA_CACHE_MISS);
+            return nullptr;
+        }
+        ++counters.hits;
+        count(lsm::METADATA_CACHE_HIT);
+        lru.splice(lru.begin(), lru, it->second);
+        return it->second->second;
+    }
+
+    void insert(uint64_t id, meta_ptr meta) {
+        std::lock_guard<std::mutex> lock{mutex};
+        auto it = index.find(id);
+        if (it != index.end()) {
+            cached_bytes -= it->second->second->charge();
+            lru.erase(it->second);
+        }
+        cached_bytes += meta->charge();
+        lru.emplace_front(id, std::move(meta));
+        index[id] = lru.begin();
+        evict();
+    }
+
+    void erase(uint64_t id) {
+        std::lock_guard<std::mutex> lock{mutex};
+        auto it = index.find(id);
+        if (it != index.end()) {
+            cached_bytes -= it->second->second->charge();
+            lru.erase(it->second);
+            index.erase(it);
+        }
+    }
+
+    void pin(lsm::size_type bytes) {
+        std::lock_guard<std::mutex> lock{mutex};
+        pinned_bytes += bytes;
+        evict();
+    }
+
+    void unpin(lsm::size_type bytes) {
+        std::lock_guard<std::mutex> lock{mutex};
+        pinned_bytes -= bytes;
+    }
+
+    // Bytes of the pinned and the cached metadata. It exceeds the capacity only if the pinned
+    // metadata does.
+    lsm::size_type usage() const {
+        std::lock_guard<std::mutex> lock{mutex};
+        return pinned_bytes + cached_bytes;
+    }
+
+    lsm::size_type pinned_usage() const {
+        std::lock_guard<std::mutex> lock{mutex};
+        return pinned_bytes;
+    }
+
+    stats get_stats() const {
+        std::lock_guard<std::mutex> lock{mutex};
+        return counters;
+    }
+
+private:
+    using entry = std::pair<uint64_t, meta_ptr>;
+
+    const lsm::size_type capacity;
+    const lsm::index_options index_opts;
+    lsm::statistics *const statistics;
+    mutable std::mutex mutex;
+    std::list<entry> lru;  // From the most recently used
+    std::unordered_map<uint64_t, std::list<entry>::iterator> index;
+    lsm::size_type pinned_bytes, cached_bytes;
+    stats counters;
+    std::atomic<uint64_t> next_id;
+
+    // The metadata evicted is freed once its readers are done with it.
+    void evict() {
+        while (pinned_bytes + cached_bytes > capacity && !lru.empty()) {
+            cached_bytes -= lru.back().second->charge();
+            index.erase(lru.back().first);
+            lru.pop_back();
+            ++counters.evictions;
+        }
+    }
+
+    void count(lsm::ticker t) noexcept {
+        if (statistics) {
+            statistics->add(t);
+        }
+    }
+};
+
+/**
+ * @brief The metadata of an sst, either pinned or held by a `meta_cache`. The copies of an
+ *        sst cache share the handle, and the cache forgets the metadata with the last of them.
+ */
+class meta_handle {
+public:
+    // Pinned, and charged to `cache` if any.
+    explicit meta_handle(meta_ptr meta, std::shared_ptr<meta_cache> cache = nullptr)
+        : cache(std::move(cache)), pinned(std::move(meta)), id(0) {
+        if (this->cache) {
+            this->cache->pin(pinned->charge());
+        }
+    }
+
+    // Held by `cache`, starting with `meta`.
+    meta_handle(std::shared_ptr<meta_cache> cache, meta_ptr meta)
+        : cache(std::move(cache)), id(this->cache->new_id()) {
+        this->cache->insert(id, std::move(meta));
+    }
+
+    meta_handle(const meta_handle &) = delete;
+    meta_handle &operator=(const meta_handle &) = delete;
+
+    ~meta_handle() {
+        if (!cache) {
+            return;
+        }
+        if (pinned) {
+            cache->unpin(pinned->charge());
+        } else {
+            cache->erase(id);
+        }
+    }
+
+    bool is_pinned() const noexcept {
+        return pinned != nullptr;
+    }
+
+    const std::shared_ptr<meta_cache> &owner() const noexcept {
+        return cache;
+    }
+
+    // The metadata, read by `load()` and cached again if it was evicted.
+    template <typename Loader>
+    meta_ptr get(Loader &&load) const {
+        if (pinned) {
+            return pinned;
+        }
+        if (auto meta = cache->lookup(id)) {
+            return meta;
+        }
+        meta_ptr meta = load();
+        cache->insert(id, meta);
+        return meta;
+    }
+
+private:
+    std::shared_ptr<meta_cache> cache;
+    meta_ptr pinned;
+    uint64_t id;
+};
+
+}  // namespace sst
+
+#endif
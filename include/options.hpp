@@ -0,0 +1,132 @@
+/**
+ * @file options.hpp
+ * @brief Tunable knobs of the `KVStore`.
+ */
+#ifndef LSM_OPTIONS
+#define LSM_OPTIONS
+
+#include <functional>
+#include <limits>
+#include <memory>
+#include <string>
+
+#include "types.hpp"
+
+namespace lsm {
+
+class statistics;
+
+enum class compaction_style {
+    LEVEL,      // Leveled levels below a tiered level-0, see `KVStore::check_level`.
+    UNIVERSAL,  // A bounded number of sorted runs in level-0, merged by their sizes.
+};
+
+// How a leveled compaction picks its single input file from the upper level.
+enum class compaction_pri {
+    ROUND_ROBIN,            // Walk the key space with a per-level cursor.
+    MIN_OVERLAPPING_RATIO,  // The file with least bytes overlapped in the next level.
+};
+
+struct options {
+    compaction_style style = compaction_style::LEVEL;
+
+    compaction_pri pri = compaction_pri::ROUND_ROBIN;
+
+    // Cut a compaction output once it overlaps this many bytes in the level after the
+    // output level, so that a later compaction of that output stays bounded.
+    size_type max_grandparent_overlap_bytes = 10 * MTB_MAXSIZE;
+
+    // A compaction is split into up to this many key ranges, each merged by its own thread, as
+    // long as every range gets about `min_subcompaction_bytes` of the inputs. With 0, every
+    // compaction is split into `max_subcompactions` ranges.
+    size_type max_subcompactions = 1;
+    size_type min_subcompaction_bytes = 4 * MTB_MAXSIZE;
+
+    // Level targets in bytes. Each level below the base level targets
+    // `max_bytes_for_level_multiplier` times the bytes of the level above it.
+    size_type max_bytes_for_level_base = 4 * MTB_MAXSIZE;
+    double max_bytes_for_level_multiplier = 10;
+
+    // Derive the targets backwards from the size of the last level. Level-0 then compacts into
+    // the first level that is due, and the bytes above the last level stay within about
+    // 1 / multiplier of it.
+    bool level_compaction_dynamic_level_bytes = true;
+
+    // Universal compaction starts once there are this many sorted runs, and merges the newest
+    // runs when no other rule applies.
+    size_type universal_max_sorted_runs = 8;
+    // A run joins the candidates if it is at most `size_ratio` percent larger than them.
+    size_type universal_size_ratio = 1;
+    size_type universal_min_merge_width = 2;
+    size_type universal_max_merge_width = std::numeric_limits<unsigned>::max();
+    // Merge all runs once the newer runs exceed this percent of the oldest run.
+    size_type universal_max_size_amplification_percent = 200;
+
+    // Sst reads a `multi_get` keeps in flight. They go through io_uring where the kernel
+    // supports it, or else through as many threads.
+    size_type read_queue_depth = 32;
+    bool use_io_uring = true;
+
+    // Bytes per second that flushes and compactions may read and write together, 0 for no
+    // limit. Auto-tuning lowers the limit while foreground reads are slower than usual.
+    size_type rate_limit_bytes_per_sec = 0;
+    bool rate_limit_auto_tune = false;
+
+    // Compact in a background thread, instead of inside the write that fills the memory table.
+    bool background_compaction = false;
+
+    // Writes slow down once compaction falls behind, and stop until it catches up at the hard
+    // limits. Level-0 is measured in files, or in sorted runs for universal compaction.
+    // Only background compaction can fall behind.
+    size_type level0_slowdown_writes_trigger = 20;
+    size_type level0_stop_writes_trigger = 36;
+    size_type soft_pending_compaction_bytes_limit = 64 * MTB_MAXSIZE;
+    size_type hard_pending_compaction_bytes_limit = 256 * MTB_MAXSIZE;
+    // Bytes per second written past the soft limits. The rate falls towards 1/16 of it as the
+    // hard limits get closer.
+    size_type delayed_write_rate = 16 * 1024 * 1024;
+
+    // How the index of each sst is laid out in the memory. A `LEARNED` index suits keys that
+    // are dense or evenly spread.
+    index_options sst_index;
+
+    // Bytes the bloom filters and indices of the ssts may take together, 0 for no limit. Past
+    // it, the metadata of the levels from `pinned_metadata_levels` on is evicted, and read
+    // again from its sst when a lookup needs it. The pinned metadata is charged too, but is
+    // never evicted.
+    size_type metadata_cache_bytes = 0;
+    int pinned_metadata_levels = 2;
+
+    // Bytes of the row cache, which keeps the values of the keys `get` reads most often, 0 for
+    // none. A key is admitted only if it is used more often than the one it would evict, so
+    // that scans through cold keys leave the hot ones cached.
+    size_type row_cache_bytes = 0;
+
+    // Bits per key prefix of the range filters, which let a scan skip the ssts holding no key
+    // in its range, 0 for none. They stay in the memory: about this many bits a key when the
+    // keys are dense, and up to 8 times as many when they spread over the whole key space.
+    size_type range_filter_bits_per_prefix = 0;
+
+    // Values of at least this many bytes are moved to the value log as the memory table is
+    // flushed, and the ssts hold where they lie instead, 0 for none. Compactions then rewrite
+    // the keys and these pointers only, while a read of such a value takes one more read.
+    size_type value_log_min_size = 0;
+    // A segment of the value log is garbage collected once compactions have dropped this share
+    // of its bytes: its live values are written to a new segment, and it is removed.
+    double value_log_gc_ratio = 0.5;
+
+    // Counters and latency histograms of the operations, none if null. A `statistics` may be
+    // shared by several stores.
+    std::shared_ptr<lsm::statistics> statistics;
+
+    // Log the operations slower than this, with the steps they took (see `perf_context`),
+    // 0 for none. Meanwhile the operations record at `perf_level::ENABLE_TIME`, and a thread
+    // whose perf context is disabled finds it unchanged afterwards.
+    size_type slow_op_threshold_us = 0;
+    // Receives the lines of the log, written to stderr if empty.
+    std::function<void(const std::string &)> slow_op_logger;
+};
+
+}  // namespace lsm
+
+#endif
@@ -0,0 +1,144 @@
+/**
+ * @file perf_context.hpp
+ * @brief Per-thread counts and timings of the steps of the operations, to tell why one of them
+ *        was slow.
+ */
+#ifndef LSM_PERF_CONTEXT
+#define LSM_PERF_CONTEXT
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <utility>
+
+namespace lsm {
+
+enum class perf_level {
+    DISABLE,       // Record nothing
+    ENABLE_COUNT,  // Count the steps
+    ENABLE_TIME,   // Count and time the steps
+};
+
+/**
+ * @brief What the operations of the thread have done since the last `reset`. Only the steps
+ *        run by the calling thread are recorded: neither the background compaction nor the
+ *        workers of a read engine add to it.
+ */
+struct perf_context {
+    uint64_t memtable_lookups = 0;
+    uint64_t memtable_nanos = 0;
+    uint64_t sst_searches = 0;    // Keys searched in an sst, in its key range or not
+    uint64_t filter_probes = 0;   // Searches in the key range, checked by the bloom filter
+    uint64_t filter_passes = 0;   // Probes the filter let through
+    uint64_t index_searches = 0;  // Binary searches of the indices after the filter passed
+    uint64_t index_nanos = 0;
+    uint64_t file_opens = 0;
+    uint64_t block_reads = 0;     // Positional reads of the records of a key
+    uint64_t bytes_read = 0;
+    uint64_t read_nanos = 0;
+
+    void reset() noexcept {
+        *this = perf_context{};
+    }
+
+    // The steps recorded after `before` was copied.
+    perf_context operator-(const perf_context &before) const noexcept {
+        perf_context delta;
+        for (const auto &field : fields()) {
+            delta.*field.second = this->*field.second - before.*field.second;
+        }
+        return delta;
+    }
+
+    // `name = value` pairs separated by ", ". The zero ones are left out if `exclude_zero`.
+    std::string to_string(bool exclude_zero = true) const {
+        std::ostringstream os;
+        const char *sep = "";
+        for (const auto &field : fields()) {
+            if (!exclude_zero || this->*field.second != 0) {
+                os << sep << field.first << " = " << this->*field.second;
+                sep = ", ";
+            }
+        }
+        return os.str();
+    }
+
+private:
+    using field_type = std::pair<const char *, uint64_t perf_context::*>;
+
+    static const std::array<field_type, 11> &fields() noexcept {
+        static const std::array<field_type, 11> all{{
+            {"memtable_lookups", &perf_context::memtable_lookups},
+            {"memtable_nanos", &perf_context::memtable_nanos},
+            {"sst_searches", &perf_context::sst_searches},
+            {"filter_probes", &perf_context::filter_probes},
+            {"filter_passes", &perf_context::filter_passes},
+            {"index_searches", &perf_context::index_searches},
+            {"index_nanos", &perf_context::index_nanos},
+            {"file_opens", &perf_context::file_opens},
+            {"block_reads", &perf_context::block_reads},
+            {"bytes_read", &perf_context::bytes_read},
+            {"read_nanos", &perf_context::read_nanos},
+        }};
+        static_assert(sizeof(perf_context) == 11 * sizeof(uint64_t),
+                      "A field of the perf context has no name");
+        return all;
+    }
+};
+
+inline perf_level &thread_perf_level() noexcept {
+    static thread_local perf_level level = perf_level::DISABLE;
+    return level;
+}
+
+inline perf_level get_perf_level() noexcept {
+    return thread_perf_level();
+}
+
+// The level of the calling thread.
+inline void set_perf_level(perf_level level) noexcept {
+    thread_perf_level() = level;
+}
+
+// The context of the calling thread.
+inline perf_context &get_perf_context() noexcept {
+    static thread_local perf_context context;
+    return context;
+}
+
+inline void perf_add(uint64_t perf_context::*field, uint64_t n = 1) noexcept {
+    if (thread_perf_level() >= perf_level::ENABLE_COUNT) {
+        get_perf_context().*field += n;
+    }
+}
+
+// Adds the time from its construction to its destruction to a field, at `ENABLE_TIME`.
+class perf_timer {
+    using clock = std::chrono::steady_clock;
+
+public:
+    explicit perf_timer(uint64_t perf_context::*field) noexcept
+        : field(thread_perf_level() >= perf_level::ENABLE_TIME ? field : nullptr),
+          start(this->field ? clock::now() : clock::time_point{}) {}
+
+    ~perf_timer() {
+        if (field) {
+            get_perf_context().*field +=
+                std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start)
+                    .count();
+        }
+    }
+
+    perf_timer(const perf_timer &) = delete;
+    perf_timer &operator=(const perf_timer &) = delete;
+
+private:
+    uint64_t perf_context::*field;
+    clock::time_point start;
+};
+
+}  // namespace lsm
+
+#endif
@@ -0,0 +1,125 @@
+/**
+ * @file range_filter.hpp
+ * @brief A filter over the key ranges of an sst, which lets a scan skip the ssts with no keys
+ *        in its range.
+ */
+#ifndef SST_RANGE_FILTER
+#define SST_RANGE_FILTER
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "types.hpp"
+
+namespace sst {
+
+/**
+ * @brief A bloom filter of the key prefixes of an sst, at every `SHIFT_STEP` bits from the whole
+ *        key down to its top byte. A range is checked at the finest level where it spans at
+ *        most `MAX_PROBES` prefixes, so that a short range is checked almost key by key and a
+ *        wide one by a few coarse prefixes. It has no false negatives.
+ *
+ *        Dense keys share their high prefixes, so that a filter costs about `bits_per_prefix`
+ *        bits a key for them, and up to `LEVELS` times as much for keys spread over the whole
+ *        key space.
+ */
+class range_filter {
+public:
+    static constexpr int SHIFT_STEP = 8;
+    static constexpr int LEVELS = 64 / SHIFT_STEP;
+    static constexpr uint64_t MAX_PROBES = 8;
+
+    // A filter which passes every range.
+    range_filter() : hashes(0) {}
+
+    // `keys` sorted, repeats allowed.
+    range_filter(const std::vector<lsm::key_type> &keys, lsm::size_type bits_per_prefix)
+        : hashes(std::min<lsm::size_type>(std::max<lsm::size_type>(bits_per_prefix * 69 / 100, 1),
+                                          16)) {
+        lsm::size_type prefixes = 0;
+        for (int level = 0; level < LEVELS; ++level) {
+            for_each_prefix(keys, level, [&](uint64_t) { ++prefixes; });
+        }
+        lsm::size_type words = (std::max<lsm::size_type>(prefixes * bits_per_prefix, 64) + 63) / 64;
+        table.assign(words, 0);
+        for (int level = 0; level < LEVELS; ++level) {
+            for_each_prefix(keys, level, [&](uint64_t prefix) { insert(prefix, level); });
+        }
+    }
+
+    // Whether the sst may hold a key in [first, last]. False only if it holds none.
+    bool may_contain(lsm::key_type first, lsm::key_type last) const noexcept {
+        if (table.empty()) {
+            return true;
+        }
+        for (int level = 0; level < LEVELS; ++level) {
+            int shift = level * SHIFT_STEP;
+            uint64_t lo = first >> shift, hi = last >> shift;
+            if (hi - lo >= MAX_PROBES) {
+                continue;
+            }
+            for (uint64_t prefix = lo;; ++prefix) {
+                if (contains(prefix, level)) {
+                    return true;
+                }
+                if (prefix == hi) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    lsm::size_type byte_size() const noexcept {
+        return table.size() * sizeof(uint64_t);
+    }
+
+private:
+    std::vector<uint64_t> table;
+    lsm::size_type hashes;
+
+    // Call `f` on each distinct prefix of the level, in order.
+    template <typename F>
+    static void for_each_prefix(const std::vector<lsm::key_type> &keys, int level, F &&f) {
+        int shift = level * SHIFT_STEP;
+        for (std::size_t i = 0; i < keys.size(); ++i) {
+            if (i == 0 || keys[i] >> shift != keys[i - 1] >> shift) {
+                f(keys[i] >> shift);
+            }
+        }
+    }
+
+    // The finalizer of splitmix64, salted by the level.
+    static uint64_t hash(uint64_t prefix, int level) noexcept {
+        uint64_t x = prefix + 0x9e3779b97f4a7c15 * (level + 1);
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+        return x ^ (x >> 31);
+    }
+
+    void insert(uint64_t prefix, int level) noexcept {
+        uint64_t h = hash(prefix, level), step = (h >> 32) | 1;
+        uint64_t bits = table.size() * 64;
+        for (lsm::size_type i = 0; i < hashes; ++i, h += step) {
+            uint64_t bit = h % bits;
+            table[bit / 64] |= uint64_t{1} << (bit % 64);
+        }
+    }
+
+    bool contains(uint64_t prefix, int level) const noexcept {
+        uint64_t h = hash(prefix, level), step = (h >> 32) | 1;
+        uint64_t bits = table.size() * 64;
+        for (lsm::size_type i = 0; i < hashes; ++i, h += step) {
+            uint64_t bit = h % bits;
+            if (!(table[bit / 64] >> (bit % 64) & 1)) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+}  // namespace sst
+
+#endif
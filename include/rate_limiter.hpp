@@ -0,0 +1,146 @@
+/**
+ * @file rate_limiter.hpp
+ * @brief A token bucket bounding the bytes per second of background I/O.
+ */
+#ifndef LSM_RATE_LIMITER
+#define LSM_RATE_LIMITER
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+namespace io {
+
+constexpr uint64_t REFILL_PERIOD_US = 100'000;
+// Auto-tuning keeps the rate above this fraction of the configured rate
+constexpr uint64_t MIN_RATE_DIVISOR = 20;
+// A tune period slower than this times the average latency counts as elevated
+constexpr double LATENCY_TOLERANCE = 1.5;
+
+/**
+ * @brief Flushes and compactions ask it before each read or write, and wait until the
+ *        bucket holds enough tokens. The bucket is refilled every `REFILL_PERIOD_US` with the
+ *        bytes of a period, and does not save unused tokens beyond that.
+ *
+ *        With auto-tuning, the foreground reads report their latency. At the end of each tune
+ *        period, a latency well above its long-run average halves the rate, down to
+ *        1 / `MIN_RATE_DIVISOR` of the configured rate. Otherwise the rate climbs back by a
+ *        fixed step, up to the configured rate.
+ */
+class rate_limiter {
+    using clock = std::chrono::steady_clock;
+
+public:
+    struct stats {
+        uint64_t bytes = 0;             // Bytes let through
+        uint64_t requests = 0;
+        uint64_t waits = 0;             // Times a request waited for tokens
+        uint64_t wait_us = 0;           // Time spent waiting
+        uint64_t bytes_per_second = 0;  // The current rate
+        uint64_t decreases = 0;         // Times auto-tuning lowered the rate
+        double average_latency_ns = 0;  // Long-run foreground read latency seen by auto-tuning
+    };
+
+    /**
+     * @param bytes_per_second the rate, the highest one if auto-tuned.
+     * @param tune_period how often auto-tuning looks at the read latency.
+     */
+    explicit rate_limiter(uint64_t bytes_per_second, bool is_auto_tuned = false,
+                          std::chrono::microseconds tune_period = std::chrono::seconds{1})
+        : max_rate(std::max<uint64_t>(bytes_per_second, 1)),
+          is_auto_tuned(is_auto_tuned),
+          tune_period(tune_period),
+          available(0),
+          next_refill(clock::now()),
+          next_tune(clock::now() + tune_period),
+          latency_sum(0),
+          latency_count(0) {
+        counters.bytes_per_second = max_rate;
+    }
+
+    rate_limiter(const rate_limiter &) = delete;
+    rate_limiter &operator=(const rate_limiter &) = delete;
+
+    // Block until `bytes` may be read or written. A large request passes in several periods.
+    void request(uint64_t bytes) {
+        std::unique_lock<std::mutex> lock{mutex};
+        ++counters.requests;
+        bool has_waited = false;
+        while (bytes > 0) {
+            auto now = clock::now();
+            if (now >= next_refill) {
+                available = counters.bytes_per_second * REFILL_PERIOD_US / 1'000'000;
+                available = std::max<uint64_t>(available, 1);
+                next_refill = now + std::chrono::microseconds{REFILL_PERIOD_US};
+            }
+            uint64_t granted = std::min(bytes, available);
+            available -= granted;
+            bytes -= granted;
+            counters.bytes += granted;
+            if (bytes == 0) {
+                break;
+            }
+            if (!has_waited) {
+                ++counters.waits;
+                has_waited = true;
+            }
+            auto until = next_refill;
+            lock.unlock();
+            std::this_thread::sleep_until(until);
+            lock.lock();
+            counters.wait_us += std::chrono::duration_cast<std::chrono::microseconds>(
+                                    clock::now() - now)
+                                    .count();
+        }
+    }
+
+    // Report the latency of a foreground read. Ignored unless auto-tuned.
+    void record_latency(uint64_t latency_ns) {
+        if (!is_auto_tuned) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock{mutex};
+        latency_sum += latency_ns;
+        ++latency_count;
+        auto now = clock::now();
+        if (now < next_tune) {
+            return;
+        }
+        next_tune = now + tune_period;
+        double latency = static_cast<double>(latency_sum) / latency_count;
+        latency_sum = latency_count = 0;
+
+        double &average = counters.average_latency_ns;
+        uint64_t &rate = counters.bytes_per_second;
+        uint64_t step = std::max<uint64_t>(max_rate / MIN_RATE_DIVISOR, 1);
+        if (average > 0 && latency > LATENCY_TOLERANCE * average) {
+            rate = std::max(rate / 2, step);
+            ++counters.decreases;
+        } else {
+            rate = std::min(rate + step, max_rate);
+        }
+        // A slow moving average, so that a burst of slow reads stands out from it
+        average = average > 0 ? average + (latency - average) / 16 : latency;
+    }
+
+    stats get_stats() const {
+        std::lock_guard<std::mutex> lock{mutex};
+        return counters;
+    }
+
+private:
+    const uint64_t max_rate;
+    const bool is_auto_tuned;
+    const std::chrono::microseconds tune_period;
+    mutable std::mutex mutex;
+    uint64_t available;  // Tokens left in the current period
+    clock::time_point next_refill, next_tune;
+    uint64_t latency_sum, latency_count;  // Latency reports in the current tune period
+    stats counters;
+};
+
+}  // namespace io
+
+#endif
@@ -0,0 +1,327 @@
+/**
+ * @file read_engine.hpp
+ * @brief Batches of positional reads kept in flight together, so that the device serves many
+ *        of them at once instead of one after another.
+ */
+#ifndef LSM_READ_ENGINE
+#define LSM_READ_ENGINE
+
+#include <sys/uio.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "io.hpp"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define LSM_HAS_IO_URING
+#endif
+
+namespace io {
+
+struct read_request {
+    int fd;
+    uint64_t offset;
+    std::string data;  // Sized to the bytes to read before the request is submitted
+    bool ok;           // Whether every byte was read
+};
+
+/**
+ * @brief Reads a batch of requests with up to `depth()` of them in flight, completing them in
+ *        any order. An engine serves one batch at a time.
+ */
+class read_engine {
+public:
+    explicit read_engine(std::size_t depth) : queue_depth(std::max<std::size_t>(depth, 1)) {}
+    virtual ~read_engine() = default;
+
+    virtual const char *name() const noexcept = 0;
+
+    std::size_t depth() const noexcept {
+        return queue_depth;
+    }
+
+    // Returns once every request is complete.
+    virtual void read_all(std::vector<read_request> &requests) = 0;
+
+protected:
+    std::size_t queue_depth;
+
+    // Read what is left of a request after a short read, or all of it.
+    static void finish(read_request &req, std::size_t done) noexcept {
+        req.ok = done == req.data.size() ||
+                 read_full(req.fd, &req.data[done], req.data.size() - done,
+                           req.offset + done) == static_cast<ssize_t>(req.data.size() - done);
+    }
+};
+
+// Blocking reads spread over `depth` worker threads.
+class thread_pool_engine final : public read_engine {
+public:
+    explicit thread_pool_engine(std::size_t depth)
+        : read_engine(depth),
+          batch(nullptr),
+          next(0),
+          pending(0),
+          active(0),
+          generation(0),
+          is_stopped(false) {
+        for (std::size_t i = 0; i < queue_depth; ++i) {
+            workers.emplace_back([this] { work(); });
+        }
+    }
+
+    ~thread_pool_engine() {
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            is_stopped = true;
+        }
+        wake.notify_all();
+        for (auto &worker : workers) {
+            worker.join();
+        }
+    }
+
+    const char *name() const noexcept override {
+        return "thread-pool";
+    }
+
+    void read_all(std::vector<read_request> &requests) override {
+        if (requests.empty()) {
+            return;
+        }
+        std::unique_lock<std::mutex> lock{mutex};
+        batch = &requests;
+        next = 0;
+        pending = requests.size();
+        ++generation;
+        wake.notify_all();
+        done.wait(lock, [this] { return pending == 0 && active == 0; });
+        batch = nullptr;
+    }
+
+private:
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    std::vector<read_request> *batch;
+    std::atomic<std::size_t> next;  // The first request no worker has taken
+    // Guarded by `mutex`: requests not complete yet, and workers still in the batch
+    std::size_t pending, active;
+    uint64_t generation;  // Counts the batches, so that a worker joins each once
+    bool is_stopped;
+
+    void work() {
+        uint64_t seen = 0;
+        while (true) {
+            std::vector<read_request> *requests;
+            {
+                std::unique_lock<std::mutex> lock{mutex};
+                wake.wait(lock, [&] { return is_stopped || (batch && generation != seen); });
+                if (is_stopped) {
+                    return;
+                }
+                seen = generation;
+                requests = batch;
+                ++active;
+            }
+            std::size_t completed = 0;
+            for (std::size_t i; (i = next.fetch_add(1)) < requests->size(); ++completed) {
+                finish((*requests)[i], 0);
+            }
+            std::lock_guard<std::mutex> lock{mutex};
+            pending -= completed;
+            if (--active == 0 && pending == 0) {
+                done.notify_one();
+            }
+        }
+    }
+};
+
+#ifdef LSM_HAS_IO_URING
+/**
+ * @brief Reads submitted to an io_uring and reaped as they complete, all from the calling
+ *        thread. It talks to the kernel by the raw system calls, as liburing is not required.
+ */
+class uring_engine final : public read_engine {
+public:
+    // Returns: null if the kernel does not support io_uring.
+    static std::unique_ptr<uring_engine> create(std::size_t depth) {
+        std::unique_ptr<uring_engine> engine{new uring_engine(depth)};
+        if (!engine->setup()) {
+            return nullptr;
+        }
+        return engine;
+    }
+
+    ~uring_engine() {
+        if (sq_ring != MAP_FAILED) {
+            ::munmap(sq_ring, sq_ring_size);
+        }
+        if (cq_ring != MAP_FAILED && cq_ring != sq_ring) {
+            ::munmap(cq_ring, cq_ring_size);
+        }
+        if (sqes != MAP_FAILED) {
+            ::munmap(sqes, sqes_size);
+        }
+        if (ring_fd >= 0) {
+            ::close(ring_fd);
+        }
+    }
+
+    const char *name() const noexcept override {
+        return "io_uring";
+    }
+
+    void read_all(std::vector<read_request> &requests) override {
+        std::vector<iovec> iovs(requests.size());
+        std::size_t submitted = 0, completed = 0, in_flight = 0;
+        while (completed < requests.size()) {
+            // Fill the submission queue up to the depth
+            unsigned tail = *sq_tail;
+            while (submitted < requests.size() && in_flight < queue_depth) {
+                read_request &req = requests[submitted];
+                iovs[submitted] = {&req.data[0], req.data.size()};
+                unsigned index = tail & *sq_mask;
+                io_uring_sqe &sqe = sqes[index];
+                std::memset(&sqe, 0, sizeof sqe);
+                sqe.opcode = IORING_OP_READV;
+                sqe.fd = req.fd;
+                sqe.addr = reinterpret_cast<uint64_t>(&iovs[submitted]);
+                sqe.len = 1;
+                sqe.off = req.offset;
+                sqe.user_data = submitted;
+                sq_array[index] = index;
+                ++tail, ++submitted, ++in_flight;
+            }
+            __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+            if (!enter()) {
+                throw std::runtime_error{std::string{"io_uring_enter: "} + std::strerror(errno)};
+            }
+
+            // Reap the completions
+            unsigned head = *cq_head;
+            while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+                const io_uring_cqe &cqe = cqes[head & *cq_mask];
+                read_request &req = requests[cqe.user_data];
+                if (cqe.res < 0) {
+                    req.ok = false;
+                } else {
+                    finish(req, cqe.res);
+                }
+                ++head, ++completed, --in_flight;
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        }
+    }
+
+private:
+    int ring_fd;
+    void *sq_ring, *cq_ring;
+    io_uring_sqe *sqes;
+    std::size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_cqe *cqes;
+
+    explicit uring_engine(std::size_t depth)
+        : read_engine(depth),
+          ring_fd(-1),
+          sq_ring(MAP_FAILED),
+          cq_ring(MAP_FAILED),
+          sqes(static_cast<io_uring_sqe *>(MAP_FAILED)) {}
+
+    bool setup() {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof params);
+        ring_fd = ::syscall(__NR_io_uring_setup, static_cast<unsigned>(queue_depth), &params);
+        if (ring_fd < 0) {
+            return false;
+        }
+        // The kernel rounds the entries up to a power of two
+        queue_depth = std::min<std::size_t>(queue_depth, params.sq_entries);
+
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool is_single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (is_single_mmap) {
+            sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+        }
+        sq_ring = ::mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (sq_ring == MAP_FAILED) {
+            return false;
+        }
+        cq_ring = is_single_mmap ? sq_ring
+                                 : ::mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            return false;
+        }
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe *>(::mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                                                  MAP_SHARED | MAP_POPULATE, ring_fd,
+                                                  IORING_OFF_SQES));
+        if (sqes == MAP_FAILED) {
+            return false;
+        }
+
+        char *sq = static_cast<char *>(sq_ring), *cq = static_cast<char *>(cq_ring);
+        sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    // Submit the queued entries and wait for at least one completion.
+    bool enter() {
+        while (true) {
+            unsigned to_submit = *sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+            int res = ::syscall(__NR_io_uring_enter, ring_fd, to_submit, 1,
+                                IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (res >= 0) {
+                return true;
+            }
+            if (errno != EINTR) {
+                return false;
+            }
+        }
+    }
+};
+#endif
+
+enum class engine_kind {
+    AUTO,         // io_uring if the kernel supports it, or else a thread pool
+    THREAD_POOL,
+};
+
+inline std::unique_ptr<read_engine> make_read_engine(std::size_t depth,
+                                                     engine_kind kind = engine_kind::AUTO) {
+#ifdef LSM_HAS_IO_URING
+    if (kind == engine_kind::AUTO) {
+        if (auto engine = uring_engine::create(depth)) {
+            return engine;
+        }
+    }
+#endif
+    return std::make_unique<thread_pool_engine>(depth);
+}
+
+}  // namespace io
+
+#endif
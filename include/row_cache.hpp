@@ -0,0 +1,255 @@
+/**
+ * @file row_cache.hpp
+ * @brief The latest values of hot keys, kept in front of the memory table and the ssts.
+ */
+#ifndef LSM_ROW_CACHE
+#define LSM_ROW_CACHE
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "types.hpp"
+
+namespace lsm {
+
+/**
+ * @brief Estimates how often each key was used lately, with a count-min sketch of saturating
+ *        counters. The counters are halved once they have been added to `10 * width` times,
+ *        so that the keys which were hot long ago fade out.
+ */
+class frequency_sketch {
+public:
+    static constexpr int DEPTH = 4;
+    static constexpr uint8_t MAX_COUNT = 15;
+
+    // `width` counters a row, rounded up to a power of two.
+    explicit frequency_sketch(size_type width) : mask(1), additions(0) {
+        while (mask < width) {
+            mask <<= 1;
+        }
+        table.assign(DEPTH * mask, 0);
+        sample_size = 10 * mask;
+        --mask;
+    }
+
+    void add(uint64_t key) noexcept {
+        uint64_t h = mix(key);
+        for (int i = 0; i < DEPTH; ++i) {
+            uint8_t &counter = table[slot(h, i)];
+            counter += counter < MAX_COUNT;
+        }
+        if (++additions == sample_size) {
+            for (auto &counter : table) {
+                counter >>= 1;
+            }
+            additions /= 2;
+        }
+    }
+
+    uint8_t frequency(uint64_t key) const noexcept {
+        uint64_t h = mix(key);
+        uint8_t count = MAX_COUNT;
+        for (int i = 0; i < DEPTH; ++i) {
+            count = std::min(count, table[slot(h, i)]);
+        }
+        return count;
+    }
+
+    void clear() noexcept {
+        std::fill(table.begin(), table.end(), 0);
+        additions = 0;
+    }
+
+private:
+    std::vector<uint8_t> table;  // `DEPTH` rows
+    size_type mask;
+    size_type sample_size, additions;
+
+    // The finalizer of splitmix64.
+    static uint64_t mix(uint64_t x) noexcept {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+        return x ^ (x >> 31);
+    }
+
+    // Double hashing, each row with its own probe.
+    size_type slot(uint64_t h, int row) const noexcept {
+        uint64_t step = (h >> 32) | 1;
+        return row * (mask + 1) + ((h + row * step) & mask);
+    }
+};
+
+/**
+ * @brief The values of keys within `capacity` bytes, an empty one for a key which is deleted or
+ *        was never written. Entries are evicted by CLOCK. A key missing from the cache is
+ *        admitted only if it has been used more often than the entry it would evict (TinyLFU),
+ *        so that a scan through cold keys does not flush the hot ones.
+ *
+ *        It is not thread safe: the store calls it under its mutex, and drops the entries its
+ *        writes outdate.
+ */
+class row_cache {
+public:
+    struct stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t admissions = 0;
+        uint64_t rejections = 0;  // Keys not admitted, being used less than the victims
+        uint64_t evictions = 0;
+        size_type entries = 0;
+        size_type bytes = 0;  // Charged to the capacity
+    };
+
+    // Bytes charged to an entry besides its value.
+    static constexpr size_type ENTRY_OVERHEAD = 64;
+
+    explicit row_cache(size_type capacity)
+        : capacity(capacity), sketch(std::max<size_type>(capacity / 256, 1024)), hand(0) {}
+
+    // Count a use of the key, and copy its value into `value` if it is cached.
+    bool lookup(uint64_t key, std::string &value) {
+        sketch.add(key);
+        auto it = index.find(key);
+        if (it == index.end()) {
+            ++counters.misses;
+            return false;
+        }
+        ++counters.hits;
+        slot &s = slots[it->second];
+        s.referenced = true;
+        value = s.value;
+        return true;
+    }
+
+    /**
+     * @brief Cache the value of a key which `lookup` missed, unless the admission policy turns
+     *        it away.
+     * @return whether it is cached.
+     */
+    bool insert(uint64_t key, const std::string &value) {
+        erase(key);
+        size_type charge = value.size() + ENTRY_OVERHEAD;
+        if (charge > capacity) {
+            ++counters.rejections;
+            return false;
+        }
+        if (counters.bytes + charge > capacity) {
+            if (sketch.frequency(key) <= sketch.frequency(slots[victim()].key)) {
+                ++counters.rejections;
+                return false;
+            }
+            while (counters.bytes + charge > capacity) {
+                evict(victim());
+            }
+        }
+        std::size_t pos;
+        if (free_slots.empty()) {
+            pos = slots.size();
+            slots.emplace_back();
+        } else {
+            pos = free_slots.back();
+            free_slots.pop_back();
+        }
+        slots[pos] = slot{key, value, false, true};
+        index.emplace(key, pos);
+        counters.bytes += charge;
+        ++counters.entries;
+        ++counters.admissions;
+        return true;
+    }
+
+    void erase(uint64_t key) {
+        auto it = index.find(key);
+        if (it != index.end()) {
+            drop(it->second);
+        }
+    }
+
+    // Erase the keys in [first, last].
+    void erase_range(uint64_t first, uint64_t last) {
+        if (last - first < index.size()) {
+            for (uint64_t key = first;; ++key) {
+                erase(key);
+                if (key == last) {
+                    break;
+                }
+            }
+            return;
+        }
+        for (std::size_t pos = 0; pos < slots.size(); ++pos) {
+            if (slots[pos].live && slots[pos].key >= first && slots[pos].key <= last) {
+                drop(pos);
+            }
+        }
+    }
+
+    // Drop every entry and forget the frequencies.
+    void clear() {
+        slots.clear();
+        free_slots.clear();
+        index.clear();
+        sketch.clear();
+        hand = 0;
+        counters.entries = 0;
+        counters.bytes = 0;
+    }
+
+    const stats &get_stats() const noexcept {
+        return counters;
+    }
+
+private:
+    struct slot {
+        uint64_t key;
+        std::string value;
+        bool referenced;  // Used since the hand last passed
+        bool live;
+    };
+
+    const size_type capacity;
+    frequency_sketch sketch;
+    std::vector<slot> slots;  // The clock, dead slots included
+    std::vector<std::size_t> free_slots;
+    std::unordered_map<uint64_t, std::size_t> index;
+    std::size_t hand;
+    stats counters;
+
+    // The next live slot the hand finds unreferenced, clearing the references it passes.
+    // There must be a live slot.
+    std::size_t victim() {
+        while (true) {
+            if (hand == slots.size()) {
+                hand = 0;
+            }
+            slot &s = slots[hand];
+            if (s.live && !s.referenced) {
+                return hand;
+            }
+            s.referenced = false;
+            ++hand;
+        }
+    }
+
+    void evict(std::size_t pos) {
+        drop(pos);
+        ++counters.evictions;
+    }
+
+    void drop(std::size_t pos) {
+        slot &s = slots[pos];
+        index.erase(s.key);
+        counters.bytes -= s.value.size() + ENTRY_OVERHEAD;
+        --counters.entries;
+        s.live = false;
+        s.referenced = false;
+        std::string{}.swap(s.value);
+        free_slots.push_back(pos);
+    }
+};
+
+}  // namespace lsm
+
+#endif
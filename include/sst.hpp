@@ -2,23 +2,102 @@
 #define SST_UTILS
 
 #include <algorithm>
+#include <cstring>
+#include <exception>
 #include <fstream>
+#include <functional>
+#include <future>
 #include <iomanip>
+#include <iterator>
+#include <limits>
 #include <memory>
 #include <random>
 #include <sstream>
+#include <thread>
 #include <vector>
 
 #include "BloomFilter.hpp"
+#include "io.hpp"
+#include "meta_cache.hpp"
+#include "perf_context.hpp"
+#include "range_filter.hpp"
+#include "sst_index.hpp"
 #include "types.hpp"
 #include "utils.h"
+#include "value_log.hpp"
 
 namespace sst {
 
+/**
+ * Layout of an sst file:
+ *   header (32 B) | bloom filter | index (key, offset) * count |
+ *   records (type, seq, value, '\0') * count | range tombstones (begin, end, seq) * n |
+ *   value refs (segment, bytes) * m | footer (40 B)
+ * The versions of a key are stored next to each other, from the newest to the oldest.
+ * A record of type `VALUE_POINTER` holds an encoded `lsm::value_pointer` as its value, and the
+ * value refs count the bytes the records point to in each segment of the value log, so that
+ * they are known without reading the records.
+ * An sst whose footer holds `SST_DELTA_MAGIC` stores the delta encoding of its index instead
+ * (see `key_index::encode`).
+ */
+constexpr lsm::size_type HEADER_SIZE = 32;
+constexpr lsm::size_type INDEX_ENTRY_SIZE = sizeof(lsm::key_type) + sizeof(lsm::offset_type);
+constexpr lsm::size_type RANGE_TOMBSTONE_SIZE = 2 * sizeof(lsm::key_type) + sizeof(lsm::seq_type);
+constexpr lsm::size_type VALUE_REF_SIZE = 2 * sizeof(uint64_t);
+constexpr lsm::size_type FOOTER_SIZE = 40;
+constexpr uint64_t SST_MAGIC = 0x335453532d4d534cull; /* "LSM-SST3" */
+constexpr uint64_t SST_DELTA_MAGIC = 0x334453532d4d534cull; /* "LSM-SSD3" */
+
+// Size of a record stored in an sst, given the length of its value, including its index entry.
+// A delta encoded entry is mostly smaller.
+inline lsm::size_type record_size(lsm::size_type value_length) noexcept {
+    return INDEX_ENTRY_SIZE + 1 /* type */ + sizeof(lsm::seq_type) +
+           (value_length + 1 /* null-terminated */);
+}
+
+inline lsm::size_type record_size(const lsm::value_type &value) noexcept {
+    return record_size(value.length());
+}
+
+// A record whose value is left in the block of an sst it was read from, see
+// `sst_cache::get_slices`. It is valid as long as the block is.
+struct record_slice {
+    lsm::record_type type;
+    lsm::seq_type seq;
+    const char *value;  // Null-terminated, as stored in the sst
+    lsm::size_type length;
+
+    bool is_deleted() const noexcept {
+        return !lsm::has_value(type);
+    }
+};
+
+// The value of a record to write, for either kind of record.
+inline const char *value_data(const lsm::record &rec) noexcept {
+    return rec.value.c_str();
+}
+inline lsm::size_type value_length(const lsm::record &rec) noexcept {
+    return rec.value.length();
+}
+inline const char *value_data(const record_slice &rec) noexcept {
+    return rec.value;
+}
+inline lsm::size_type value_length(const record_slice &rec) noexcept {
+    return rec.length;
+}
+
+struct sst_footer {
+    uint64_t range_del_offset, range_del_count;
+    lsm::seq_type max_seq;  // The newest sequence number in the sst
+    uint64_t value_ref_count;
+    uint64_t magic;
+};
+
 inline static std::string generate_hash() {
-    static std::random_device random_device{};
-    static std::mt19937 engine{random_device()};
-    static std::uniform_int_distribution<> dist(0, 0xFFFFFF);
+    // Flushes and background compactions name their ssts concurrently
+    thread_local std::random_device random_device{};
+    thread_local std::mt19937 engine{random_device()};
+    thread_local std::uniform_int_distribution<> dist(0, 0xFFFFFF);
 
     uint32_t random_number = dist(engine);
     std::stringstream ss{};
@@ -26,12 +105,36 @@ inline static std::string generate_hash() {
     return ss.str();
 }
 
+// A fresh sst path in the directory. A taken name would truncate a live sst, so the name is
+// taken by creating an empty file.
+inline std::string generate_path(const std::string &dir) {
+    while (true) {
+        std::string path = dir + '/' + generate_hash() + ".sst";
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd >= 0) {
+            ::close(fd);
+            return path;
+        }
+        if (errno != EEXIST) {
+            throw std::runtime_error{"Cannot create sst " + path};
+        }
+    }
+}
+
+// How the search of a key in an sst ended.
+enum class probe_result {
+    OUT_OF_RANGE,  // The key lies outside the key range of the sst
+    FILTERED,      // The bloom filter ruled the key out
+    ABSENT,        // The bloom filter passed the key, but the indices do not hold it
+    FOUND,
+};
+
 // Cache for sst files, stored in the memory.
 // It's an aggregate, moveable type.
 struct sst_cache {
     using key_type = lsm::key_type;
     using value_type = lsm::value_type;
-    using kv_type = std::pair<key_type, value_type>;
+    using kv_type = std::pair<key_type, lsm::record>;
     using offset_type = lsm::offset_type;
 
     struct sst_header {
@@ -41,40 +144,134 @@ struct sst_cache {
 
     // Variables
     int level;
-    struct sst_header header;
-    basic_ds::BloomFilter<lsm::BLF_SIZE> bft;  // bloom filter is designed to be moveable.
-    std::vector<std::pair<lsm::key_type, lsm::offset_type>> indices;
+    struct sst_header header;  // [lower, upper] also covers the range tombstones
+    std::shared_ptr<const meta_handle> meta;  // The bloom filter and the index
     std::string sst_path;  // The associated sst file (full path)
+    lsm::size_type file_size;  // Size of the associated sst file in bytes
+    // Range tombstones ordered by `begin`
+    std::vector<lsm::range_tombstone> range_dels;
+    lsm::seq_type max_seq;  // The newest sequence number in the sst
+    // The range filter of the keys, built by the store if it scans with them
+    std::shared_ptr<const range_filter> scan_filter;
+    // Bytes of the value log entries the records point to, by segment, stored after the range
+    // tombstones
+    lsm::value_refs value_refs;
 
-    // Read the associated sst file and return the value from offset.
-    value_type from_offset(offset_type offset) const {
+    // Read the associated sst file and return the record from offset.
+    lsm::record from_offset(offset_type offset) const {
         std::ifstream in{sst_path, std::ios::binary};
         in.seekg(offset, std::ios::beg);
-        std::string str;
-        for (char c; (in >> c) && c;) {
-            str.append(1, c);
-        }
-        return str;
+        return read_record(in);
     }
 
+    // The bloom filter and the index, read again from the file if they were evicted.
+    meta_ptr metadata() const;
+
     // Search the key in indices. If found, return the offset and bool flag `true`.
-    std::pair<offset_type, bool> search(key_type key) const {
-// #define TEST2
-#ifdef TEST2
-        if (!(this->header.lower <= key && key <= this->header.upper)) {
-            return {0, false};
+    // How the search ended is stored in `probe`, if given.
+    std::pair<offset_type, bool> search(key_type key, probe_result *probe = nullptr) const {
+        return search(key, probe, nullptr);
+    }
+
+    // Whether the sst may hold keys in [first, last], by its key range and its range filter.
+    bool may_contain_range(key_type first, key_type last) const noexcept {
+        if (first > header.upper || last < header.lower) {
+            return false;
         }
-#else
-        if (!(this->header.lower <= key && key <= this->header.upper) || !this->bft.contains(key)) {
-            return {0, false};
+        return !scan_filter || scan_filter->may_contain(std::max(first, header.lower),
+                                                        std::min(last, header.upper));
+    }
+
+    // The end of the record block, where the range tombstones start.
+    offset_type records_end() const noexcept {
+        return file_size - FOOTER_SIZE - range_dels.size() * RANGE_TOMBSTONE_SIZE -
+               value_refs.size() * VALUE_REF_SIZE;
+    }
+
+    // The file range [first, second) holding the versions of the key, empty if there are none.
+    std::pair<offset_type, offset_type> extent(key_type key,
+                                               probe_result *probe = nullptr) const {
+        meta_ptr meta;
+        auto found = search(key, probe, &meta);
+        if (!found.second) {
+            return {0, 0};
         }
-#endif
-        using pair_type = decltype(indices)::value_type;
-        auto it = std::lower_bound(indices.begin(), indices.end(), pair_type{key, 0});
-        if (it == indices.cend() || it->first != key) {
-            return {0, false};
+        auto pos = meta->indices.upper_bound(key);
+        return {found.first, pos == key_index::npos ? records_end() : meta->indices.offset(pos)};
+    }
+
+    /**
+     * @brief Get the newest version of the key visible at `snapshot`.
+     * @return the record and a flag denoting whether the sst holds a visible version. A version
+     *         deleted by a range tombstone of this sst is found as a tombstone.
+     */
+    std::pair<lsm::record, bool> get(key_type key, lsm::seq_type snapshot = lsm::MAX_SEQ) const {
+        return get(key, snapshot, read(extent(key)));
+    }
+
+    // Read the file range [first, second).
+    std::string read(std::pair<offset_type, offset_type> range) const {
+        std::string block(range.second - range.first, '\0');
+        if (block.empty()) {
+            return block;
+        }
+        lsm::perf_add(&lsm::perf_context::file_opens);
+        lsm::perf_add(&lsm::perf_context::block_reads);
+        lsm::perf_add(&lsm::perf_context::bytes_read, block.size());
+        lsm::perf_timer timer{&lsm::perf_context::read_nanos};
+        if (!io::file{sst_path}.read_at(&block[0], block.size(), range.first)) {
+            throw std::runtime_error{"Cannot read sst file " + sst_path};
+        }
+        return block;
+    }
+
+    // The same as above, given the bytes of `extent(key)`, which may be read ahead of time.
+    std::pair<lsm::record, bool> get(key_type key, lsm::seq_type snapshot,
+                                     const std::string &block) const {
+        std::pair<lsm::record, bool> res{{lsm::record_type::PUT, {}, 0}, false};
+        // The versions from the newest: type, sequence number and null-terminated value
+        for (std::size_t pos = 0; pos + 1 + sizeof(lsm::seq_type) < block.size();) {
+            lsm::record rec{static_cast<lsm::record_type>(block[pos]), {}, 0};
+            std::memcpy(&rec.seq, &block[pos + 1], sizeof rec.seq);
+            pos += 1 + sizeof rec.seq;
+            std::size_t end = block.find('\0', pos);
+            if (end == std::string::npos) {
+                break;
+            }
+            if (rec.seq <= snapshot) {
+                rec.value = block.substr(pos, end - pos);
+                res = {std::move(rec), true};
+                break;
+            }
+            pos = end + 1;
+        }
+        // The newest range tombstone visible at `snapshot`
+        const lsm::range_tombstone *newest = nullptr;
+        for (const auto &range : range_dels) {
+            if (range.begin > key) {
+                break;
+            }
+            if (range.covers(key) && range.seq <= snapshot && (!newest || range.seq > newest->seq)) {
+                newest = &range;
+            }
+        }
+        if (newest && (!res.second || newest->seq > res.first.seq)) {
+            return {{lsm::record_type::DELETE, {}, newest->seq}, true};
         }
-        return {it->second, true};
+        return res;
+    }
+
+    // Whether any range tombstone of this sst covers the key.
+    bool covers(key_type key) const noexcept {
+        for (const auto &range : range_dels) {
+            if (range.begin > key) {
+                break;
+            }
+            if (range.covers(key)) {
+                return true;
+            }
+        }
+        return false;
     }
 
     bool operator<(const sst_cache &rhs) const {
@@ -86,23 +283,171 @@ struct sst_cache {
         return rhs < *this;
     }
 
-    std::vector<kv_type> get_kv() const {
+    // Read the records of the keys in [lower, upper], every record by default. The reads are
+    // paced by the rate limiter, if any.
+    std::vector<kv_type> get_kv(io::rate_limiter *limiter = nullptr, key_type lower = 0,
+                                key_type upper = std::numeric_limits<key_type>::max()) const {
         std::vector<kv_type> kv_list{};
-        kv_list.reserve(this->header.count);
-        std::ifstream in{sst_path, std::ios::binary};
+        if (this->header.count == 0 || lower > header.upper || upper < header.lower) {
+            return kv_list;
+        }
+        auto meta = metadata();
+        const key_index &indices = meta->indices;
+        auto first = indices.lower_bound(lower);
+        if (first == key_index::npos) {
+            return kv_list;
+        }
+        auto last = upper == std::numeric_limits<key_type>::max() ? key_index::npos
+                                                                   : indices.upper_bound(upper);
+        if (lower <= header.lower && last == key_index::npos) {
+            kv_list.reserve(this->header.count);
+        }
+        // The records are read front to back, prefetched as a whole
+        io::sequential_reader in{sst_path, io::DEFAULT_BUFFER_SIZE, limiter};
         if (!in) {
             throw std::runtime_error{"Cannot open sst file " + sst_path};
         }
-        in.seekg(this->indices[0].second);
-        for (const auto &index : indices) {
-            std::string buffer;
-            std::getline(in, buffer, '\0');
-            kv_list.emplace_back(index.first, std::move(buffer));
+        offset_type begin = indices.offset(first);
+        offset_type end = last == key_index::npos ? records_end() : indices.offset(last);
+        in.will_need(begin, end - begin);
+        in.seek(begin);
+        for (auto pos = first; pos != last; pos = indices.next(pos)) {
+            kv_list.emplace_back(indices.key(pos), read_record(in));
         }
         return kv_list;
     }
+
+    /**
+     * @brief The same as `get_kv`, without copying out the values: the records are read into
+     *        `block` in a few large reads, and the returned records point into it.
+     */
+    std::vector<std::pair<key_type, record_slice>> get_slices(
+        std::string &block, io::rate_limiter *limiter = nullptr, key_type lower = 0,
+        key_type upper = std::numeric_limits<key_type>::max()) const {
+        std::vector<std::pair<key_type, record_slice>> slices{};
+        block.clear();
+        if (this->header.count == 0 || lower > header.upper || upper < header.lower) {
+            return slices;
+        }
+        auto meta = metadata();
+        const key_index &indices = meta->indices;
+        auto first = indices.lower_bound(lower);
+        if (first == key_index::npos) {
+            return slices;
+        }
+        auto last = upper == std::numeric_limits<key_type>::max() ? key_index::npos
+                                                                   : indices.upper_bound(upper);
+        if (lower <= header.lower && last == key_index::npos) {
+            slices.reserve(this->header.count);
+        }
+        offset_type begin = indices.offset(first);
+        offset_type end = last == key_index::npos ? records_end() : indices.offset(last);
+        read_block(block, begin, end, limiter);
+
+        // The versions from the newest: type, sequence number and null-terminated value
+        constexpr std::size_t HEAD_SIZE = 1 + sizeof(lsm::seq_type);
+        const char *pos = block.data(), *block_end = block.data() + block.size();
+        for (auto i = first; i != last; i = indices.next(i)) {
+            const char *value_end =
+                block_end - pos > static_cast<std::ptrdiff_t>(HEAD_SIZE)
+                    ? static_cast<const char *>(
+                          std::memchr(pos + HEAD_SIZE, '\0', block_end - pos - HEAD_SIZE))
+                    : nullptr;
+            if (!value_end) {
+                throw std::runtime_error{"Corrupted sst " + sst_path};
+            }
+            record_slice rec{static_cast<lsm::record_type>(*pos), 0, pos + HEAD_SIZE,
+                             static_cast<lsm::size_type>(value_end - pos - HEAD_SIZE)};
+            std::memcpy(&rec.seq, pos + 1, sizeof rec.seq);
+            slices.emplace_back(indices.key(i), rec);
+            pos = value_end + 1;
+        }
+        return slices;
+    }
+
+    // Read the type and the sequence number of the record at the current position of a
+    // `std::istream` or an `io::sequential_reader`.
+    template <typename Stream>
+    static lsm::record read_head(Stream &in) {
+        lsm::record rec{lsm::record_type::PUT, {}, 0};
+        rec.type = static_cast<lsm::record_type>(in.get());
+        in.read(reinterpret_cast<char *>(&rec.seq), sizeof rec.seq);
+        return rec;
+    }
+
+    template <typename Stream>
+    static lsm::record read_record(Stream &in) {
+        using std::getline;
+        lsm::record rec = read_head(in);
+        getline(in, rec.value, '\0');
+        return rec;
+    }
+
+private:
+    // Read the file range [begin, end) into `block`, a buffer at a time, each paced by the rate
+    // limiter, if any.
+    void read_block(std::string &block, offset_type begin, offset_type end,
+                    io::rate_limiter *limiter) const {
+        block.resize(end - begin);
+        io::file in{sst_path};
+        lsm::perf_add(&lsm::perf_context::file_opens);
+        for (std::size_t done = 0; done < block.size();) {
+            std::size_t chunk = std::min(block.size() - done, io::DEFAULT_BUFFER_SIZE);
+            {
+                lsm::perf_timer timer{&lsm::perf_context::read_nanos};
+                if (!in.read_at(&block[done], chunk, begin + done)) {
+                    throw std::runtime_error{"Cannot read sst file " + sst_path};
+                }
+            }
+            lsm::perf_add(&lsm::perf_context::bytes_read, chunk);
+            if (limiter) {
+                limiter->request(chunk);
+            }
+            done += chunk;
+        }
+    }
+
+    // The same as above. `meta` receives the metadata, unless the key is out of range.
+    std::pair<offset_type, bool> search(key_type key, probe_result *probe,
+                                        meta_ptr *meta) const {
+        probe_result ignored;
+        probe_result &res = probe ? *probe : ignored;
+        lsm::perf_add(&lsm::perf_context::sst_searches);
+        if (!(this->header.lower <= key && key <= this->header.upper)) {
+            res = probe_result::OUT_OF_RANGE;
+            return {0, false};
+        }
+        meta_ptr loaded = metadata();
+        const key_index &indices = loaded->indices;
+        if (meta) {
+            *meta = loaded;
+        }
+// #define TEST2
+#ifndef TEST2
+        lsm::perf_add(&lsm::perf_context::filter_probes);
+        if (!loaded->bft.contains(key)) {
+            res = probe_result::FILTERED;
+            return {0, false};
+        }
+        lsm::perf_add(&lsm::perf_context::filter_passes);
+#endif
+        lsm::perf_add(&lsm::perf_context::index_searches);
+        auto pos = [&] {
+            lsm::perf_timer timer{&lsm::perf_context::index_nanos};
+            return indices.lower_bound(key);
+        }();
+        if (pos == key_index::npos || indices.key(pos) != key) {
+            res = probe_result::ABSENT;
+            return {0, false};
+        }
+        res = probe_result::FOUND;
+        return {indices.offset(pos), true};
+    }
 };
 
+// Caches are shared by the store and the iterators reading them.
+using cache_ptr = std::shared_ptr<sst_cache>;
+
 // A wrapper structure to read from sst files.
 // Used when initialize the memory table from current ssts.
 struct sst_reader {
@@ -112,14 +457,19 @@ struct sst_reader {
     using offset_type = lsm::offset_type;
 
     uint64_t time_stamp, count, lower, upper;  // The header
-    std::vector<std::pair<key_type, offset_type>> indices;
+    key_index indices;
     basic_ds::BloomFilter<lsm::BLF_SIZE> bft;
+    std::vector<lsm::range_tombstone> range_dels;
+    lsm::value_refs value_refs;
+    lsm::size_type file_size;
+    lsm::seq_type max_seq;
     bool is_success;
 
     sst_reader() = delete;
     sst_reader(sst_reader &&) = delete;
     sst_reader(const sst_reader &) = delete;
-    explicit sst_reader(const char *sst_name) : is_success(false) {
+    explicit sst_reader(const char *sst_name, const lsm::index_options &index_opts = {})
+        : is_success(false) {
         std::ifstream in{sst_name, std::ios::binary};
         if (!in) {
             return;
@@ -136,220 +486,666 @@ struct sst_reader {
             return;
         }
 
-        indices = decltype(indices)(count);
-        for (auto &index : indices) {
-            in.read(reinterpret_cast<char *>(&index), sizeof(key_type) + sizeof(offset_type));
+        // The footer tells how the index is encoded
+        in.seekg(0, std::ios::end);
+        file_size = in.tellg();
+        sst_footer footer;
+        in.seekg(file_size - FOOTER_SIZE).read(reinterpret_cast<char *>(&footer), FOOTER_SIZE);
+        if (!in.good() || (footer.magic != SST_MAGIC && footer.magic != SST_DELTA_MAGIC)) {
+            return;
+        }
+        in.seekg(HEADER_SIZE + lsm::BLF_SIZE);
+        if (footer.magic == SST_DELTA_MAGIC ? !read_delta_index(in, index_opts)
+                                            : !read_fixed_index(in, index_opts)) {
+            return;
+        }
+        max_seq = footer.max_seq;
+        range_dels = decltype(range_dels)(footer.range_del_count);
+        in.seekg(footer.range_del_offset);
+        for (auto &range : range_dels) {
+            in.read(reinterpret_cast<char *>(&range), RANGE_TOMBSTONE_SIZE);
             if (!in.good()) {
                 return;
             }
         }
+        for (uint64_t i = 0; i < footer.value_ref_count; ++i) {
+            uint64_t ref[2];
+            in.read(reinterpret_cast<char *>(ref), VALUE_REF_SIZE);
+            if (!in.good()) {
+                return;
+            }
+            value_refs.emplace_hint(value_refs.end(), ref[0], ref[1]);
+        }
         is_success = true;
     }
+
+private:
+    bool read_fixed_index(std::istream &in, const lsm::index_options &index_opts) {
+        std::vector<key_type> keys(count);
+        std::vector<offset_type> offsets(count);
+        for (uint64_t i = 0; i < count; ++i) {
+            in.read(reinterpret_cast<char *>(&keys[i]), sizeof(key_type))
+                .read(reinterpret_cast<char *>(&offsets[i]), sizeof(offset_type));
+            if (!in.good()) {
+                return false;
+            }
+        }
+        indices = key_index{keys, offsets, index_opts};
+        return true;
+    }
+
+    // The block is kept as read for the `DELTA` layout, and decoded for the others.
+    bool read_delta_index(std::istream &in, const lsm::index_options &index_opts) {
+        uint32_t size = 0;
+        in.read(reinterpret_cast<char *>(&size), sizeof size);
+        if (!in.good() || size < sizeof size || size > file_size) {
+            return false;
+        }
+        std::string block(size, '\0');
+        std::memcpy(&block[0], &size, sizeof size);
+        in.read(&block[sizeof size], size - sizeof size);
+        if (!in.good()) {
+            return false;
+        }
+        const bool is_kept = index_opts.layout == lsm::index_layout::DELTA;
+        std::vector<key_type> keys;
+        std::vector<offset_type> offsets;
+        uint64_t decoded = 0;
+        bool is_valid = key_index::decode(block, [&](key_type key, offset_type offset) {
+            ++decoded;
+            if (!is_kept) {
+                keys.push_back(key);
+                offsets.push_back(offset);
+            }
+        });
+        if (!is_valid || decoded != count) {
+            return false;
+        }
+        if (is_kept) {
+            indices = key_index{std::move(block), index_opts};
+        } else {
+            indices = key_index{keys, offsets, index_opts};
+        }
+        return true;
+    }
 };
 
+inline meta_ptr sst_cache::metadata() const {
+    return meta->get([this] {
+        lsm::perf_add(&lsm::perf_context::file_opens);
+        sst_reader sr{sst_path.c_str(), meta->owner()->index_options()};
+        if (!sr.is_success) {
+            throw std::runtime_error{"Cannot read sst " + sst_path};
+        }
+        return std::make_shared<const table_meta>(
+            table_meta{std::move(sr.bft), std::move(sr.indices)});
+    });
+}
+
 /**
  * @brief Read sst file, return the cache.
  *
  * @param sst_path
  * @param level
+ * @param index_opts how the index is laid out in the memory.
  * @return sst_cache, level -1 indicates the read is failed or the given argument is invalid.
  */
-inline sst_cache read_sst(const std::string &sst_path, int level) {
+inline sst_cache read_sst(const std::string &sst_path, int level,
+                          const lsm::index_options &index_opts = {}) {
     if (level < 0) {
         return {-1};
     }
-    sst_reader sr{sst_path.c_str()};
+    sst_reader sr{sst_path.c_str(), index_opts};
     if (!sr.is_success) {
         return {-1};
     }
 
-    return {level,
-            {sr.time_stamp, sr.count, sr.lower, sr.upper},
-            std::move(sr.bft),
-            std::move(sr.indices),
-            std::move(sst_path)};
+    sst_cache cache{level,
+                    {sr.time_stamp, sr.count, sr.lower, sr.upper},
+                    std::make_shared<const meta_handle>(std::make_shared<const table_meta>(
+                        table_meta{std::move(sr.bft), std::move(sr.indices)})),
+                    std::move(sst_path),
+                    sr.file_size,
+                    std::move(sr.range_dels),
+                    sr.max_seq};
+    cache.value_refs = std::move(sr.value_refs);
+    return cache;
 }
 
+// Smaller indices are laid out in the memory by the thread writing the sst
+constexpr lsm::size_type PARALLEL_INDEX_MIN_KEYS = 4096;
+
+/**
+ * @brief Write an sst file, return the cache. This method throws if the file cannot be written.
+ *
+ * @param for_each_record calls its argument with the key and the record of each record, ordered
+ *        by key and the versions of a key from the newest. It is called twice: once to lay out
+ *        the index, and once to write the records, so that the records are never copied. The
+ *        records are either `lsm::record`s or `record_slice`s.
+ * @param range_dels range tombstones ordered by begin.
+ * @param bft the bloom filter of the keys of the records.
+ * @param limiter paces the writes, if any.
+ * @param index_opts how the index of the returned cache is laid out in the memory. It is laid
+ *        out by another thread while the records are written.
+ */
+template <typename ForEachRecord>
+inline sst_cache write_sst_records(const std::string &bin_name, int level, uint64_t timestamp,
+                                   ForEachRecord &&for_each_record,
+                                   std::vector<lsm::range_tombstone> range_dels,
+                                   basic_ds::BloomFilter<lsm::BLF_SIZE> bft,
+                                   io::rate_limiter *limiter = nullptr,
+                                   const lsm::index_options &index_opts = {}) {
+    using key_type = lsm::key_type;
+
+    // Lay out the index. The offsets are found from the size of the index, and the size of the
+    // delta encoding does not depend on where the records start.
+    std::vector<key_type> keys;
+    std::vector<lsm::offset_type> offsets;
+    lsm::offset_type offset = 0;
+    lsm::seq_type max_seq = 0;
+    lsm::value_refs refs;
+#ifndef NDEBUG
+    lsm::seq_type last_seq = 0;
+#endif
+    for_each_record([&](key_type key, const auto &rec) {
+#ifndef NDEBUG
+        assert(keys.empty() || keys.back() < key || (keys.back() == key && rec.seq < last_seq));
+        last_seq = rec.seq;
+#endif
+        keys.push_back(key);
+        offsets.push_back(offset);
+        offset += record_size(value_length(rec)) - INDEX_ENTRY_SIZE;
+        max_seq = std::max(max_seq, rec.seq);
+        if (rec.type == lsm::record_type::VALUE_POINTER) {
+            lsm::add_value_ref(refs, value_data(rec), value_length(rec));
+        }
+    });
+    uint64_t count = keys.size();
+
+    std::pair<uint64_t, uint64_t> range{std::numeric_limits<key_type>::max(),
+                                        std::numeric_limits<key_type>::min()};
+    if (!keys.empty()) {
+        range = {keys.front(), keys.back()};
+    }
+    for (const auto &range_del : range_dels) {
+        range.first = std::min(range.first, range_del.begin);
+        range.second = std::max(range.second, range_del.end);
+        max_seq = std::max(max_seq, range_del.seq);
+    }
+
+    const bool is_delta = index_opts.encoding == lsm::index_encoding::DELTA;
+    lsm::offset_type records_begin =
+        HEADER_SIZE + lsm::BLF_SIZE +
+        (is_delta ? key_index::encoded_size(keys, offsets, index_opts.restart_interval)
+                  : count * INDEX_ENTRY_SIZE);
+    for (auto &record_offset : offsets) {
+        record_offset += records_begin;
+    }
+    offset += records_begin;
+    std::string block;
+    if (is_delta) {
+        block = key_index::encode(keys, offsets, index_opts.restart_interval);
+        assert(HEADER_SIZE + lsm::BLF_SIZE + block.size() == records_begin);
+    }
+    // Waited for on the way out, also if the writes throw
+    std::future<key_index> indices = std::async(
+        count < PARALLEL_INDEX_MIN_KEYS ? std::launch::deferred : std::launch::async,
+        [&keys, &offsets, &index_opts] { return key_index{keys, offsets, index_opts}; });
+
+    io::sequential_writer bin_out{bin_name, io::DEFAULT_BUFFER_SIZE, limiter};  // Trunc
+    if (!bin_out) {
+        throw std::runtime_error{"Cannot write sst " + bin_name +
+                                 ". Please check if the directory exists."};
+    }
+
+    // Write the header
+    bin_out.write(reinterpret_cast<const char *>(&timestamp), sizeof timestamp)
+        .write(reinterpret_cast<const char *>(&count), sizeof count)
+        .write(reinterpret_cast<const char *>(&range), sizeof range);
+
+    // Write the bloom filter
+    bin_out.write(bft.data(), bft.byte_size());
+
+    // The below implements are value_type-dependent
+
+    // Write the index table
+    if (is_delta) {
+        bin_out.write(block.data(), block.size());
+    } else {
+        for (uint64_t i = 0; i < count; ++i) {
+            bin_out.write(reinterpret_cast<const char *>(&keys[i]), sizeof(key_type))
+                .write(reinterpret_cast<const char *>(&offsets[i]), sizeof(lsm::offset_type));
+        }
+    }
+
+    // Write the records
+    for_each_record([&](key_type, const auto &rec) {
+        bin_out.put(static_cast<char>(rec.type));
+        bin_out.write(reinterpret_cast<const char *>(&rec.seq), sizeof(lsm::seq_type));
+        bin_out.write(value_data(rec), value_length(rec) + 1);
+    });
+
+    // Write the range tombstones, the value refs and the footer
+    sst_footer footer{offset, range_dels.size(), max_seq, refs.size(),
+                      is_delta ? SST_DELTA_MAGIC : SST_MAGIC};
+    for (const auto &range_del : range_dels) {
+        bin_out.write(reinterpret_cast<const char *>(&range_del), RANGE_TOMBSTONE_SIZE);
+    }
+    for (const auto &ref : refs) {
+        uint64_t fields[2] = {ref.first, ref.second};
+        bin_out.write(reinterpret_cast<const char *>(fields), VALUE_REF_SIZE);
+    }
+    bin_out.write(reinterpret_cast<const char *>(&footer), FOOTER_SIZE);
+    offset += range_dels.size() * RANGE_TOMBSTONE_SIZE + refs.size() * VALUE_REF_SIZE +
+              FOOTER_SIZE;
+
+    if (!bin_out.close()) {
+        throw std::runtime_error{"Cannot write sst " + bin_name};
+    }
+
+    sst_cache cache{level,
+                    {timestamp, count, range.first, range.second},
+                    std::make_shared<const meta_handle>(std::make_shared<const table_meta>(
+                        table_meta{std::move(bft), indices.get()})),
+                    bin_name,
+                    offset,
+                    std::move(range_dels),
+                    max_seq};
+    cache.value_refs = std::move(refs);
+    return cache;
+}
+
+/**
+ * @brief `write_sst_records` of the records in a list.
+ *
+ * @param kv_list records ordered by key, and the versions of a key from the newest.
+ */
+template <typename Record>
+inline sst_cache write_sst(const std::string &bin_name, int level, uint64_t timestamp,
+                           const std::vector<std::pair<lsm::key_type, Record>> &kv_list,
+                           std::vector<lsm::range_tombstone> range_dels,
+                           basic_ds::BloomFilter<lsm::BLF_SIZE> bft,
+                           io::rate_limiter *limiter = nullptr,
+                           const lsm::index_options &index_opts = {}) {
+    return write_sst_records(
+        bin_name, level, timestamp,
+        [&kv_list](auto &&f) {
+            for (const auto &kv : kv_list) {
+                f(kv.first, kv.second);
+            }
+        },
+        std::move(range_dels), std::move(bft), limiter, index_opts);
+}
+
+// The outputs of a compaction. The records appended point into the blocks read from the
+// inputs, which outlive the buffer, so that a value is copied once, into an output.
 struct sst_buffer {
     using key_type = lsm::key_type;
     using value_type = lsm::value_type;
-    using kv_type = std::pair<key_type, value_type>;
+    using kv_type = std::pair<key_type, record_slice>;
 
     std::vector<kv_type> kv_list;
     lsm::size_type byte_size;
     uint64_t timestamp;
     std::string target_dir;
     int level;
+    // Range tombstones to be written, ordered by `begin`. Each output keeps the part of them
+    // within its own key range.
+    std::vector<lsm::range_tombstone> range_dels;
+    key_type range_start;  // The smallest key the current output may cover
+    key_type range_end;    // The largest key the outputs may cover
+    io::rate_limiter *limiter = nullptr;  // Paces the writes of the outputs
+    lsm::index_options index_opts;         // How the indices of the outputs are laid out
+
+    static constexpr lsm::size_type EMPTY_SIZE = HEADER_SIZE + lsm::BLF_SIZE + FOOTER_SIZE;
 
     sst_buffer(uint64_t _timestamp, const std::string &_dir)
-        : byte_size(32 + lsm::BLF_SIZE),
+        : byte_size(EMPTY_SIZE),
           timestamp(_timestamp),
           target_dir(_dir),
-          level(std::stoi(_dir.substr(target_dir.find('-') + 1))) {
+          level(std::stoi(_dir.substr(target_dir.find_last_of('-') + 1))),
+          range_start(std::numeric_limits<key_type>::min()),
+          range_end(std::numeric_limits<key_type>::max()) {
         if (utils::mkdir(target_dir.c_str()) != 0) {
             throw std::runtime_error{"Cannot create directory " + target_dir};
         }
     }
 
     // I'd like to use unique_ptr. However, copy elision isn't mandatory in C++14.
-    sst_cache *append(key_type key, value_type value) {
-        auto tmp_size = this->byte_size + sizeof(key_type) + sizeof(lsm::offset_type) +
-                        (value.length() + 1) * sizeof(char);
-        if (tmp_size <= lsm::MTB_MAXSIZE) {
+    // The versions of a key are never split into two outputs.
+    sst_cache *append(key_type key, const record_slice &rec) {
+        auto tmp_size = this->byte_size + record_size(rec.length);
+        if (tmp_size <= lsm::MTB_MAXSIZE || (!kv_list.empty() && kv_list.back().first == key)) {
             this->byte_size = tmp_size;
-            kv_list.emplace_back(key, value);
+            kv_list.emplace_back(key, rec);
             return nullptr;
         }
 
-        auto *cache_ptr = to_binary();
+        auto *cache_ptr = to_binary(false, key);
 
-        this->byte_size +=
-            sizeof(key_type) + sizeof(lsm::offset_type) + (value.length() + 1) * sizeof(char);
-        this->kv_list = {{key, value}};
+        this->byte_size += record_size(rec.length);
+        this->kv_list.emplace_back(key, rec);
 
         return cache_ptr;
     }
 
-    sst_cache *clear() {
+    // End the current output before `key`, if it holds any record.
+    sst_cache *cut(key_type key) {
         if (this->kv_list.empty()) {
             return nullptr;
         }
-        return to_binary();
+        return to_binary(false, key);
+    }
+
+    sst_cache *clear() {
+        if (this->kv_list.empty() && clip(range_end).empty()) {
+            return nullptr;
+        }
+        return to_binary(true, 0);
     }
 
 private:
-    // Will clear the kv_list and reset byte_size.
-    sst_cache *to_binary() {
-#ifndef NDEBUG
-        bool flag = std::is_sorted(
-            kv_list.begin(), kv_list.end(),
-            [](const kv_type &kv1, const kv_type &kv2) -> bool { return kv1.first < kv2.first; });
-        assert(flag);
-#endif
+    // The range tombstones within [range_start, end].
+    std::vector<lsm::range_tombstone> clip(key_type end) const {
+        std::vector<lsm::range_tombstone> res{};
+        for (const auto &range : range_dels) {
+            if (range.begin > end) {
+                break;
+            }
+            if (range.end >= range_start) {
+                res.push_back(
+                    {std::max(range.begin, range_start), std::min(range.end, end), range.seq});
+            }
+        }
+        return res;
+    }
 
+    // Will clear the kv_list and reset byte_size. The output covers keys up to `next` (excluded),
+    // or all remaining keys if `is_last`.
+    sst_cache *to_binary(bool is_last, key_type next) {
         basic_ds::BloomFilter<lsm::BLF_SIZE> bft;
         for (const auto &kv : kv_list) {
             bft.insert(kv.first);
         }
 
-        std::string bin_name = target_dir + '/' + generate_hash() + ".sst";
+        std::string bin_name = generate_path(target_dir);
+        auto *cache_ptr =
+            new sst_cache{write_sst(bin_name, level, timestamp, kv_list,
+                                    clip(is_last ? range_end : next - 1), std::move(bft),
+                                    limiter, index_opts)};
 
-        std::ofstream bin_out{bin_name, std::ios::binary};  // Trunc
-        if (!bin_out) {
-            throw std::runtime_error{"Cannot write sst " + bin_name +
-                                     ". Please check if the directory exists."};
-        }
+        this->byte_size = EMPTY_SIZE;
+        this->kv_list.clear();
+        this->range_start = next;
 
-        std::pair<uint64_t, uint64_t> range{kv_list.front().first, kv_list.back().first};
-        uint64_t count = kv_list.size();
-
-        // Write the header
-        bin_out.write(reinterpret_cast<const char *>(&timestamp), sizeof timestamp)
-            .write(reinterpret_cast<const char *>(&count), sizeof count)
-            .write(reinterpret_cast<const char *>(&range), sizeof range);
-
-        // Write the bloom filter
-        bin_out << bft;
-
-        // The below implements are value_type-dependent
-
-        // Write the index table
-        decltype(sst::sst_cache{}.indices) indices;
-        indices.reserve(count);
-
-        lsm::offset_type offset =
-            32 + lsm::BLF_SIZE + count * (sizeof(key_type) + sizeof(lsm::offset_type));
-        for (kv_type &kv : kv_list) {
-            bin_out.write(reinterpret_cast<const char *>(&kv.first), sizeof(key_type))
-                .write(reinterpret_cast<const char *>(&offset), sizeof(lsm::offset_type));
-            indices.emplace_back(kv.first, offset);
-            offset += kv.second.length() + 1;  // null-terminated
-        }
+        return cache_ptr;
+    }
+};
 
-        // Write the value data
-        for (kv_type &kv : kv_list) {
-            bin_out.write(kv.second.c_str(), kv.second.length() + 1);
-        }
+// Key range and size of an sst in the level below the compaction output (the "grandparent"
+// level). Compaction cuts its outputs at these boundaries.
+struct file_boundary {
+    lsm::key_type lower, upper;
+    lsm::size_type size;
+};
 
-        this->byte_size = 32 + lsm::BLF_SIZE;
+// Whether any table older than the compaction inputs may hold a key in [begin, end].
+using overlap_predicate = std::function<bool(lsm::key_type, lsm::key_type)>;
 
-        return new sst_cache{level,
-                             {timestamp, count, range.first, range.second},
-                             std::move(bft),
-                             std::move(indices),
-                             {bin_name}};
-    }
-};
+// A key range of a compaction, [first, second].
+using key_range = std::pair<lsm::key_type, lsm::key_type>;
 
-/**
- * @brief Merge sort multiple sst files. This function will delete all the referred ssts,
- *        and write at least several ssts into the target level.
- * @param cache_list
- * @param level the target level where the compacted ssts are put into.
- * @return std::vector<sst::sst_cache> the caches associated with newly-created ssts.
- */
-inline std::vector<sst_cache> sort_and_merge(const std::vector<sst_cache> &cache_list,
-                                             std::string target_dir, bool is_last = false) {
-    using kv_type = std::pair<lsm::key_type, lsm::value_type>;
+// `sort_and_merge` of the keys in `range` only. The outputs keep the parts of the range
+// tombstones within it.
+inline std::vector<sst_cache> merge_key_range(
+    const std::vector<cache_ptr> &cache_list, const std::string &target_dir,
+    const overlap_predicate &overlaps_older, const std::vector<lsm::seq_type> &snapshots,
+    const std::vector<file_boundary> &grandparents, lsm::size_type max_overlap,
+    io::rate_limiter *limiter, const lsm::index_options &index_opts, key_range range) {
+    using kv_type = std::pair<lsm::key_type, record_slice>;
 
-    uint64_t timestamp = cache_list.front().header.time_stamp;
+    uint64_t timestamp = cache_list.front()->header.time_stamp;
     sst_buffer buffer{timestamp, target_dir};
+    buffer.limiter = limiter;
+    buffer.index_opts = index_opts;
+    buffer.range_start = range.first;
+    buffer.range_end = range.second;
+
+    auto can_drop = [&](lsm::key_type begin, lsm::key_type end) -> bool {
+        return overlaps_older && !overlaps_older(begin, end);
+    };
+    // Versions in the same stripe are seen by the same snapshots, and only the newest one of
+    // them is ever read. Stripe 0 is seen by every snapshot.
+    auto stripe = [&](lsm::seq_type seq) -> std::size_t {
+        return std::lower_bound(snapshots.begin(), snapshots.end(), seq) - snapshots.begin();
+    };
 
+    // The records of each input in the range, whose values stay in its block until written
     const std::size_t N = cache_list.size();
+    std::vector<std::string> blocks(N);
     std::vector<std::vector<kv_type>> kv_list;
     kv_list.reserve(N);
 
     for (std::size_t i = 0; i < N; ++i) {
-        kv_list.push_back(cache_list[i].get_kv());
-        utils::rmfile(cache_list.at(i).sst_path.c_str());
+        kv_list.push_back(cache_list[i]->get_slices(blocks[i], limiter, range.first, range.second));
+        for (const auto &range_del : cache_list[i]->range_dels) {
+            if (range_del.end < range.first || range_del.begin > range.second) {
+                continue;
+            }
+            if (!(stripe(range_del.seq) == 0 && can_drop(range_del.begin, range_del.end))) {
+                buffer.range_dels.push_back(range_del);
+            }
+        }
     }
+    std::sort(buffer.range_dels.begin(), buffer.range_dels.end(),
+              [](const lsm::range_tombstone &r1, const lsm::range_tombstone &r2) -> bool {
+                  return r1.begin < r2.begin;
+              });
+
+    // Whether a range tombstone deletes the version, and no snapshot sees the version.
+    auto is_covered = [&](lsm::key_type key, lsm::seq_type seq) -> bool {
+        for (const auto &cache : cache_list) {
+            for (const auto &range : cache->range_dels) {
+                if (range.begin > key) {
+                    break;
+                }
+                if (range.covers(key) && range.seq > seq && stripe(range.seq) == stripe(seq)) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    };
 
     std::vector<std::size_t> p(N, 0);
 
-    auto key_to_select = [&](std::size_t i) -> lsm::key_type {
-        return kv_list.at(i).at(p.at(i)).first;
+    std::vector<sst_cache> res{};
+    auto push_cache = [&](sst_cache *cache_ptr) -> void {
+        if (cache_ptr) {
+            res.push_back(std::move(*cache_ptr));
+            delete cache_ptr;
+        }
     };
 
-    auto remove_cache = [&](std::size_t i) -> void {
-        if (++p[i] == kv_list.at(i).size()) {
-            kv_list.erase(kv_list.begin() + i);
-            p.erase(p.begin() + i);
+    // Whether the output should be cut before `key`, see leveldb's `ShouldStopBefore`.
+    std::size_t gp_index = 0;
+    lsm::size_type overlapped_bytes = 0;
+    bool seen_key = false;
+    auto should_stop_before = [&](lsm::key_type key) -> bool {
+        while (gp_index < grandparents.size() && key > grandparents[gp_index].upper) {
+            if (seen_key) {
+                overlapped_bytes += grandparents[gp_index].size;
+            }
+            ++gp_index;
+        }
+        seen_key = true;
+        if (overlapped_bytes > max_overlap) {
+            overlapped_bytes = 0;
+            return true;
         }
+        return false;
     };
 
-    std::vector<sst_cache> res{};
-
-    while (!p.empty()) {
-        std::size_t selected = 0;
-        auto selected_key = key_to_select(selected);
-        for (std::size_t i = 1; i < p.size(); ++i) {
-            auto tmp = key_to_select(i);
-            if (tmp == selected_key) {
-                remove_cache(i--);
-            } else if (tmp < selected_key) {
-                selected_key = tmp;
+    std::vector<record_slice> versions{};
+    while (true) {
+        // The smallest key
+        std::size_t selected = N;
+        for (std::size_t i = 0; i < N; ++i) {
+            if (p[i] == kv_list[i].size()) {
+                continue;
+            }
+            if (selected == N || kv_list[i][p[i]].first < kv_list[selected][p[selected]].first) {
                 selected = i;
             }
         }
-        auto &selected_kv_list = kv_list.at(selected);
-        lsm::value_type to_append_value = selected_kv_list.at(p.at(selected)).second;
-        if (!is_last || to_append_value != lsm::DeleteNote) {
-            auto cache_ptr = buffer.append(selected_key, to_append_value);
-            if (cache_ptr) {
-                res.push_back(std::move(*cache_ptr));
-                delete cache_ptr;
+        if (selected == N) {
+            break;
+        }
+        auto selected_key = kv_list[selected][p[selected]].first;
+
+        // Gather its versions from all the inputs, the newest first
+        versions.clear();
+        for (std::size_t i = 0; i < N; ++i) {
+            for (; p[i] < kv_list[i].size() && kv_list[i][p[i]].first == selected_key; ++p[i]) {
+                versions.push_back(kv_list[i][p[i]].second);
+            }
+        }
+        std::stable_sort(versions.begin(), versions.end(),
+                         [](const record_slice &r1, const record_slice &r2) -> bool {
+                             return r1.seq > r2.seq;
+                         });
+
+        bool is_first = true;
+        std::size_t last_stripe = snapshots.size() + 1;
+        for (const auto &version : versions) {
+            std::size_t cur_stripe = stripe(version.seq);
+            if (cur_stripe == last_stripe) {
+                continue;  // Hidden by a newer version in the same stripe
+            }
+            last_stripe = cur_stripe;
+            if (is_covered(selected_key, version.seq) ||
+                (version.is_deleted() && cur_stripe == 0 &&
+                 can_drop(selected_key, selected_key))) {
+                continue;
             }
+            if (is_first && should_stop_before(selected_key)) {
+                push_cache(buffer.cut(selected_key));
+            }
+            is_first = false;
+            push_cache(buffer.append(selected_key, version));
         }
-        remove_cache(selected);
     }
     // Clear the resident kv
-    auto cache_ptr = buffer.clear();
-    if (cache_ptr) {
-        res.push_back(std::move(*cache_ptr));
-        delete cache_ptr;
+    push_cache(buffer.clear());
+    return res;
+}
+
+
+/**
+ * @brief Split the keys of the compaction inputs into at most `n` ranges of about as many
+ *        records, at keys sampled from their indices. The versions of a key fall in one range.
+ * @return the ranges in order, covering every key.
+ */
+inline std::vector<key_range> split_key_range(const std::vector<cache_ptr> &cache_list,
+                                              std::size_t n) {
+    constexpr lsm::key_type MAX_KEY = std::numeric_limits<lsm::key_type>::max();
+    // Keys standing for the records after them, up to the next sample of the same input
+    std::vector<std::pair<lsm::key_type, lsm::size_type>> samples{};
+    lsm::size_type total = 0;
+    for (const auto &cache : cache_list) {
+        if (n <= 1 || cache->header.count == 0) {
+            continue;
+        }
+        auto meta = cache->metadata();
+        const key_index &indices = meta->indices;
+        lsm::size_type stride = std::max<lsm::size_type>(indices.size() / (16 * n), 1);
+        lsm::size_type rank = 0;
+        for (auto pos = indices.first(); pos != key_index::npos; pos = indices.next(pos), ++rank) {
+            if (rank % stride == 0) {
+                samples.emplace_back(indices.key(pos), std::min(stride, indices.size() - rank));
+            }
+        }
+        total += indices.size();
+    }
+    std::sort(samples.begin(), samples.end());
+
+    std::vector<key_range> ranges{};
+    lsm::key_type first = 0;
+    lsm::size_type seen = 0;
+    for (const auto &sample : samples) {
+        // A range starts at the sample passing the next share of the records
+        if (sample.first > first && seen * n >= total * (ranges.size() + 1)) {
+            ranges.emplace_back(first, sample.first - 1);
+            first = sample.first;
+        }
+        seen += sample.second;
+    }
+    ranges.emplace_back(first, MAX_KEY);
+    return ranges;
+}
+
+/**
+ * @brief Merge sort multiple sst files into at least several ssts in the target level.
+ *        The caller removes the referred ssts.
+ * @param cache_list ordered from the newest to the oldest.
+ * @param level the target level where the compacted ssts are put into.
+ * @param overlaps_older tombstones are dropped once no older table overlaps them.
+ *        Tombstones are always kept if it is empty. It may be called from several threads.
+ * @param snapshots the sequence numbers of live snapshots in ascending order. Besides the
+ *        newest version of a key, the newest version visible at each snapshot is kept.
+ * @param grandparents ssts of the level after the target level, ordered by key range.
+ * @param max_overlap an output is cut before it overlaps more bytes than this in `grandparents`.
+ * @param limiter paces the reads of the inputs and the writes of the outputs, if any.
+ * @param index_opts how the indices of the outputs are laid out in the memory.
+ * @param subcompactions the keys are split into up to this many ranges, see `split_key_range`,
+ *        each merged by its own thread into its own outputs.
+ * @return std::vector<sst::sst_cache> the caches associated with newly-created ssts, ordered
+ *         by key range.
+ */
+inline std::vector<sst_cache> sort_and_merge(
+    const std::vector<cache_ptr> &cache_list, std::string target_dir,
+    const overlap_predicate &overlaps_older = nullptr,
+    const std::vector<lsm::seq_type> &snapshots = {},
+    const std::vector<file_boundary> &grandparents = {},
+    lsm::size_type max_overlap = std::numeric_limits<lsm::size_type>::max(),
+    io::rate_limiter *limiter = nullptr, const lsm::index_options &index_opts = {},
+    std::size_t subcompactions = 1) {
+    std::vector<key_range> ranges = split_key_range(cache_list, subcompactions);
+    std::vector<std::vector<sst_cache>> outputs(ranges.size());
+    std::vector<std::exception_ptr> errors(ranges.size());
+    auto merge = [&](std::size_t i) {
+        try {
+            outputs[i] = merge_key_range(cache_list, target_dir, overlaps_older, snapshots,
+                                         grandparents, max_overlap, limiter, index_opts,
+                                         ranges[i]);
+        } catch (...) {
+            errors[i] = std::current_exception();
+        }
+    };
+    std::vector<std::thread> threads{};
+    for (std::size_t i = 1; i < ranges.size(); ++i) {
+        threads.emplace_back(merge, i);
+    }
+    merge(0);
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    std::vector<sst_cache> res{};
+    for (std::size_t i = 0; i < ranges.size(); ++i) {
+        if (errors[i]) {
+            // The outputs of the other ranges are of no use without this one
+            for (const auto &output : outputs) {
+                for (const auto &cache : output) {
+                    utils::rmfile(cache.sst_path.c_str());
+                }
+            }
+            std::rethrow_exception(errors[i]);
+        }
+        std::move(outputs[i].begin(), outputs[i].end(), std::back_inserter(res));
     }
     return res;
 }
 
 }  // namespace sst
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,581 @@
+/**
+ * @file sst_index.hpp
+ * @brief The in-memory index of an sst: its keys and the offsets of their records, laid out for
+ *        searching.
+ */
+#ifndef SST_INDEX
+#define SST_INDEX
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "types.hpp"
+
+#if !defined(LSM_NO_SIMD) && defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SST_INDEX_AVX2
+#include <immintrin.h>
+#endif
+
+namespace sst {
+
+// Hands out memory aligned to `Align` bytes, so that a node of the index fills a cache line.
+template <typename T, std::size_t Align>
+struct aligned_allocator {
+    using value_type = T;
+    template <typename U>
+    struct rebind {
+        using other = aligned_allocator<U, Align>;
+    };
+
+    aligned_allocator() = default;
+    template <typename U>
+    aligned_allocator(const aligned_allocator<U, Align> &) noexcept {}
+
+    T *allocate(std::size_t n) {
+        void *p = nullptr;
+        if (::posix_memalign(&p, Align, n * sizeof(T)) != 0) {
+            throw std::bad_alloc{};
+        }
+        return static_cast<T *>(p);
+    }
+    void deallocate(T *p, std::size_t) noexcept {
+        std::free(p);
+    }
+
+    friend bool operator==(const aligned_allocator &, const aligned_allocator &) noexcept {
+        return true;
+    }
+    friend bool operator!=(const aligned_allocator &, const aligned_allocator &) noexcept {
+        return false;
+    }
+};
+
+/**
+ * @brief The keys of an sst and the offsets of their records, in two arrays (12 bytes a key
+ *        instead of the 16 of a padded pair). The keys are laid out by `lsm::index_layout`:
+ *        - `BTREE`: an implicit B-tree. A node holds 8 ascending keys in a cache line, and the
+ *          children of node `k` are the nodes `k * 9 + 1` to `k * 9 + 9`. A search reads one
+ *          cache line per level, and compares the keys of a node at once with AVX2 where the
+ *          CPU has it.
+ *        - `LEARNED`: in key order, with a piecewise linear model mapping a key to its rank
+ *          within `max_error`. A search binary searches the few entries around the guess of
+ *          the model. The model of dense or evenly spread keys is a handful of segments.
+ *        - `DELTA`: the block of `encode`, a few bytes a key. A search binary searches the
+ *          restart points, and decodes the entries of one restart interval. So does reading
+ *          an entry.
+ *
+ *        An entry is referred to by its `position` in the layout, which is not its rank in
+ *        general. The entries are walked in key order with `first`, `next`, `last` and `prev`.
+ */
+class key_index {
+public:
+    using key_type = lsm::key_type;
+    using offset_type = lsm::offset_type;
+    using position = std::size_t;
+    static constexpr position npos = std::numeric_limits<position>::max();
+    static constexpr std::size_t NODE_KEYS = 8;
+
+    key_index() noexcept
+        : count(0), nodes(0), interval(1), max_key(0), first_pos(npos), last_pos(npos) {}
+
+    // `sorted_keys` ascending, and `sorted_offsets` of the same length.
+    key_index(const std::vector<key_type> &sorted_keys,
+              const std::vector<offset_type> &sorted_offsets,
+              const lsm::index_options &opts = {})
+        : opts(opts),
+          count(sorted_keys.size()),
+          nodes(opts.layout == lsm::index_layout::BTREE ? (count + NODE_KEYS - 1) / NODE_KEYS
+                                                         : 0),
+          interval(1),
+          max_key(0),
+          first_pos(npos),
+          last_pos(npos) {
+        if (opts.layout == lsm::index_layout::DELTA) {
+            *this = key_index{encode(sorted_keys, sorted_offsets, opts.restart_interval), opts};
+            return;
+        }
+        if (count == 0) {
+            return;
+        }
+        max_key = sorted_keys.back();
+        if (opts.layout == lsm::index_layout::LEARNED) {
+            keys.assign(sorted_keys.begin(), sorted_keys.end());
+            offsets = sorted_offsets;
+            first_pos = 0;
+            last_pos = count - 1;
+            build_model();
+            return;
+        }
+        keys.assign(nodes * NODE_KEYS, std::numeric_limits<key_type>::max());
+        offsets.assign(nodes * NODE_KEYS, 0);
+        // The slots are filled in key order. The unused ones end the order with the largest key.
+        first_pos = leftmost(0);
+        position pos = first_pos;
+        for (std::size_t rank = 0; rank < count; ++rank) {
+            keys[pos] = sorted_keys[rank];
+            offsets[pos] = sorted_offsets[rank];
+            last_pos = pos;
+            pos = advance(pos);
+        }
+    }
+
+    // The `DELTA` layout of a block checked by `decode`.
+    key_index(std::string encoded, const lsm::index_options &opts)
+        : opts(opts),
+          count(0),
+          nodes(0),
+          interval(fixed<uint32_t>(&encoded[4])),
+          max_key(0),
+          block(std::move(encoded)),
+          first_pos(npos),
+          last_pos(npos) {
+        this->opts.layout = lsm::index_layout::DELTA;
+        decode(block, [this](key_type key, offset_type) {
+            max_key = key;
+            ++count;
+        });
+        if (count > 0) {
+            first_pos = 0;
+            last_pos = count - 1;
+        }
+    }
+
+    /**
+     * @brief The delta encoding of sorted entries, as an sst stores its index with
+     *        `lsm::index_encoding::DELTA`:
+     *          size (4 B) | interval (4 B) | restart count (4 B) | restarts (4 B each) | entries
+     *        Every `interval`-th entry is a restart point: its key (8 B) and offset (4 B) in
+     *        full, found in the block at its element of `restarts`. The other entries are the
+     *        varint deltas of their key and their offset from the entry before.
+     */
+    static std::string encode(const std::vector<key_type> &sorted_keys,
+                              const std::vector<offset_type> &sorted_offsets,
+                              std::size_t interval) {
+        interval = std::max<std::size_t>(interval, 1);
+        const std::size_t n = sorted_keys.size();
+        const uint32_t restart_count = (n + interval - 1) / interval;
+        const uint32_t head = 12 + 4 * restart_count;
+        std::string entries;
+        std::vector<uint32_t> restarts;
+        for (std::size_t i = 0; i < n; ++i) {
+            if (i % interval == 0) {
+                restarts.push_back(head + entries.size());
+                entries.append(reinterpret_cast<const char *>(&sorted_keys[i]), sizeof(key_type));
+                entries.append(reinterpret_cast<const char *>(&sorted_offsets[i]),
+                               sizeof(offset_type));
+            } else {
+                put_varint(entries, sorted_keys[i] - sorted_keys[i - 1]);
+                put_varint(entries, sorted_offsets[i] - sorted_offsets[i - 1]);
+            }
+        }
+        uint32_t head_fields[3] = {static_cast<uint32_t>(head + entries.size()),
+                                   static_cast<uint32_t>(interval), restart_count};
+        std::string block(reinterpret_cast<const char *>(head_fields), sizeof head_fields);
+        block.append(reinterpret_cast<const char *>(restarts.data()), 4 * restarts.size());
+        return block + entries;
+    }
+
+    // The size of `encode(sorted_keys, sorted_offsets, interval)`, which moving every offset
+    // by the same amount leaves unchanged.
+    static std::size_t encoded_size(const std::vector<key_type> &sorted_keys,
+                                    const std::vector<offset_type> &sorted_offsets,
+                                    std::size_t interval) {
+        interval = std::max<std::size_t>(interval, 1);
+        const std::size_t n = sorted_keys.size();
+        std::size_t size = 12 + 4 * ((n + interval - 1) / interval);
+        for (std::size_t i = 0; i < n; ++i) {
+            if (i % interval == 0) {
+                size += sizeof(key_type) + sizeof(offset_type);
+            } else {
+                size += varint_size(sorted_keys[i] - sorted_keys[i - 1]) +
+                        varint_size(sorted_offsets[i] - sorted_offsets[i - 1]);
+            }
+        }
+        return size;
+    }
+
+    /**
+     * @brief Visit the entries of an encoded block in order, by `visit(key, offset)`.
+     * @return false if the block is malformed. The entries before the fault are visited.
+     */
+    template <typename Visitor>
+    static bool decode(const std::string &block, Visitor &&visit) {
+        if (block.size() < 12 || fixed<uint32_t>(&block[0]) != block.size()) {
+            return false;
+        }
+        const std::size_t interval = fixed<uint32_t>(&block[4]);
+        const std::size_t restart_count = fixed<uint32_t>(&block[8]);
+        if (interval == 0 || (block.size() - 12) / 4 < restart_count) {
+            return false;
+        }
+        const char *p = block.data() + 12 + 4 * restart_count, *end = block.data() + block.size();
+        key_type key = 0;
+        uint64_t offset = 0;
+        for (std::size_t i = 0; p != end; ++i) {
+            if (i % interval == 0) {
+                if (i / interval >= restart_count ||
+                    fixed<uint32_t>(&block[12 + 4 * (i / interval)]) !=
+                        static_cast<std::size_t>(p - block.data()) ||
+                    end - p < 12) {
+                    return false;
+                }
+                key = fixed<key_type>(p);
+                offset = fixed<offset_type>(p + 8);
+                p += 12;
+            } else {
+                uint64_t key_delta, offset_delta;
+                if (!(p = get_varint(p, end, key_delta)) ||
+                    !(p = get_varint(p, end, offset_delta))) {
+                    return false;
+                }
+                key += key_delta;
+                offset += offset_delta;
+            }
+            visit(key, static_cast<offset_type>(offset));
+        }
+        return true;
+    }
+
+    std::size_t size() const noexcept {
+        return count;
+    }
+    bool empty() const noexcept {
+        return count == 0;
+    }
+    lsm::index_layout layout() const noexcept {
+        return opts.layout;
+    }
+    // Bytes held by the arrays, the model and the block.
+    std::size_t memory_usage() const noexcept {
+        return keys.capacity() * sizeof(key_type) + offsets.capacity() * sizeof(offset_type) +
+               segments.capacity() * sizeof(segment) +
+               (opts.layout == lsm::index_layout::DELTA ? block.capacity() : 0);
+    }
+    // Segments of the model, 0 unless `LEARNED`.
+    std::size_t model_size() const noexcept {
+        return segments.size();
+    }
+
+    key_type key(position pos) const noexcept {
+        return opts.layout == lsm::index_layout::DELTA ? entry(pos).first : keys[pos];
+    }
+    offset_type offset(position pos) const noexcept {
+        return opts.layout == lsm::index_layout::DELTA ? entry(pos).second : offsets[pos];
+    }
+
+    // The entry of the smallest key, `npos` if empty.
+    position first() const noexcept {
+        return first_pos;
+    }
+    // The entry of the largest key, `npos` if empty.
+    position last() const noexcept {
+        return last_pos;
+    }
+    // The entry after `pos` in key order, `npos` after the last one.
+    position next(position pos) const noexcept {
+        if (pos == last_pos) {
+            return npos;
+        }
+        return opts.layout == lsm::index_layout::BTREE ? advance(pos) : pos + 1;
+    }
+    // The entry before `pos` in key order, `npos` before the first one.
+    position prev(position pos) const noexcept {
+        if (pos == first_pos) {
+            return npos;
+        }
+        return opts.layout == lsm::index_layout::BTREE ? retreat(pos) : pos - 1;
+    }
+
+    // The first entry whose key is not less than `key`, `npos` if there is none.
+    position lower_bound(key_type key) const noexcept {
+        if (count == 0 || key > max_key) {
+            return npos;
+        }
+        if (opts.layout == lsm::index_layout::LEARNED) {
+            return search_model(key);
+        }
+        if (opts.layout == lsm::index_layout::DELTA) {
+            return search_block(key);
+        }
+#ifdef SST_INDEX_AVX2
+        static const bool has_avx2 = __builtin_cpu_supports("avx2");
+        if (has_avx2) {
+            return search_avx2(key);
+        }
+#endif
+        return search(key);
+    }
+    // The first entry whose key is greater than `key`, `npos` if there is none.
+    position upper_bound(key_type key) const noexcept {
+        return key == std::numeric_limits<key_type>::max() ? npos : lower_bound(key + 1);
+    }
+
+private:
+    // The keys from `first_key` up to the first key of the next segment, whose ranks are
+    // `rank + slope * (key - first_key)` give or take `max_error`.
+    struct segment {
+        key_type first_key;
+        double slope;
+        std::size_t rank;
+    };
+
+    lsm::index_options opts;
+    std::size_t count, nodes;
+    std::size_t interval;  // Of the restart points of `block`
+    key_type max_key;
+    std::vector<key_type, aligned_allocator<key_type, 64>> keys;
+    std::vector<offset_type> offsets;
+    std::vector<segment> segments;
+    std::string block;
+    position first_pos, last_pos;
+
+    template <typename T>
+    static T fixed(const char *p) noexcept {
+        T value;
+        std::memcpy(&value, p, sizeof value);
+        return value;
+    }
+
+    static void put_varint(std::string &out, uint64_t value) {
+        for (; value >= 0x80; value >>= 7) {
+            out.push_back(static_cast<char>(value | 0x80));
+        }
+        out.push_back(static_cast<char>(value));
+    }
+
+    static std::size_t varint_size(uint64_t value) noexcept {
+        std::size_t size = 1;
+        for (; value >= 0x80; value >>= 7) {
+            ++size;
+        }
+        return size;
+    }
+
+    // The position after the varint at `p`, null if it runs past `end`.
+    static const char *get_varint(const char *p, const char *end, uint64_t &value) noexcept {
+        value = 0;
+        for (int shift = 0; p != end && shift < 64; shift += 7) {
+            auto byte = static_cast<unsigned char>(*p++);
+            value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if (byte < 0x80) {
+                return p;
+            }
+        }
+        return nullptr;
+    }
+
+    // Where the restart point `r` starts in the block.
+    const char *restart(std::size_t r) const noexcept {
+        return block.data() + fixed<uint32_t>(&block[12 + 4 * r]);
+    }
+
+    // Decodes the restart interval of `pos` up to it.
+    std::pair<key_type, offset_type> entry(position pos) const noexcept {
+        const char *p = restart(pos / interval), *end = block.data() + block.size();
+        std::pair<key_type, offset_type> res{fixed<key_type>(p), fixed<offset_type>(p + 8)};
+        p += 12;
+        for (std::size_t i = pos / interval * interval; i < pos; ++i) {
+            uint64_t key_delta, offset_delta;
+            p = get_varint(get_varint(p, end, key_delta), end, offset_delta);
+            res.first += key_delta;
+            res.second += offset_delta;
+        }
+        return res;
+    }
+
+    // The answer is in the restart interval before the first restart point not less than
+    // `key`, or is that restart point.
+    position search_block(key_type key) const noexcept {
+        std::size_t lo = 0, hi = (count + interval - 1) / interval;
+        while (lo < hi) {
+            std::size_t mid = (lo + hi) / 2;
+            if (fixed<key_type>(restart(mid)) < key) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo == 0) {
+            return 0;
+        }
+        position pos = (lo - 1) * interval;
+        const char *p = restart(lo - 1), *end = block.data() + block.size();
+        key_type cur = fixed<key_type>(p);
+        p += 12;
+        for (; cur < key && ++pos < lo * interval;) {
+            uint64_t key_delta, offset_delta;
+            p = get_varint(get_varint(p, end, key_delta), end, offset_delta);
+            cur += key_delta;
+        }
+        return pos;
+    }
+
+    // Fits the segments from the first key on, each as long as a slope keeps all its keys
+    // within the error (the shrinking cone of FITing-tree). A key of several versions is
+    // modelled by its first version.
+    void build_model() {
+        const double error = static_cast<double>(opts.max_error);
+        std::size_t begin = 0;
+        while (begin < count) {
+            segment seg{keys[begin], 0, begin};
+            double lo = 0, hi = std::numeric_limits<double>::infinity();
+            std::size_t end = begin + 1;
+            for (; end < count; ++end) {
+                if (keys[end] == keys[end - 1]) {
+                    continue;
+                }
+                double dx = static_cast<double>(keys[end] - seg.first_key);
+                double dy = static_cast<double>(end - begin);
+                double new_lo = std::max(lo, (dy - error) / dx);
+                double new_hi = std::min(hi, (dy + error) / dx);
+                if (new_lo > new_hi) {
+                    break;
+                }
+                lo = new_lo;
+                hi = new_hi;
+            }
+            seg.slope = hi == std::numeric_limits<double>::infinity() ? 0 : (lo + hi) / 2;
+            segments.push_back(seg);
+            begin = end;
+        }
+        segments.shrink_to_fit();
+    }
+
+    // The keys missing from the sst may land outside the window of the model, as may the keys
+    // after a key of many versions. Then the whole segment is searched.
+    position search_model(key_type key) const noexcept {
+        auto seg = std::upper_bound(
+            segments.begin(), segments.end(), key,
+            [](key_type k, const segment &s) { return k < s.first_key; });
+        if (seg == segments.begin()) {
+            return 0;
+        }
+        --seg;
+        std::size_t begin = seg->rank, end = seg + 1 == segments.end() ? count : seg[1].rank;
+        double guess = seg->rank + seg->slope * static_cast<double>(key - seg->first_key);
+        double error = static_cast<double>(opts.max_error);
+        std::size_t lo = static_cast<std::size_t>(
+            std::min(std::max(guess - error, static_cast<double>(begin)),
+                     static_cast<double>(end)));
+        std::size_t hi = static_cast<std::size_t>(
+            std::min(std::max(guess + error + 2, static_cast<double>(lo)),
+                     static_cast<double>(end)));
+        const key_type *base = keys.data();
+        std::size_t pos = std::lower_bound(base + lo, base + hi, key) - base;
+        if ((lo > begin && keys[lo - 1] >= key) || (pos == hi && hi < end)) {
+            pos = std::lower_bound(base + begin, base + end, key) - base;
+        }
+        return pos;
+    }
+
+    std::size_t child(std::size_t node, std::size_t i) const noexcept {
+        return node * (NODE_KEYS + 1) + i + 1;
+    }
+
+    // The first key of a node not less than `key` bounds the answer, and the subtree left of it
+    // may hold a smaller one. So the slot found in the deepest node is the answer.
+    position search(key_type key) const noexcept {
+        position res = npos;
+        for (std::size_t node = 0; node < nodes;) {
+            const key_type *node_keys = &keys[node * NODE_KEYS];
+            std::size_t i = 0;
+            for (std::size_t j = 0; j < NODE_KEYS; ++j) {
+                i += node_keys[j] < key;
+            }
+            if (i < NODE_KEYS) {
+                res = node * NODE_KEYS + i;
+            }
+            node = child(node, i);
+        }
+        return res;
+    }
+
+#ifdef SST_INDEX_AVX2
+    // The same as above. AVX2 compares signed integers, so the keys are compared with their
+    // top bits flipped.
+    __attribute__((target("avx2"))) position search_avx2(key_type key) const noexcept {
+        const __m256i sign = _mm256_set1_epi64x(std::numeric_limits<int64_t>::min());
+        const __m256i target = _mm256_xor_si256(_mm256_set1_epi64x(key), sign);
+        position res = npos;
+        for (std::size_t node = 0; node < nodes;) {
+            const auto *node_keys = reinterpret_cast<const __m256i *>(&keys[node * NODE_KEYS]);
+            __m256i lo = _mm256_xor_si256(_mm256_load_si256(node_keys), sign);
+            __m256i hi = _mm256_xor_si256(_mm256_load_si256(node_keys + 1), sign);
+            int less = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(target, lo))) |
+                       _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(target, hi)))
+                           << 4;
+            std::size_t i = __builtin_popcount(less);
+            if (i < NODE_KEYS) {
+                res = node * NODE_KEYS + i;
+            }
+            node = child(node, i);
+        }
+        return res;
+    }
+#endif
+
+    // The first slot of the subtree of the node in key order.
+    position leftmost(std::size_t node) const noexcept {
+        while (child(node, 0) < nodes) {
+            node = child(node, 0);
+        }
+        return node * NODE_KEYS;
+    }
+    // The last slot of the subtree of the node in key order.
+    position rightmost(std::size_t node) const noexcept {
+        while (child(node, NODE_KEYS) < nodes) {
+            node = child(node, NODE_KEYS);
+        }
+        return node * NODE_KEYS + NODE_KEYS - 1;
+    }
+
+    // The slot after `pos` in key order, unused ones included.
+    position advance(position pos) const noexcept {
+        std::size_t node = pos / NODE_KEYS, i = pos % NODE_KEYS;
+        if (child(node, i + 1) < nodes) {
+            return leftmost(child(node, i + 1));
+        }
+        if (i + 1 < NODE_KEYS) {
+            return pos + 1;
+        }
+        // Up to the first ancestor reached from a child other than its last one
+        while (node != 0) {
+            std::size_t parent = (node - 1) / (NODE_KEYS + 1), j = (node - 1) % (NODE_KEYS + 1);
+            if (j < NODE_KEYS) {
+                return parent * NODE_KEYS + j;
+            }
+            node = parent;
+        }
+        return npos;
+    }
+    // The slot before `pos` in key order.
+    position retreat(position pos) const noexcept {
+        std::size_t node = pos / NODE_KEYS, i = pos % NODE_KEYS;
+        if (child(node, i) < nodes) {
+            return rightmost(child(node, i));
+        }
+        if (i > 0) {
+            return pos - 1;
+        }
+        // Up to the first ancestor reached from a child other than its first one
+        while (node != 0) {
+            std::size_t parent = (node - 1) / (NODE_KEYS + 1), j = (node - 1) % (NODE_KEYS + 1);
+            if (j > 0) {
+                return parent * NODE_KEYS + j - 1;
+            }
+            node = parent;
+        }
+        return npos;
+    }
+};
+
+}  // namespace sst
+
+#endif
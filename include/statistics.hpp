@@ -0,0 +1,372 @@
+/**
+ * @file statistics.hpp
+ * @brief Counters and latency histograms of a `KVStore`, dumped as text or JSON.
+ */
+#ifndef LSM_STATISTICS
+#define LSM_STATISTICS
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <sstream>
+#include <string>
+
+namespace lsm {
+
+enum ticker : uint32_t {
+    MEMTABLE_HIT,              // Lookups answered by the memory table
+    MEMTABLE_MISS,             // Lookups which went on to the ssts
+    SST_BLOCK_READS,           // Record blocks read by lookups
+    KEYS_SCANNED,              // Pairs returned by scans
+    USER_BYTES_WRITTEN,        // Keys and values of the writes
+    FLUSH_BYTES_WRITTEN,       // Bytes of sst written by memory table flushes
+    COMPACTION_BYTES_READ,     // Bytes of sst read by merges
+    COMPACTION_BYTES_WRITTEN,  // Bytes of sst written by merges
+    STALL_MICROS,              // Time the writes were delayed or blocked
+    METADATA_CACHE_HIT,        // Filters and indices found in the metadata cache
+    METADATA_CACHE_MISS,       // Filters and indices read again from the ssts
+    ROW_CACHE_HIT,             // Gets answered by the row cache
+    ROW_CACHE_MISS,            // Gets which went on to the memory table
+    RANGE_FILTER_NEGATIVE,     // Ssts in the key range of a scan, skipped by their range filter
+    RANGE_FILTER_POSITIVE,     // Ssts in the key range of a scan, passed by their range filter
+    VALUE_LOG_BYTES_WRITTEN,   // Bytes of value log written by flushes and garbage collection
+    TICKER_COUNT
+};
+
+// Bloom filter outcomes of the ssts a lookup checks, counted per level.
+enum level_ticker : uint32_t {
+    BLOOM_NEGATIVE,        // The filter ruled the key out
+    BLOOM_POSITIVE,        // The filter passed the key, and the sst has it
+    BLOOM_FALSE_POSITIVE,  // The filter passed the key, but the sst does not have it
+    LEVEL_TICKER_COUNT
+};
+
+enum histogram : uint32_t {
+    GET_NANOS,
+    MULTI_GET_NANOS,  // Per batch
+    PUT_NANOS,
+    DEL_NANOS,
+    DEL_RANGE_NANOS,
+    SCAN_NANOS,
+    SST_PROBES_PER_GET,  // Ssts whose filter a lookup checks
+    HISTOGRAM_COUNT
+};
+
+constexpr int STATISTICS_MAX_LEVELS = 8;  // Deeper levels are counted in the last one
+
+inline const char *ticker_name(ticker t) noexcept {
+    static const char *const names[] = {
+        "lsm.memtable.hit",           "lsm.memtable.miss",
+        "lsm.sst.block.reads",        "lsm.scan.keys",
+        "lsm.user.bytes.written",     "lsm.flush.bytes.written",
+        "lsm.compaction.bytes.read",  "lsm.compaction.bytes.written",
+        "lsm.stall.micros",           "lsm.metadata.cache.hit",
+        "lsm.metadata.cache.miss",    "lsm.row.cache.hit",
+        "lsm.row.cache.miss",         "lsm.range.filter.negative",
+        "lsm.range.filter.positive",  "lsm.value.log.bytes.written",
+    };
+    static_assert(sizeof names / sizeof *names == TICKER_COUNT, "A ticker has no name");
+    return names[t];
+}
+
+inline const char *level_ticker_name(level_ticker t) noexcept {
+    static const char *const names[] = {
+        "lsm.bloom.negative",
+        "lsm.bloom.positive",
+        "lsm.bloom.false.positive",
+    };
+    static_assert(sizeof names / sizeof *names == LEVEL_TICKER_COUNT, "A ticker has no name");
+    return names[t];
+}
+
+inline const char *histogram_name(histogram h) noexcept {
+    static const char *const names[] = {
+        "lsm.get.nanos",    "lsm.multi.get.nanos", "lsm.put.nanos",
+        "lsm.del.nanos",    "lsm.del.range.nanos", "lsm.scan.nanos",
+        "lsm.sst.probes.per.get",
+    };
+    static_assert(sizeof names / sizeof *names == HISTOGRAM_COUNT, "A histogram has no name");
+    return names[h];
+}
+
+struct histogram_summary {
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t min = 0;
+    uint64_t max = 0;
+    double average = 0;
+    double p50 = 0;
+    double p95 = 0;
+    double p99 = 0;
+};
+
+/**
+ * @brief The counters and histograms shared by every thread of a store. Each thread records
+ *        into its own shard with relaxed atomic adds, so that the threads do not contend for
+ *        cache lines, and the shards are summed when read.
+ *
+ *        A histogram bucket spans a quarter of a power of two, so that a percentile is off by
+ *        at most 25%.
+ */
+class statistics {
+    static constexpr std::size_t SHARDS = 16;  // Threads beyond this share the shards
+    static constexpr std::size_t BUCKETS = 252;  // Enough for every `uint64_t`
+
+    struct histogram_data {
+        std::atomic<uint64_t> count{0}, sum{0};
+        std::atomic<uint64_t> min{UINT64_MAX}, max{0};
+        std::array<std::atomic<uint64_t>, BUCKETS> buckets{};
+    };
+
+    struct shard {
+        std::array<std::atomic<uint64_t>, TICKER_COUNT> tickers{};
+        std::array<std::array<std::atomic<uint64_t>, LEVEL_TICKER_COUNT>, STATISTICS_MAX_LEVELS>
+            level_tickers{};
+        std::array<histogram_data, HISTOGRAM_COUNT> histograms;
+        char padding[64];  // Keeps the hot counters of the next shard off this cache line
+    };
+
+public:
+    statistics() : shards(new shard[SHARDS]) {}
+
+    statistics(const statistics &) = delete;
+    statistics &operator=(const statistics &) = delete;
+
+    void add(ticker t, uint64_t n = 1) noexcept {
+        local().tickers[t].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    void add(level_ticker t, int level, uint64_t n = 1) noexcept {
+        level = std::min(std::max(level, 0), STATISTICS_MAX_LEVELS - 1);
+        local().level_tickers[level][t].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    void record(histogram h, uint64_t value) noexcept {
+        histogram_data &data = local().histograms[h];
+        data.count.fetch_add(1, std::memory_order_relaxed);
+        data.sum.fetch_add(value, std::memory_order_relaxed);
+        data.buckets[bucket_of(value)].fetch_add(1, std::memory_order_relaxed);
+        // Only the threads sharing the shard race on these
+        uint64_t cur = data.min.load(std::memory_order_relaxed);
+        while (value < cur && !data.min.compare_exchange_weak(cur, value,
+                                                              std::memory_order_relaxed)) {
+        }
+        cur = data.max.load(std::memory_order_relaxed);
+        while (value > cur && !data.max.compare_exchange_weak(cur, value,
+                                                              std::memory_order_relaxed)) {
+        }
+    }
+
+    uint64_t get(ticker t) const noexcept {
+        uint64_t total = 0;
+        for (std::size_t i = 0; i < SHARDS; ++i) {
+            total += shards[i].tickers[t].load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    uint64_t get(level_ticker t, int level) const noexcept {
+        uint64_t total = 0;
+        for (std::size_t i = 0; i < SHARDS; ++i) {
+            total += shards[i].level_tickers[level][t].load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    // The sum over the levels.
+    uint64_t get(level_ticker t) const noexcept {
+        uint64_t total = 0;
+        for (int level = 0; level < STATISTICS_MAX_LEVELS; ++level) {
+            total += get(t, level);
+        }
+        return total;
+    }
+
+    histogram_summary get(histogram h) const noexcept {
+        histogram_summary summary{};
+        std::array<uint64_t, BUCKETS> buckets{};
+        summary.min = UINT64_MAX;
+        for (std::size_t i = 0; i < SHARDS; ++i) {
+            const histogram_data &data = shards[i].histograms[h];
+            summary.count += data.count.load(std::memory_order_relaxed);
+            summary.sum += data.sum.load(std::memory_order_relaxed);
+            summary.min = std::min(summary.min, data.min.load(std::memory_order_relaxed));
+            summary.max = std::max(summary.max, data.max.load(std::memory_order_relaxed));
+            for (std::size_t b = 0; b < BUCKETS; ++b) {
+                buckets[b] += data.buckets[b].load(std::memory_order_relaxed);
+            }
+        }
+        if (summary.count == 0) {
+            summary.min = 0;
+            return summary;
+        }
+        summary.average = static_cast<double>(summary.sum) / summary.count;
+        summary.p50 = percentile(buckets, summary, 50);
+        summary.p95 = percentile(buckets, summary, 95);
+        summary.p99 = percentile(buckets, summary, 99);
+        return summary;
+    }
+
+    // Bytes written to ssts and to the value log per byte written by the user, 0 before any
+    // write.
+    double write_amplification() const noexcept {
+        uint64_t user = get(USER_BYTES_WRITTEN);
+        if (user == 0) {
+            return 0;
+        }
+        return static_cast<double>(get(FLUSH_BYTES_WRITTEN) + get(COMPACTION_BYTES_WRITTEN) +
+                                   get(VALUE_LOG_BYTES_WRITTEN)) /
+               user;
+    }
+
+    // Zero everything. Records made concurrently may survive.
+    void reset() noexcept {
+        for (std::size_t i = 0; i < SHARDS; ++i) {
+            for (auto &t : shards[i].tickers) {
+                t.store(0, std::memory_order_relaxed);
+            }
+            for (auto &level : shards[i].level_tickers) {
+                for (auto &t : level) {
+                    t.store(0, std::memory_order_relaxed);
+                }
+            }
+            for (auto &data : shards[i].histograms) {
+                data.count.store(0, std::memory_order_relaxed);
+                data.sum.store(0, std::memory_order_relaxed);
+                data.min.store(UINT64_MAX, std::memory_order_relaxed);
+                data.max.store(0, std::memory_order_relaxed);
+                for (auto &b : data.buckets) {
+                    b.store(0, std::memory_order_relaxed);
+                }
+            }
+        }
+    }
+
+    // One `name value` line per counter, and one line of percentiles per histogram.
+    std::string to_string() const {
+        std::ostringstream os;
+        for (uint32_t t = 0; t < TICKER_COUNT; ++t) {
+            os << ticker_name(static_cast<ticker>(t)) << " COUNT : "
+               << get(static_cast<ticker>(t)) << '\n';
+        }
+        for (uint32_t t = 0; t < LEVEL_TICKER_COUNT; ++t) {
+            auto lt = static_cast<level_ticker>(t);
+            os << level_ticker_name(lt) << " COUNT : " << get(lt);
+            for (int level = 0; level < STATISTICS_MAX_LEVELS; ++level) {
+                os << " L" << level << " : " << get(lt, level);
+            }
+            os << '\n';
+        }
+        os << "lsm.write.amplification : " << write_amplification() << '\n';
+        for (uint32_t h = 0; h < HISTOGRAM_COUNT; ++h) {
+            auto s = get(static_cast<histogram>(h));
+            os << histogram_name(static_cast<histogram>(h)) << " P50 : " << s.p50
+               << " P95 : " << s.p95 << " P99 : " << s.p99 << " MIN : " << s.min
+               << " MAX : " << s.max << " AVG : " << s.average << " COUNT : " << s.count
+               << " SUM : " << s.sum << '\n';
+        }
+        return os.str();
+    }
+
+    // A flat object keyed by the names of `to_string`. Per-level counters are arrays.
+    std::string to_json() const {
+        std::ostringstream os;
+        os << '{';
+        for (uint32_t t = 0; t < TICKER_COUNT; ++t) {
+            os << '"' << ticker_name(static_cast<ticker>(t))
+               << "\":" << get(static_cast<ticker>(t)) << ',';
+        }
+        for (uint32_t t = 0; t < LEVEL_TICKER_COUNT; ++t) {
+            auto lt = static_cast<level_ticker>(t);
+            os << '"' << level_ticker_name(lt) << "\":[";
+            for (int level = 0; level < STATISTICS_MAX_LEVELS; ++level) {
+                os << (level > 0 ? "," : "") << get(lt, level);
+            }
+            os << "],";
+        }
+        os << "\"lsm.write.amplification\":" << write_amplification();
+        for (uint32_t h = 0; h < HISTOGRAM_COUNT; ++h) {
+            auto s = get(static_cast<histogram>(h));
+            os << ",\"" << histogram_name(static_cast<histogram>(h)) << "\":{\"count\":"
+               << s.count << ",\"sum\":" << s.sum << ",\"min\":" << s.min
+               << ",\"max\":" << s.max << ",\"avg\":" << s.average << ",\"p50\":" << s.p50
+               << ",\"p95\":" << s.p95 << ",\"p99\":" << s.p99 << '}';
+        }
+        os << '}';
+        return os.str();
+    }
+
+private:
+    std::unique_ptr<shard[]> shards;
+
+    shard &local() noexcept {
+        static std::atomic<std::size_t> next_index{0};
+        thread_local const std::size_t index = next_index.fetch_add(1) % SHARDS;
+        return shards[index];
+    }
+
+    // Values below 4 get a bucket each; then each power of two is split in four.
+    static std::size_t bucket_of(uint64_t value) noexcept {
+        if (value < 4) {
+            return value;
+        }
+        int exp = 63 - __builtin_clzll(value);
+        return 4 * (exp - 1) + ((value >> (exp - 2)) & 3);
+    }
+
+    // The smallest value of the bucket.
+    static uint64_t bucket_lower(std::size_t bucket) noexcept {
+        if (bucket < 4) {
+            return bucket;
+        }
+        return (4 + bucket % 4) << (bucket / 4 - 1);
+    }
+
+    // Interpolated within the bucket, and clamped to the recorded range.
+    static double percentile(const std::array<uint64_t, BUCKETS> &buckets,
+                             const histogram_summary &summary, double p) noexcept {
+        double threshold = summary.count * p / 100;
+        uint64_t seen = 0;
+        for (std::size_t b = 0; b < BUCKETS; ++b) {
+            if (buckets[b] == 0 || seen + buckets[b] < threshold) {
+                seen += buckets[b];
+                continue;
+            }
+            double lower = bucket_lower(b);
+            double upper = b + 1 < BUCKETS ? bucket_lower(b + 1) : static_cast<double>(UINT64_MAX);
+            double value = lower + (upper - lower) * (threshold - seen) / buckets[b];
+            return std::min(std::max(value, static_cast<double>(summary.min)),
+                            static_cast<double>(summary.max));
+        }
+        return summary.max;
+    }
+};
+
+// Records the time from its construction to its destruction in a histogram, if any.
+class stop_watch {
+    using clock = std::chrono::steady_clock;
+
+public:
+    stop_watch(statistics *stats, histogram h)
+        : stats(stats), h(h), start(stats ? clock::now() : clock::time_point{}) {}
+
+    ~stop_watch() {
+        if (stats) {
+            stats->record(h, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                 clock::now() - start)
+                                 .count());
+        }
+    }
+
+private:
+    statistics *stats;
+    histogram h;
+    clock::time_point start;
+};
+
+}  // namespace lsm
+
+#endif
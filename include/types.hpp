@@ -13,7 +13,66 @@ using offset_type = uint32_t;
 
 constexpr size_type BLF_SIZE = 10240;
 constexpr size_type MTB_MAXSIZE = 2 * 1024 * 1024; /* 2 MB */
-const std::string DeleteNote = "~DELETED~";
+
+// Every write is stamped with a sequence number, starting from 1.
+using seq_type = uint64_t;
+constexpr seq_type MAX_SEQ = UINT64_MAX;
+
+// The type of a record, stored as one byte before the value in an sst.
+enum class record_type : uint8_t {
+    PUT = 0,
+    DELETE = 1,
+    RANGE_DELETE = 2,  // Only appears in the range tombstone block of an sst.
+    VALUE_POINTER = 3,  // The value is in the value log, and the record holds where.
+};
+
+// Whether a record of the type holds a value, in place or in the value log.
+inline bool has_value(record_type type) noexcept {
+    return type == record_type::PUT || type == record_type::VALUE_POINTER;
+}
+
+struct record {
+    record_type type;
+    value_type value;  // Empty for tombstones
+    seq_type seq;
+
+    bool is_deleted() const noexcept {
+        return !has_value(type);
+    }
+};
+
+// A range tombstone deleting the records of keys in [begin, end] written before it.
+struct range_tombstone {
+    key_type begin, end;
+    seq_type seq;
+
+    bool covers(key_type key) const noexcept {
+        return begin <= key && key <= end;
+    }
+};
+
+// How the in-memory index of an sst lays out its keys, see `sst::key_index`.
+enum class index_layout {
+    BTREE,    // An implicit B-tree, searched a cache line at a time
+    LEARNED,  // In key order, searched near where a piecewise linear model of the keys puts them
+    DELTA,    // Varint deltas between restart points, the smallest and the slowest to search
+};
+
+// How an sst stores its index.
+enum class index_encoding {
+    FIXED,  // A key (8 B) and an offset (4 B) an entry
+    DELTA,  // Varint deltas between restart points, see `sst::key_index::encode`
+};
+
+struct index_options {
+    index_layout layout = index_layout::BTREE;
+    // The most a `LEARNED` model may misplace a key by, in entries.
+    size_type max_error = 16;
+    // The encoding of the ssts written. Either encoding is read.
+    index_encoding encoding = index_encoding::FIXED;
+    // Entries from one restart point to the next, when delta encoded.
+    size_type restart_interval = 16;
+};
 };                                                 // namespace lsm
 
-#endif
\ No newline at end of file
+#endif
@@ -138,6 +138,20 @@ namespace utils{
         #endif
     }
 
+    /**
+     * Create a hard link to a file
+     * @param from file to be linked.
+     * @param to new path of the file, on the same file system.
+     * @return 0 if link successfully, -1 otherwise.
+     */
+    static inline int lnfile(const char *from, const char *to){
+        #ifdef _WIN32
+            return ::CreateHardLinkA(to, from, NULL) ? 0 : -1;
+        #else
+            return ::link(from, to) == 0 ? 0 : -1;
+        #endif
+    }
+
 
 
 }
@@ -0,0 +1,515 @@
+/**
+ * @file value_log.hpp
+ * @brief The value log: large values kept apart from the ssts, which hold where they lie, so
+ *        that compaction rewrites the keys but not the values.
+ */
+#ifndef LSM_VALUE_LOG
+#define LSM_VALUE_LOG
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "io.hpp"
+#include "perf_context.hpp"
+#include "rate_limiter.hpp"
+#include "read_engine.hpp"
+#include "statistics.hpp"
+#include "types.hpp"
+#include "utils.h"
+
+namespace lsm {
+
+/**
+ * Layout of a segment of the value log:
+ *   entries (key, seq, size (4 B), value) back to back
+ * A segment is written once, by a flush or by the garbage collection, and removed as a whole.
+ */
+constexpr size_type VLOG_ENTRY_HEADER_SIZE =
+    sizeof(key_type) + sizeof(seq_type) + sizeof(offset_type);
+
+// Where a value lies in the value log: the entry at `offset` of the segment `number`, holding
+// `size` bytes of value.
+struct value_pointer {
+    uint64_t number;
+    offset_type offset;
+    offset_type size;
+
+    // The pointer is stored as the value of a record, in hex so that it holds no '\0'.
+    static constexpr size_type ENCODED_SIZE = 32;
+
+    std::string encode() const {
+        char buf[ENCODED_SIZE + 1];
+        std::snprintf(buf, sizeof buf, "%016llx%08x%08x", static_cast<unsigned long long>(number),
+                      static_cast<unsigned>(offset), static_cast<unsigned>(size));
+        return std::string(buf, ENCODED_SIZE);
+    }
+
+    // Returns: false if `str` is not an encoded pointer.
+    static bool decode(const std::string &str, value_pointer &ptr) noexcept {
+        return decode(str.data(), str.size(), ptr);
+    }
+
+    // The same as above, of the `length` bytes at `str`.
+    static bool decode(const char *str, size_type length, value_pointer &ptr) noexcept {
+        if (length != ENCODED_SIZE) {
+            return false;
+        }
+        auto parse = [str](size_type pos, size_type n, uint64_t &res) -> bool {
+            res = 0;
+            for (size_type i = pos; i < pos + n; ++i) {
+                char c = str[i];
+                int digit = '0' <= c && c <= '9'   ? c - '0'
+                            : 'a' <= c && c <= 'f' ? c - 'a' + 10
+                                                   : -1;
+                if (digit < 0) {
+                    return false;
+                }
+                res = res << 4 | digit;
+            }
+            return true;
+        };
+        uint64_t offset, size;
+        if (!parse(0, 16, ptr.number) || !parse(16, 8, offset) || !parse(24, 8, size)) {
+            return false;
+        }
+        ptr.offset = offset;
+        ptr.size = size;
+        return true;
+    }
+
+    // Bytes of the entry in its segment.
+    size_type entry_size() const noexcept {
+        return VLOG_ENTRY_HEADER_SIZE + size;
+    }
+};
+
+// Bytes of the entries of each segment that the records of an sst point to.
+using value_refs = std::map<uint64_t, size_type>;
+
+// Count the entry of an encoded pointer of `length` bytes in `refs`.
+inline void add_value_ref(value_refs &refs, const char *encoded, size_type length) {
+    value_pointer ptr;
+    if (value_pointer::decode(encoded, length, ptr)) {
+        refs[ptr.number] += ptr.entry_size();
+    }
+}
+
+inline void add_value_ref(value_refs &refs, const value_type &encoded) {
+    add_value_ref(refs, encoded.data(), encoded.size());
+}
+
+// An entry of a segment, see `value_log::read_entries`.
+struct value_entry {
+    key_type key;
+    seq_type seq;
+    offset_type offset;
+    value_type value;
+};
+
+/**
+ * @brief The segments of the value log, in the directory `dir`. Each flush writes its large
+ *        values to a segment of its own, and the ssts point to them. Compactions count the
+ *        bytes of the pointers they drop as the garbage of the segments, and the garbage
+ *        collection moves the live values of a segment with enough garbage to a new one.
+ *
+ *        A collected segment stays until the pointers to the moved values are flushed to an
+ *        sst, and while a snapshot older than the collection may read the versions left in it.
+ *        It is unlinked once the iterators reading it are gone as well. The methods may be
+ *        called from several threads.
+ */
+class value_log {
+public:
+    struct stats {
+        uint64_t files = 0;             // Segments in the log
+        uint64_t bytes = 0;             // Bytes of the segments
+        uint64_t garbage_bytes = 0;     // Bytes of them no sst points to any more, estimated
+        uint64_t bytes_written = 0;     // Bytes of entries written by flushes and collections
+        uint64_t collections = 0;       // Segments garbage collected
+        uint64_t gc_bytes_read = 0;     // Bytes of the collected segments
+        uint64_t gc_bytes_written = 0;  // Bytes of the live entries moved out of them
+    };
+
+    struct segment {
+        uint64_t number;
+        std::string path;
+        size_type size;
+        size_type garbage = 0;         // Guarded by the mutex of the log
+        seq_type retired_seq = 0;      // The last sequence number when collected, 0 if live
+        uint64_t retired_table = 0;    // The memory table holding the moved pointers, if any
+        std::atomic<bool> is_obsolete{false};  // Unlinked with the last reference if set
+
+        segment(uint64_t number, std::string path, size_type size)
+            : number(number), path(std::move(path)), size(size) {}
+
+        ~segment() {
+            if (is_obsolete) {
+                utils::rmfile(path.c_str());
+            }
+        }
+    };
+
+    using segment_ptr = std::shared_ptr<segment>;
+    // The segments by number. A map never changes once shared, so that an iterator keeps
+    // reading the segments it was created with.
+    using segment_map = std::map<uint64_t, segment_ptr>;
+    using version = std::shared_ptr<const segment_map>;
+
+    // Appends the entries of a new segment, which joins the log once it is installed. The
+    // file is removed if it never is.
+    class writer {
+    public:
+        writer(uint64_t number, std::string path, io::rate_limiter *limiter)
+            : number(number), path(std::move(path)), out(this->path, io::DEFAULT_BUFFER_SIZE,
+                                                          limiter) {
+            if (!out) {
+                throw std::runtime_error{"Cannot write value log " + this->path};
+            }
+        }
+
+        writer(const writer &) = delete;
+        writer &operator=(const writer &) = delete;
+
+        ~writer() {
+            if (!is_installed) {
+                out.close();
+                utils::rmfile(path.c_str());
+            }
+        }
+
+        value_pointer append(key_type key, seq_type seq, const value_type &value) {
+            value_pointer ptr{number, static_cast<offset_type>(out.tell()),
+                              static_cast<offset_type>(value.size())};
+            out.write(reinterpret_cast<const char *>(&key), sizeof key)
+                .write(reinterpret_cast<const char *>(&seq), sizeof seq)
+                .write(reinterpret_cast<const char *>(&ptr.size), sizeof ptr.size)
+                .write(value.data(), value.size());
+            return ptr;
+        }
+
+        uint64_t segment_number() const noexcept {
+            return number;
+        }
+
+        size_type byte_size() const noexcept {
+            return out.tell();
+        }
+
+        // Close the segment, so that records may point to its entries before it is installed.
+        void finish() {
+            if (!out.close()) {
+                throw std::runtime_error{"Cannot write value log " + path};
+            }
+        }
+
+    private:
+        friend class value_log;
+
+        uint64_t number;
+        std::string path;
+        io::sequential_writer out;
+        bool is_installed = false;
+    };
+
+    // Opens the segments in the directory, which is created as the first one is written.
+    // `statistics` counts the bytes written, if not null.
+    explicit value_log(std::string dir, lsm::statistics *statistics = nullptr)
+        : dir(std::move(dir)), statistics(statistics), segments(std::make_shared<segment_map>()),
+          next_number(1), counters{} {
+        std::vector<std::string> names;
+        if (!utils::dirExists(this->dir)) {
+            return;
+        }
+        utils::scanDir(this->dir, names);
+        auto map = std::make_shared<segment_map>();
+        for (const auto &name : names) {
+            std::size_t dot = name.find(".vlog");
+            if (dot == std::string::npos || dot == 0) {
+                continue;
+            }
+            uint64_t number = std::stoull(name.substr(0, dot));
+            std::string path = this->dir + '/' + name;
+            std::ifstream in{path, std::ios::binary | std::ios::ate};
+            (*map)[number] = std::make_shared<segment>(number, path, in.tellg());
+            next_number = std::max(next_number, number + 1);
+        }
+        segments = std::move(map);
+    }
+
+    bool empty() const {
+        std::lock_guard<std::mutex> lock{mutex};
+        return segments->empty();
+    }
+
+    version current() const {
+        std::lock_guard<std::mutex> lock{mutex};
+        return segments;
+    }
+
+    std::unique_ptr<writer> new_writer(io::rate_limiter *limiter = nullptr) {
+        uint64_t number;
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            number = next_number++;
+        }
+        if (utils::mkdir(dir.c_str()) != 0) {
+            throw std::runtime_error{"Cannot create directory " + dir};
+        }
+        return std::make_unique<writer>(number, dir + '/' + std::to_string(number) + ".vlog",
+                                        limiter);
+    }
+
+    // Close the segment and add it to the log. An empty segment is removed instead.
+    void install(writer &w) {
+        w.finish();
+        if (w.byte_size() == 0) {
+            return;
+        }
+        w.is_installed = true;
+        std::lock_guard<std::mutex> lock{mutex};
+        auto map = std::make_shared<segment_map>(*segments);
+        (*map)[w.number] = std::make_shared<segment>(w.number, w.path, w.byte_size());
+        segments = std::move(map);
+        counters.bytes_written += w.byte_size();
+        if (statistics) {
+            statistics->add(VALUE_LOG_BYTES_WRITTEN, w.byte_size());
+        }
+    }
+
+    /**
+     * @brief Replace a record pointing to the value log with the record of its value. Other
+     *        records are left as they are.
+     * @param segments the segments to read from, those of `current()` by default.
+     */
+    void resolve(key_type key, record &rec) const {
+        resolve(*current(), key, rec);
+    }
+
+    static void resolve(const segment_map &segments, key_type key, record &rec) {
+        if (rec.type != record_type::VALUE_POINTER) {
+            return;
+        }
+        value_pointer ptr = decode(rec);
+        std::string entry(ptr.entry_size(), '\0');
+        const segment &seg = find(segments, ptr);
+        lsm::perf_add(&lsm::perf_context::file_opens);
+        lsm::perf_add(&lsm::perf_context::block_reads);
+        lsm::perf_add(&lsm::perf_context::bytes_read, entry.size());
+        {
+            lsm::perf_timer timer{&lsm::perf_context::read_nanos};
+            if (!io::file{seg.path}.read_at(&entry[0], entry.size(), ptr.offset)) {
+                throw std::runtime_error{"Cannot read value log " + seg.path};
+            }
+        }
+        assign(seg, key, entry, rec);
+    }
+
+    // `resolve` of a batch of records, whose reads are issued together through `reader`.
+    void resolve_all(const std::vector<std::pair<key_type, record *>> &batch,
+                     io::read_engine &reader) const {
+        version segments = current();
+        std::map<uint64_t, io::file> files;
+        std::vector<io::read_request> requests;
+        std::vector<std::pair<const segment *, std::size_t>> owners;  // Per request
+        for (std::size_t i = 0; i < batch.size(); ++i) {
+            record &rec = *batch[i].second;
+            if (rec.type != record_type::VALUE_POINTER) {
+                continue;
+            }
+            value_pointer ptr = decode(rec);
+            const segment &seg = find(*segments, ptr);
+            auto &file = files[ptr.number];
+            if (!file) {
+                lsm::perf_add(&lsm::perf_context::file_opens);
+                if (!(file = io::file{seg.path})) {
+                    throw std::runtime_error{"Cannot open value log " + seg.path};
+                }
+            }
+            lsm::perf_add(&lsm::perf_context::bytes_read, ptr.entry_size());
+            requests.push_back(
+                {file.descriptor(), ptr.offset, std::string(ptr.entry_size(), '\0'), false});
+            owners.emplace_back(&seg, i);
+        }
+        lsm::perf_add(&lsm::perf_context::block_reads, requests.size());
+        {
+            lsm::perf_timer timer{&lsm::perf_context::read_nanos};
+            reader.read_all(requests);
+        }
+        for (std::size_t j = 0; j < requests.size(); ++j) {
+            const segment &seg = *owners[j].first;
+            if (!requests[j].ok) {
+                throw std::runtime_error{"Cannot read value log " + seg.path};
+            }
+            const auto &item = batch[owners[j].second];
+            assign(seg, item.first, requests[j].data, *item.second);
+        }
+    }
+
+    /**
+     * @brief Count the bytes the inputs of a compaction point to, and its outputs do not, as
+     *        the garbage of the segments.
+     */
+    void add_garbage(const value_refs &inputs, const value_refs &outputs) {
+        std::lock_guard<std::mutex> lock{mutex};
+        for (const auto &ref : inputs) {
+            auto it = segments->find(ref.first);
+            if (it == segments->end()) {
+                continue;  // Collected already
+            }
+            auto kept = outputs.find(ref.first);
+            size_type dropped = ref.second - (kept == outputs.end() ? 0 : kept->second);
+            it->second->garbage = std::min(it->second->garbage + dropped, it->second->size);
+        }
+    }
+
+    // The garbage of each segment is what the ssts, holding `live`, do not point to.
+    void reset_garbage(const value_refs &live) {
+        std::lock_guard<std::mutex> lock{mutex};
+        for (const auto &entry : *segments) {
+            auto it = live.find(entry.first);
+            size_type referred = it == live.end() ? 0 : it->second;
+            entry.second->garbage = entry.second->size - std::min(referred, entry.second->size);
+        }
+    }
+
+    // The live segment with the largest share of garbage, if it is at least `ratio`.
+    segment_ptr pick(double ratio) const {
+        std::lock_guard<std::mutex> lock{mutex};
+        segment_ptr picked;
+        for (const auto &entry : *segments) {
+            const segment &seg = *entry.second;
+            if (seg.retired_seq > 0 || seg.garbage < ratio * seg.size) {
+                continue;
+            }
+            if (!picked || seg.garbage * picked->size > picked->garbage * seg.size) {
+                picked = entry.second;
+            }
+        }
+        return picked;
+    }
+
+    // Read the entries of a segment in order, paced by the rate limiter if any.
+    static std::vector<value_entry> read_entries(const segment &seg,
+                                                 io::rate_limiter *limiter = nullptr) {
+        std::vector<value_entry> entries;
+        io::sequential_reader in{seg.path, io::DEFAULT_BUFFER_SIZE, limiter};
+        if (!in) {
+            throw std::runtime_error{"Cannot open value log " + seg.path};
+        }
+        while (in.tell() < seg.size) {
+            value_entry entry{0, 0, static_cast<offset_type>(in.tell()), {}};
+            offset_type size = 0;
+            if (!in.read(reinterpret_cast<char *>(&entry.key), sizeof entry.key) ||
+                !in.read(reinterpret_cast<char *>(&entry.seq), sizeof entry.seq) ||
+                !in.read(reinterpret_cast<char *>(&size), sizeof size)) {
+                throw std::runtime_error{"Corrupt value log " + seg.path};
+            }
+            entry.value.resize(size);
+            if (size > 0 && !in.read(&entry.value[0], size)) {
+                throw std::runtime_error{"Corrupt value log " + seg.path};
+            }
+            entries.push_back(std::move(entry));
+        }
+        return entries;
+    }
+
+    // Retire a collected segment, whose live entries were moved in `moved` bytes. The
+    // collection ends at sequence number `seq`, and the pointers to the moved entries are in
+    // the memory table of time stamp `table`, 0 if none: the segment is removed once that
+    // table is flushed and no snapshot is older, see `purge`.
+    void retire(const segment_ptr &seg, seq_type seq, size_type moved, uint64_t table) {
+        std::lock_guard<std::mutex> lock{mutex};
+        seg->retired_seq = std::max<seq_type>(seq, 1);
+        seg->retired_table = table;
+        ++counters.collections;
+        counters.gc_bytes_read += seg->size;
+        counters.gc_bytes_written += moved;
+    }
+
+    // Remove the retired segments that no snapshot at or after `oldest_snapshot` reads, and
+    // whose moved pointers are in the ssts: the memory tables up to `flushed_table` are flushed.
+    void purge(seq_type oldest_snapshot, uint64_t flushed_table) {
+        std::lock_guard<std::mutex> lock{mutex};
+        std::shared_ptr<segment_map> map;
+        for (const auto &entry : *segments) {
+            seq_type retired = entry.second->retired_seq;
+            if (retired > 0 && retired <= oldest_snapshot &&
+                entry.second->retired_table <= flushed_table) {
+                if (!map) {
+                    map = std::make_shared<segment_map>(*segments);
+                }
+                entry.second->is_obsolete = true;
+                map->erase(entry.first);
+            }
+        }
+        if (map) {
+            segments = std::move(map);
+        }
+    }
+
+    // Forget every segment, whose files the caller removes.
+    void clear() {
+        std::lock_guard<std::mutex> lock{mutex};
+        segments = std::make_shared<segment_map>();
+    }
+
+    stats get_stats() const {
+        std::lock_guard<std::mutex> lock{mutex};
+        stats res = counters;
+        for (const auto &entry : *segments) {
+            ++res.files;
+            res.bytes += entry.second->size;
+            res.garbage_bytes += entry.second->garbage;
+        }
+        return res;
+    }
+
+private:
+    const std::string dir;  // No ending '/'
+    lsm::statistics *const statistics;
+    mutable std::mutex mutex;
+    version segments;
+    uint64_t next_number;
+    stats counters;  // Only the counters of the writes and the collections
+
+    static value_pointer decode(const record &rec) {
+        value_pointer ptr;
+        if (!value_pointer::decode(rec.value, ptr)) {
+            throw std::runtime_error{"Invalid value pointer " + rec.value};
+        }
+        return ptr;
+    }
+
+    static const segment &find(const segment_map &segments, const value_pointer &ptr) {
+        auto it = segments.find(ptr.number);
+        if (it == segments.end()) {
+            throw std::runtime_error{"Missing value log segment " + std::to_string(ptr.number)};
+        }
+        return *it->second;
+    }
+
+    // Check the entry read for the record against its key and its sequence number, and store
+    // its value in the record.
+    static void assign(const segment &seg, key_type key, const std::string &entry, record &rec) {
+        key_type entry_key;
+        seq_type entry_seq;
+        std::memcpy(&entry_key, entry.data(), sizeof entry_key);
+        std::memcpy(&entry_seq, entry.data() + sizeof entry_key, sizeof entry_seq);
+        if (entry_key != key || entry_seq != rec.seq) {
+            throw std::runtime_error{"Corrupt value log " + seg.path};
+        }
+        rec.value = entry.substr(VLOG_ENTRY_HEADER_SIZE);
+        rec.type = record_type::PUT;
+    }
+};
+
+}  // namespace lsm
+
+#endif
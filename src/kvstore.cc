@@ -8,17 +8,149 @@
  *
  */
 #include <algorithm>
+#include <chrono>
 #include <iomanip>
+#include <iostream>
+#include <unordered_map>
 
 #include "kvstore.h"
 #include "utils.h"
 
-KVStore::KVStore(const std::string &dir)
-    : KVStoreAPI(dir), data_dir{dir}, cur_ts{1}, mtb_ptr{nullptr} {
+// Reports the latency of a foreground read to the rate limiter, when it goes out of scope.
+class latency_recorder {
+    using clock = std::chrono::steady_clock;
+
+public:
+    // The latency is averaged over `reads` reads.
+    latency_recorder(io::rate_limiter *limiter, std::size_t reads)
+        : limiter(limiter), reads(reads), start(limiter ? clock::now() : clock::time_point{}) {}
+
+    ~latency_recorder() {
+        if (limiter && reads > 0) {
+            auto ns =
+                std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start);
+            limiter->record_latency(ns.count() / reads);
+        }
+    }
+
+private:
+    io::rate_limiter *limiter;
+    std::size_t reads;
+    clock::time_point start;
+};
+
+// Logs an operation which takes longer than `options::slow_op_threshold_us`, with the steps of
+// its perf context.
+class slow_op_tracer {
+    using clock = std::chrono::steady_clock;
+
+public:
+    // The operation is logged as "<op> <arg>", like "get key 42".
+    slow_op_tracer(const lsm::options &opts, const char *op, uint64_t arg)
+        : opts(opts), op(op), arg(arg), is_enabled(opts.slow_op_threshold_us > 0) {
+        if (!is_enabled) {
+            return;
+        }
+        saved_level = lsm::get_perf_level();
+        before = lsm::get_perf_context();
+        lsm::set_perf_level(lsm::perf_level::ENABLE_TIME);
+        start = clock::now();
+    }
+
+    ~slow_op_tracer() {
+        if (!is_enabled) {
+            return;
+        }
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start);
+        lsm::perf_context steps = lsm::get_perf_context() - before;
+        lsm::set_perf_level(saved_level);
+        if (saved_level == lsm::perf_level::DISABLE) {
+            lsm::get_perf_context() = before;
+        }
+        if (static_cast<uint64_t>(us.count()) < opts.slow_op_threshold_us) {
+            return;
+        }
+        try {
+            std::string line = "slow " + std::string{op} + ' ' + std::to_string(arg) + ": " +
+                               std::to_string(us.count()) + " us; " + steps.to_string();
+            if (opts.slow_op_logger) {
+                opts.slow_op_logger(line);
+            } else {
+                std::cerr << line << std::endl;
+            }
+        } catch (...) {
+            // Logging never fails the operation
+        }
+    }
+
+private:
+    const lsm::options &opts;
+    const char *op;
+    uint64_t arg;
+    bool is_enabled;
+    lsm::perf_level saved_level;
+    lsm::perf_context before;
+    clock::time_point start;
+};
+
+// Count the outcome of searching an sst of the level for a key.
+static void record_probe(lsm::statistics *statistics, int level, sst::probe_result probe) {
+    if (!statistics) {
+        return;
+    }
+    switch (probe) {
+    case sst::probe_result::OUT_OF_RANGE:
+        break;
+    case sst::probe_result::FILTERED:
+        statistics->add(lsm::BLOOM_NEGATIVE, level);
+        break;
+    case sst::probe_result::ABSENT:
+        statistics->add(lsm::BLOOM_FALSE_POSITIVE, level);
+        break;
+    case sst::probe_result::FOUND:
+        statistics->add(lsm::BLOOM_POSITIVE, level);
+        break;
+    }
+}
+
+KVStore::KVStore(const std::string &dir) : KVStore(dir, lsm::options{}) {}
+
+KVStore::KVStore(const std::string &dir, const lsm::options &opts)
+    : KVStoreAPI(dir),
+      data_dir{dir},
+      cur_ts{1},
+      mtb_ptr{nullptr},
+      opts{opts},
+      last_seq{0},
+      snapshots{std::make_shared<mtb_type::snapshot_list>()},
+      snapshots_mutex{std::make_shared<std::mutex>()},
+      reader{io::make_read_engine(opts.read_queue_depth, opts.use_io_uring
+                                                             ? io::engine_kind::AUTO
+                                                             : io::engine_kind::THREAD_POOL)},
+      limiter{opts.rate_limit_bytes_per_sec == 0
+                  ? nullptr
+                  : std::make_unique<io::rate_limiter>(opts.rate_limit_bytes_per_sec,
+                                                       opts.rate_limit_auto_tune)},
+      statistics{opts.statistics.get()},
+      meta_cache{opts.metadata_cache_bytes == 0
+                     ? nullptr
+                     : std::make_shared<sst::meta_cache>(opts.metadata_cache_bytes, opts.sst_index,
+                                                         opts.statistics.get())},
+      row_cache{opts.row_cache_bytes == 0 ? nullptr
+                                          : std::make_unique<lsm::row_cache>(opts.row_cache_bytes)},
+      value_log{std::make_unique<lsm::value_log>(dir + "/vlog", opts.statistics.get())},
+      needs_compaction{opts.background_compaction},
+      is_compacting{false},
+      is_closing{false},
+      is_paused{false},
+      delay_debt_ns{0},
+      level0_runs{0},
+      pending_bytes{0} {
     static_assert(KVStore::MEMORY_MAXSIZE > lsm::BLF_SIZE, "No enough space!");
     // Hard-coded configuration
     strategy = {{0, 2, level_type::TIERING}, {1, 4}, {2, 8}, {3, 16}, {4, 32},
                 {5, /* uint32_max */}};
+    compact_cursor = decltype(compact_cursor)(strategy.size(), 0);
 
     // Check the directory and create when necessary
     if (utils::mkdir(dir.c_str())) {
@@ -28,30 +160,63 @@ KVStore::KVStore(const std::string &dir)
     std::vector<std::string> dir_list{};
     utils::scanDir(data_dir, dir_list);
 
+    // The garbage of the value log is what the ssts do not point to
+    lsm::value_refs live{};
     for (const std::string &level_dir : dir_list) {
+        if (level_dir.compare(0, 6, "level-") != 0) {
+            continue;
+        }
         int level = std::stoi(level_dir.substr(level_dir.find('-') + 1));
         std::string dir_path = data_dir + '/' + level_dir + '/';
         std::vector<std::string> sst_list;
         utils::scanDir(dir_path, sst_list);
         for (const auto &sst_name : sst_list) {
-            auto cache = sst::read_sst(dir_path + sst_name, level);
+            auto cache = sst::read_sst(dir_path + sst_name, level, opts.sst_index);
             // TODO ignore or exception?
             if (cache.level != -1) {
-                caches.push_back(std::move(cache));
+                for (const auto &ref : cache.value_refs) {
+                    live[ref.first] += ref.second;
+                }
+                place_metadata(cache);
+                last_seq = std::max(last_seq, cache.max_seq);
+                caches.push_back(std::make_shared<sst::sst_cache>(std::move(cache)));
             }
         }
     }
-    std::sort(caches.begin(), caches.end(), std::less<decltype(caches)::value_type>{});
+    sort_caches();
+    update_write_pressure();
+    value_log->reset_garbage(live);
     if (!caches.empty()) {
-        cur_ts = caches.back().header.time_stamp + 1;
+        cur_ts = caches.back()->header.time_stamp + 1;
+    }
+    mtb_ptr = std::make_shared<mtb_type>(cur_ts, snapshots.get());
+    if (opts.background_compaction) {
+        bg_thread = std::thread{&KVStore::background_work, this};
     }
-    mtb_ptr = std::make_unique<mtb_type>(cur_ts);
 }
 
 KVStore::~KVStore() {
-    if (this->mtb_ptr->size() != 0) {
+    std::unique_lock<std::mutex> lock{mutex};
+    if (!this->mtb_ptr->empty()) {
+        handle_sst();
+    }
+    // A running compaction completes, and the due ones are left to the next open
+    is_closing = true;
+    if (bg_thread.joinable()) {
+        compaction_cv.notify_one();
+        lock.unlock();
+        bg_thread.join();
+        lock.lock();
+    }
+    // The collections of the value log meanwhile moved pointers to the memory table
+    if (!this->mtb_ptr->empty()) {
         handle_sst();
     }
+    // No snapshot or iterator outlives the store
+    value_log->purge(lsm::MAX_SEQ, cur_ts - 1);
+    for (const auto &cache : obsolete) {
+        utils::rmfile(cache->sst_path.c_str());
+    }
 }
 
 /**
@@ -59,26 +224,96 @@ KVStore::~KVStore() {
  * No return values for simplicity.
  */
 void KVStore::put(uint64_t key, const std::string &s) {
+    slow_op_tracer tracer{opts, "put key", key};
+    lsm::stop_watch watch{statistics, lsm::PUT_NANOS};
+    std::unique_lock<std::mutex> lock{mutex};
+    delay_write(lock, sst::record_size(s));
     if (mtb_ptr->predict_byte_size(key, s) >= KVStore::MEMORY_MAXSIZE) {
         handle_sst();
     }
     // Automatically destruct the previous memory table.
-    mtb_ptr->put(key, s);
+    own_memtable();
+    mtb_ptr->put(key, s, ++last_seq);
+    if (row_cache) {
+        row_cache->erase(key);
+    }
+    if (statistics) {
+        statistics->add(lsm::USER_BYTES_WRITTEN, sizeof key + s.size());
+    }
 }
 /**
  * Returns the (string) value of the given key.
  * An empty string indicates not found.
  */
 std::string KVStore::get(uint64_t key) {
-    auto mtb_get_res = mtb_ptr->get(key);
-    if (mtb_get_res.second) {
-        if (mtb_get_res.first == KVStore::DeleteNote) {
-            // Already deleted
-            return {};
+    slow_op_tracer tracer{opts, "get key", key};
+    lsm::stop_watch watch{statistics, lsm::GET_NANOS};
+    std::lock_guard<std::mutex> lock{mutex};
+    std::string value;
+    if (row_cache) {
+        bool is_cached = row_cache->lookup(key, value);
+        if (statistics) {
+            statistics->add(is_cached ? lsm::ROW_CACHE_HIT : lsm::ROW_CACHE_MISS);
+        }
+        if (is_cached) {
+            return value;
         }
-        return mtb_get_res.first;
     }
-    assert(std::is_sorted(caches.begin(), caches.end(), std::less<sst::sst_cache>{}));
+    auto res = lookup(key);
+    if (res.second && !res.first.is_deleted()) {
+        value_log->resolve(key, res.first);
+        value = std::move(res.first.value);
+    }
+    if (row_cache) {
+        // The writes drop what they change, so the latest value stays valid until then
+        row_cache->insert(key, value);
+    }
+    return value;
+}
+
+/**
+ * Take a snapshot of the store. Reads through the snapshot ignore the later writes.
+ */
+KVStore::snapshot_type KVStore::snapshot() {
+    std::lock_guard<std::mutex> lock{mutex};
+    auto list = this->snapshots;
+    auto list_mutex = this->snapshots_mutex;
+    std::lock_guard<std::mutex> list_lock{*list_mutex};
+    auto it = list->insert(last_seq);
+    return snapshot_type{new lsm::seq_type{last_seq},
+                         [list, list_mutex, it](const lsm::seq_type *seq) {
+                             std::lock_guard<std::mutex> list_lock{*list_mutex};
+                             list->erase(it);
+                             delete seq;
+                         }};
+}
+
+std::string KVStore::get(uint64_t key, const snapshot_type &snap) {
+    slow_op_tracer tracer{opts, "get key", key};
+    lsm::stop_watch watch{statistics, lsm::GET_NANOS};
+    std::lock_guard<std::mutex> lock{mutex};
+    auto res = lookup(key, *snap);
+    if (!res.second || res.first.is_deleted()) {
+        return {};
+    }
+    value_log->resolve(key, res.first);
+    return std::move(res.first.value);
+}
+
+std::pair<lsm::record, bool> KVStore::lookup(key_type key, lsm::seq_type snapshot) const {
+    latency_recorder recorder{limiter.get(), 1};
+    lsm::perf_add(&lsm::perf_context::memtable_lookups);
+    auto mtb_get_res = [&] {
+        lsm::perf_timer timer{&lsm::perf_context::memtable_nanos};
+        return mtb_ptr->get(key, snapshot);
+    }();
+    if (statistics) {
+        statistics->add(mtb_get_res.second ? lsm::MEMTABLE_HIT : lsm::MEMTABLE_MISS);
+    }
+    if (mtb_get_res.second) {
+        return mtb_get_res;
+    }
+    assert(std::is_sorted(caches.begin(), caches.end(), cache_less));
 #ifdef TEST1
     std::vector<std::string> dir_list{};
     utils::scanDir(data_dir, dir_list);
@@ -95,81 +330,232 @@ std::string KVStore::get(uint64_t key) {
         std::string dir_path = data_dir + '/' + level_dir + '/';
         std::vector<std::string> sst_list;
         utils::scanDir(dir_path, sst_list);
-        std::vector<std::pair<uint64_t, std::string>> candidate{};
+        std::vector<lsm::record> candidate{};
 
         for (const auto &sst_name : sst_list) {
             auto cache = sst::read_sst(dir_path + sst_name, level);
             if (cache.level == -1) {
                 throw std::runtime_error{"Cannot read sst " + dir_path + sst_name};
             }
-            lsm::offset_type offset;
-            bool flag;
-            std::tie(offset, flag) = cache.search(key);
-            if (flag) {
-                std::string res = cache.from_offset(offset);
-                if (res == KVStore::DeleteNote) {
-                    continue;
-                }
-                candidate.emplace_back(cache.header.time_stamp, res);
+            auto res = cache.get(key, snapshot);
+            if (res.second) {
+                candidate.push_back(std::move(res.first));
             }
         }
         if (!candidate.empty()) {
-            using inner_type = decltype(candidate)::value_type;
             std::sort(candidate.begin(), candidate.end(),
-                      [](const inner_type &c1, const inner_type &c2) -> bool {
-                          return c1.first > c2.first;
+                      [](const lsm::record &r1, const lsm::record &r2) -> bool {
+                          return r1.seq > r2.seq;
                       });
-            return candidate.front().second;
+            return {candidate.front(), true};
         }
     }
 #else
     // The cache list is ordered in ascending order, see sst::sst_cache::operator<
+    // The versions in a newer sst are newer than those of the same key in older ssts
+    lsm::size_type probes = 0;  // Ssts whose filter is checked
     for (auto it = caches.rbegin(); it != caches.rend(); ++it) {
-        const auto &cache = *it;
-        lsm::offset_type offset;
-        bool flag;
-        std::tie(offset, flag) = cache.search(key);
-        if (flag) {
-            std::string res = cache.from_offset(offset);
-            if (res == KVStore::DeleteNote) {
-                return {};
+        sst::probe_result probe;
+        auto range = (*it)->extent(key, &probe);
+        record_probe(statistics, (*it)->level, probe);
+        probes += probe != sst::probe_result::OUT_OF_RANGE;
+        if (statistics && range.first < range.second) {
+            statistics->add(lsm::SST_BLOCK_READS);
+        }
+        auto res = (*it)->get(key, snapshot, (*it)->read(range));
+        if (res.second) {
+            if (statistics) {
+                statistics->record(lsm::SST_PROBES_PER_GET, probes);
             }
             return res;
         }
     }
+    if (statistics) {
+        statistics->record(lsm::SST_PROBES_PER_GET, probes);
+    }
 #endif
-    return {};
+    return {{lsm::record_type::PUT, {}, 0}, false};
+}
+// The values of found records, empty for the deleted or missing ones.
+static std::vector<std::string> to_values(std::vector<std::pair<lsm::record, bool>> found) {
+    std::vector<std::string> values(found.size());
+    for (std::size_t i = 0; i < found.size(); ++i) {
+        if (found[i].second && !found[i].first.is_deleted()) {
+            values[i] = std::move(found[i].first.value);
+        }
+    }
+    return values;
 }
+
+std::vector<std::string> KVStore::multi_get(const std::vector<key_type> &keys) {
+    slow_op_tracer tracer{opts, "multi_get of keys", keys.size()};
+    lsm::stop_watch watch{statistics, lsm::MULTI_GET_NANOS};
+    std::lock_guard<std::mutex> lock{mutex};
+    return to_values(multi_lookup(keys, lsm::MAX_SEQ));
+}
+
+std::vector<std::string> KVStore::multi_get(const std::vector<key_type> &keys,
+                                            const snapshot_type &snap) {
+    slow_op_tracer tracer{opts, "multi_get of keys", keys.size()};
+    lsm::stop_watch watch{statistics, lsm::MULTI_GET_NANOS};
+    std::lock_guard<std::mutex> lock{mutex};
+    return to_values(multi_lookup(keys, *snap));
+}
+
+std::vector<std::pair<lsm::record, bool>> KVStore::multi_lookup(const std::vector<key_type> &keys,
+                                                                lsm::seq_type snapshot) {
+    latency_recorder recorder{limiter.get(), keys.size()};
+    std::vector<std::pair<lsm::record, bool>> res{};
+    res.reserve(keys.size());
+    std::vector<std::size_t> pending{};  // The keys not found yet
+    lsm::perf_add(&lsm::perf_context::memtable_lookups, keys.size());
+    {
+        lsm::perf_timer timer{&lsm::perf_context::memtable_nanos};
+        for (std::size_t i = 0; i < keys.size(); ++i) {
+            res.push_back(mtb_ptr->get(keys[i], snapshot));
+            if (!res.back().second) {
+                pending.push_back(i);
+            }
+        }
+    }
+    if (statistics) {
+        statistics->add(lsm::MEMTABLE_HIT, keys.size() - pending.size());
+        statistics->add(lsm::MEMTABLE_MISS, pending.size());
+    }
+    std::vector<lsm::size_type> probes(keys.size(), 0);  // Ssts whose filter each key checks
+    const std::vector<std::size_t> missed = pending;
+
+    // Like `lookup`, each key walks the caches from the newest, but a round reads the next
+    // candidate sst of every pending key at once. Mostly one round finds all of them.
+    std::vector<std::size_t> searched(keys.size(), 0);  // Caches passed by each key
+    std::unordered_map<const sst::sst_cache *, io::file> files{};
+    std::vector<io::read_request> requests{};
+    std::vector<std::pair<std::size_t, const sst::sst_cache *>> owners{};  // Per request
+    while (!pending.empty()) {
+        requests.clear();
+        owners.clear();
+        for (std::size_t i : pending) {
+            for (; searched[i] < caches.size(); ++searched[i]) {
+                const auto &cache = caches[caches.size() - 1 - searched[i]];
+                sst::probe_result probe;
+                auto range = cache->extent(keys[i], &probe);
+                record_probe(statistics, cache->level, probe);
+                probes[i] += probe != sst::probe_result::OUT_OF_RANGE;
+                if (range.first < range.second) {
+                    auto &file = files[cache.get()];
+                    if (!file) {
+                        lsm::perf_add(&lsm::perf_context::file_opens);
+                        if (!(file = io::file{cache->sst_path})) {
+                            throw std::runtime_error{"Cannot open sst file " + cache->sst_path};
+                        }
+                    }
+                    lsm::perf_add(&lsm::perf_context::bytes_read, range.second - range.first);
+                    requests.push_back({file.descriptor(), range.first,
+                                        std::string(range.second - range.first, '\0'), false});
+                    owners.emplace_back(i, cache.get());
+                    break;
+                }
+                // Only a range tombstone of the sst may hide the older versions
+                auto found = cache->get(keys[i], snapshot, {});
+                if (found.second) {
+                    res[i] = std::move(found);
+                    break;
+                }
+            }
+        }
+
+        lsm::perf_add(&lsm::perf_context::block_reads, requests.size());
+        {
+            lsm::perf_timer timer{&lsm::perf_context::read_nanos};
+            reader->read_all(requests);
+        }
+        if (statistics) {
+            statistics->add(lsm::SST_BLOCK_READS, requests.size());
+        }
+        pending.clear();
+        for (std::size_t j = 0; j < requests.size(); ++j) {
+            std::size_t i = owners[j].first;
+            if (!requests[j].ok) {
+                throw std::runtime_error{"Cannot read sst file " + owners[j].second->sst_path};
+            }
+            auto found = owners[j].second->get(keys[i], snapshot, requests[j].data);
+            if (found.second) {
+                res[i] = std::move(found);
+            } else {
+                // No version visible at the snapshot: go on with the older ssts
+                ++searched[i];
+                pending.push_back(i);
+            }
+        }
+    }
+    if (statistics) {
+        for (std::size_t i : missed) {
+            statistics->record(lsm::SST_PROBES_PER_GET, probes[i]);
+        }
+    }
+
+    // The values in the value log are read in one more batch
+    std::vector<std::pair<key_type, lsm::record *>> separated{};
+    for (std::size_t i = 0; i < keys.size(); ++i) {
+        if (res[i].second && res[i].first.type == lsm::record_type::VALUE_POINTER) {
+            separated.emplace_back(keys[i], &res[i].first);
+        }
+    }
+    if (!separated.empty()) {
+        value_log->resolve_all(separated, *reader);
+    }
+    return res;
+}
+
 /**
  * Delete the given key-value pair if it exists.
  * Returns false iff the key is not found.
  */
 bool KVStore::del(uint64_t key) {
-    value_type val;
-    bool found;
-    std::tie(val, found) = mtb_ptr->get(key);
-    if (found) {
-        if (val == KVStore::DeleteNote) {
-            return false;
-        }
-        this->mtb_ptr->put(key, KVStore::DeleteNote);
-        return true;
+    slow_op_tracer tracer{opts, "del key", key};
+    lsm::stop_watch watch{statistics, lsm::DEL_NANOS};
+    std::unique_lock<std::mutex> lock{mutex};
+    delay_write(lock, sst::record_size({}));
+    auto res = lookup(key);
+    if (!res.second || res.first.is_deleted()) {
+        return false;
     }
-    for (auto it = caches.rbegin(); it != caches.rend(); ++it) {
-        const auto &cache = *it;
-        lsm::offset_type offset;
-        bool flag;
-        std::tie(offset, flag) = cache.search(key);
-        if (flag) {
-            std::string found = cache.from_offset(offset);
-            if (found == KVStore::DeleteNote) {
-                return false;
-            }
-            this->mtb_ptr->put(key, KVStore::DeleteNote);
-            return true;
-        }
+    if (mtb_ptr->predict_byte_size(key, {}) >= KVStore::MEMORY_MAXSIZE) {
+        handle_sst();
+    }
+    own_memtable();
+    this->mtb_ptr->del(key, ++last_seq);
+    if (row_cache) {
+        row_cache->erase(key);
+    }
+    if (statistics) {
+        statistics->add(lsm::USER_BYTES_WRITTEN, sizeof key);
+    }
+    return true;
+}
+
+/**
+ * Delete all the key-value pairs in [key1, key2] with a single range tombstone.
+ */
+void KVStore::del_range(uint64_t key1, uint64_t key2) {
+    if (key1 > key2) {
+        return;
+    }
+    slow_op_tracer tracer{opts, "del_range from key", key1};
+    lsm::stop_watch watch{statistics, lsm::DEL_RANGE_NANOS};
+    std::unique_lock<std::mutex> lock{mutex};
+    delay_write(lock, sst::RANGE_TOMBSTONE_SIZE);
+    if (mtb_ptr->predict_range_size() >= KVStore::MEMORY_MAXSIZE) {
+        handle_sst();
+    }
+    own_memtable();
+    this->mtb_ptr->del_range(key1, key2, ++last_seq);
+    if (row_cache) {
+        row_cache->erase_range(key1, key2);
+    }
+    if (statistics) {
+        statistics->add(lsm::USER_BYTES_WRITTEN, sizeof key1 + sizeof key2);
     }
-    return false;
 }
 
 /**
@@ -177,11 +563,16 @@ bool KVStore::del(uint64_t key) {
  * including memtable and all sstables files.
  */
 void KVStore::reset() {
+    std::unique_lock<std::mutex> lock{mutex};
+    stall_cv.wait(lock, [this] { return !is_compacting; });
+    needs_compaction = false;
+    bg_error = nullptr;
+    delay_debt_ns = 0;
+    if (row_cache) {
+        row_cache->clear();
+    }
     std::vector<std::string> dir_levels{};
     utils::scanDir(data_dir, dir_levels);
-    if (dir_levels.empty()) {
-        return;
-    }
     for (const auto &dir : dir_levels) {
         std::string dir_path = data_dir + '/' + dir + '/';
         std::vector<std::string> sst_list;
@@ -192,8 +583,11 @@ void KVStore::reset() {
         utils::rmdir(dir_path.c_str());
     }
     this->caches = decltype(this->caches){};
+    this->obsolete = decltype(this->obsolete){};
+    update_write_pressure();
+    value_log->clear();
     this->cur_ts = 1;
-    this->mtb_ptr = std::make_unique<mtb_type>(1);
+    this->mtb_ptr = std::make_shared<mtb_type>(1, snapshots.get());
 }
 
 /**
@@ -203,119 +597,904 @@ void KVStore::reset() {
  */
 void KVStore::scan(uint64_t key1, uint64_t key2,
                    std::list<std::pair<uint64_t, std::string>> &list) {
-    // using pair_type = std::remove_reference_t<decltype(caches.at(0).indices)>::value_type;
-    // TODO this implement has problems of efficiency.
-    for (; key1 <= key2; ++key1) {
-        list.emplace_back(key1, get(key1));
+    slow_op_tracer tracer{opts, "scan from key", key1};
+    lsm::stop_watch watch{statistics, lsm::SCAN_NANOS};
+    lsm::iterator it = [&] {
+        std::lock_guard<std::mutex> lock{mutex};
+        return new_iterator(last_seq, key1, key2);
+    }();
+    uint64_t n = 0;
+    for (it.seek(key1); it.valid() && it.key() <= key2; it.next(), ++n) {
+        list.emplace_back(it.key(), it.value());
+    }
+    if (statistics) {
+        statistics->add(lsm::KEYS_SCANNED, n);
+    }
+}
+
+void KVStore::scan(uint64_t key1, uint64_t key2, std::list<std::pair<uint64_t, std::string>> &list,
+                   const snapshot_type &snap) {
+    slow_op_tracer tracer{opts, "scan from key", key1};
+    lsm::stop_watch watch{statistics, lsm::SCAN_NANOS};
+    lsm::iterator it = [&] {
+        std::lock_guard<std::mutex> lock{mutex};
+        return new_iterator(*snap, key1, key2);
+    }();
+    uint64_t n = 0;
+    for (it.seek(key1); it.valid() && it.key() <= key2; it.next(), ++n) {
+        list.emplace_back(it.key(), it.value());
+    }
+    if (statistics) {
+        statistics->add(lsm::KEYS_SCANNED, n);
+    }
+}
+
+lsm::iterator KVStore::new_iterator() {
+    std::lock_guard<std::mutex> lock{mutex};
+    return new_iterator(last_seq);
+}
+
+lsm::iterator KVStore::new_iterator(const snapshot_type &snap) {
+    std::lock_guard<std::mutex> lock{mutex};
+    return new_iterator(*snap);
+}
+
+lsm::iterator KVStore::new_iterator(lsm::seq_type snapshot, key_type lower, key_type upper) {
+    std::vector<std::unique_ptr<lsm::cursor>> cursors{};
+    std::vector<lsm::range_tombstone> range_dels = mtb_ptr->range_tombstones();
+    cursors.push_back(std::make_unique<lsm::mem_cursor>(mtb_ptr));
+    bool is_bounded = lower > 0 || upper < UINT64_MAX;
+
+    // Sorted runs: each level-0 time stamp, and each deeper level
+    std::vector<std::shared_ptr<const sst::sst_cache>> run{};
+    for (auto it = caches.begin(); it != caches.end(); ++it) {
+        const auto &cache = *it;
+        // The range tombstones of a skipped sst may still hide the keys of older ones
+        range_dels.insert(range_dels.end(), cache->range_dels.begin(), cache->range_dels.end());
+        if (!is_bounded) {
+            run.push_back(cache);
+        } else if (cache->header.lower <= upper && cache->header.upper >= lower) {
+            bool may_contain = cache->may_contain_range(lower, upper);
+            if (statistics && cache->scan_filter) {
+                statistics->add(may_contain ? lsm::RANGE_FILTER_POSITIVE
+                                            : lsm::RANGE_FILTER_NEGATIVE);
+            }
+            if (may_contain) {
+                run.push_back(cache);
+            }
+        }
+        auto next = it + 1;
+        if (next == caches.end() || (*next)->level != cache->level ||
+            (cache->level == 0 && (*next)->header.time_stamp != cache->header.time_stamp)) {
+            if (!run.empty()) {
+                cursors.push_back(std::make_unique<lsm::run_cursor>(std::move(run)));
+            }
+            run.clear();
+        }
+    }
+    // Newest first: a value moved by the collection of the value log is pointed to by a newer
+    // version with the same sequence number
+    std::reverse(cursors.begin() + 1, cursors.end());
+    return lsm::iterator{std::move(cursors), std::move(range_dels), snapshot, lower, upper,
+                         value_log->current()};
+}
+
+void KVStore::own_memtable() {
+    if (mtb_ptr.use_count() > 1) {
+        mtb_ptr = std::make_shared<mtb_type>(*mtb_ptr);
+    }
+}
+
+void KVStore::sort_caches() {
+    std::sort(caches.begin(), caches.end(), cache_less);
+}
+
+void KVStore::remove_files(std::vector<sst::cache_ptr> &retired) {
+    obsolete.insert(obsolete.end(), std::make_move_iterator(retired.begin()),
+                    std::make_move_iterator(retired.end()));
+    retired.clear();
+    for (auto it = obsolete.begin(); it != obsolete.end();) {
+        if (it->use_count() == 1) {
+            utils::rmfile((*it)->sst_path.c_str());
+            it = obsolete.erase(it);
+        } else {
+            ++it;
+        }
     }
 }
 
 void KVStore::handle_sst() {
     // Write the memory table to level-0
-    std::string sst_name = sst::generate_hash() + ".sst";
-
     const std::string target_dir = this->data_dir + "/level-0";
     utils::mkdir(target_dir.c_str());
 
-    auto cache = mtb_ptr->to_binary(target_dir + "/" + sst_name, 0);
-    this->caches.push_back(std::move(cache));
+    auto cache = mtb_ptr->to_binary(sst::generate_path(target_dir), 0, limiter.get(),
+                                    opts.sst_index, value_log.get(), opts.value_log_min_size);
+    place_metadata(cache);
+    stats.bytes_flushed += cache.file_size;
+    if (statistics) {
+        statistics->add(lsm::FLUSH_BYTES_WRITTEN, cache.file_size);
+    }
+    this->caches.push_back(std::make_shared<sst::sst_cache>(std::move(cache)));
     /**
      * All caches maintained by kvstore has smaller time stamp.
      * Therefore, no need to sort.
      */
+    update_write_pressure();
 
     // Reset the memory table.
-    mtb_ptr = std::make_unique<mtb_type>(++this->cur_ts);
+    mtb_ptr = std::make_shared<mtb_type>(++this->cur_ts, snapshots.get());
+
+    // Compact until each level is within its target
+    if (bg_thread.joinable()) {
+        needs_compaction = true;
+        compaction_cv.notify_one();
+    } else if (!is_compacting) {
+        // A merge releases the lock, so another writer may flush meanwhile. The compaction
+        // under way goes on until the new file is compacted as well.
+        is_compacting = true;
+        try {
+            check_level();
+            collect_value_log();
+        } catch (...) {
+            is_compacting = false;
+            stall_cv.notify_all();
+            throw;
+        }
+        is_compacting = false;
+        stall_cv.notify_all();
+    }
+}
+
+void KVStore::background_work() {
+    std::unique_lock<std::mutex> lock{mutex};
+    while (true) {
+        compaction_cv.wait(lock,
+                           [this] { return is_closing || (needs_compaction && !is_paused); });
+        if (is_closing) {
+            return;
+        }
+        needs_compaction = false;
+        is_compacting = true;
+        try {
+            check_level();
+            collect_value_log();
+        } catch (...) {
+            bg_error = std::current_exception();
+        }
+        is_compacting = false;
+        stall_cv.notify_all();
+    }
+}
+
+lsm::seq_type KVStore::oldest_snapshot() const {
+    std::lock_guard<std::mutex> list_lock{*snapshots_mutex};
+    return snapshots->empty() ? lsm::MAX_SEQ : *snapshots->begin();
+}
+
+void KVStore::collect_value_log() {
+    struct relock {
+        std::mutex &mutex;
+        ~relock() {
+            mutex.lock();
+        }
+    };
+    // Whether the newest version of the key is the entry of the segment
+    auto is_live = [this](const lsm::value_entry &entry, uint64_t number) -> bool {
+        auto res = lookup(entry.key);
+        lsm::value_pointer ptr;
+        return res.second && res.first.type == lsm::record_type::VALUE_POINTER &&
+               res.first.seq == entry.seq && lsm::value_pointer::decode(res.first.value, ptr) &&
+               ptr.number == number && ptr.offset == entry.offset;
+    };
+    while (!is_closing) {
+        // The memory tables before the current one are flushed
+        value_log->purge(oldest_snapshot(), cur_ts - 1);
+        auto victim = value_log->pick(opts.value_log_gc_ratio);
+        if (!victim) {
+            return;
+        }
+        std::vector<lsm::value_entry> entries{};
+        {
+            mutex.unlock();
+            relock guard{mutex};
+            entries = lsm::value_log::read_entries(*victim, limiter.get());
+        }
+        entries.erase(std::remove_if(entries.begin(), entries.end(),
+                                     [&](const lsm::value_entry &entry) {
+                                         return !is_live(entry, victim->number);
+                                     }),
+                      entries.end());
+        auto writer = value_log->new_writer(limiter.get());
+        std::vector<lsm::value_pointer> moved{};
+        {
+            mutex.unlock();
+            relock guard{mutex};
+            for (const auto &entry : entries) {
+                moved.push_back(writer->append(entry.key, entry.seq, entry.value));
+            }
+        }
+        value_log->install(*writer);
+
+        // The versions written meanwhile are left out, and their entries are garbage already
+        lsm::value_refs dead{};
+        uint64_t table = 0;
+        for (std::size_t i = 0; i < entries.size(); ++i) {
+            if (!is_live(entries[i], victim->number)) {
+                dead[moved[i].number] += moved[i].entry_size();
+                continue;
+            }
+            std::string pointer = moved[i].encode();
+            if (mtb_ptr->predict_byte_size(entries[i].key, pointer) >= KVStore::MEMORY_MAXSIZE) {
+                handle_sst();
+            }
+            own_memtable();
+            mtb_ptr->put_pointer(entries[i].key, pointer, entries[i].seq);
+            table = cur_ts;
+        }
+        value_log->add_garbage(dead, {});
+        value_log->retire(victim, last_seq, writer->byte_size(), table);
+    }
+}
+
+void KVStore::wait_for_compaction() {
+    std::unique_lock<std::mutex> lock{mutex};
+    stall_cv.wait(lock, [this] { return !needs_compaction && !is_compacting; });
+    if (bg_error) {
+        std::rethrow_exception(bg_error);
+    }
+}
+
+void KVStore::pause_background_work() {
+    std::unique_lock<std::mutex> lock{mutex};
+    is_paused = true;
+    stall_cv.wait(lock, [this] { return !is_compacting; });
+}
+
+void KVStore::continue_background_work() {
+    std::lock_guard<std::mutex> lock{mutex};
+    is_paused = false;
+    compaction_cv.notify_one();
+}
+
+void KVStore::delay_write(std::unique_lock<std::mutex> &lock, lsm::size_type bytes) {
+    if (!bg_thread.joinable()) {
+        return;  // Inline compaction never falls behind
+    }
+    // How far the store is past the soft limits, reaching 1 at the hard limits
+    auto pressure = [this]() -> double {
+        auto past = [](double value, double soft, double hard) -> double {
+            if (value < soft) {
+                return 0;
+            }
+            return hard > soft ? (value - soft + 1) / (hard - soft + 1) : 1;
+        };
+        return std::max(past(level0_runs, opts.level0_slowdown_writes_trigger,
+                             opts.level0_stop_writes_trigger),
+                        past(pending_bytes, opts.soft_pending_compaction_bytes_limit,
+                             opts.hard_pending_compaction_bytes_limit));
+    };
+
+    using clock = std::chrono::steady_clock;
+    auto start = clock::now();
+    bool is_stalled = false;
+    double cur_pressure;
+    while (true) {
+        if (bg_error) {
+            std::rethrow_exception(bg_error);
+        }
+        if ((cur_pressure = pressure()) < 1) {
+            break;
+        }
+        // Stop until a compaction completes
+        if (!is_stalled) {
+            ++stats.write_stops;
+            is_stalled = true;
+        }
+        stall_cv.wait(lock);
+    }
+    if (cur_pressure > 0) {
+        // Slow down: the write pays for its bytes at the delayed rate
+        if (!is_stalled) {
+            ++stats.write_slowdowns;
+            is_stalled = true;
+        }
+        double rate = opts.delayed_write_rate * std::max(1 - cur_pressure, 1.0 / 16);
+        delay_debt_ns += static_cast<uint64_t>(bytes * 1e9 / std::max(rate, 1.0));
+        if (delay_debt_ns >= 1'000'000) {
+            auto delay = std::chrono::nanoseconds{delay_debt_ns};
+            delay_debt_ns = 0;
+            lock.unlock();
+            std::this_thread::sleep_for(delay);
+            lock.lock();
+        }
+    }
+    if (is_stalled) {
+        auto us =
+            std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start).count();
+        stats.write_stall_us += us;
+        if (statistics) {
+            statistics->add(lsm::STALL_MICROS, us);
+        }
+    }
+}
+
+void KVStore::update_write_pressure() {
+    level0_runs = opts.style == lsm::compaction_style::UNIVERSAL ? collect_sorted_runs().size()
+                                                                 : summarize_levels()[0].files;
+    pending_bytes = pending_compaction_bytes();
+}
 
-    // Recursively check each level
-    check_level(0);
+io::rate_limiter::stats KVStore::get_rate_limiter_stats() const {
+    return limiter ? limiter->get_stats() : io::rate_limiter::stats{};
 }
 
-void KVStore::check_level(int level) {
-    assert(level < strategy.size());  // The strategy generated method ensures this.
-    if (level >= strategy.size()) {
+lsm::value_log::stats KVStore::get_value_log_stats() const {
+    return value_log->get_stats();
+}
+
+lsm::row_cache::stats KVStore::get_row_cache_stats() const {
+    std::lock_guard<std::mutex> lock{mutex};
+    return row_cache ? row_cache->get_stats() : lsm::row_cache::stats{};
+}
+
+KVStore::metadata_usage KVStore::get_metadata_usage() const {
+    std::lock_guard<std::mutex> lock{mutex};
+    metadata_usage usage;
+    for (const auto &cache : caches) {
+        if (cache->scan_filter) {
+            usage.range_filter_bytes += cache->scan_filter->byte_size();
+        }
+    }
+    if (meta_cache) {
+        usage.bytes = meta_cache->usage();
+        usage.pinned_bytes = meta_cache->pinned_usage();
+        usage.cache = meta_cache->get_stats();
+        return usage;
+    }
+    for (const auto &cache : caches) {
+        usage.bytes += cache->metadata()->charge();
+    }
+    usage.pinned_bytes = usage.bytes;
+    return usage;
+}
+
+void KVStore::place_metadata(sst::sst_cache &cache) {
+    if (opts.range_filter_bits_per_prefix > 0 && !cache.scan_filter) {
+        const sst::key_index &indices = cache.metadata()->indices;
+        std::vector<key_type> keys;
+        keys.reserve(indices.size());
+        for (auto pos = indices.first(); pos != sst::key_index::npos; pos = indices.next(pos)) {
+            keys.push_back(indices.key(pos));
+        }
+        cache.scan_filter =
+            std::make_shared<const sst::range_filter>(keys, opts.range_filter_bits_per_prefix);
+    }
+    if (!meta_cache) {
         return;
     }
-    auto file_count =
-        std::count_if(caches.begin(), caches.end(),
-                      [=](const sst::sst_cache &cache) -> bool { return cache.level == level; });
-    if (file_count <= strategy[level].max_file) {
+    bool is_pinned = cache.level < opts.pinned_metadata_levels;
+    if (cache.meta->owner() == meta_cache && cache.meta->is_pinned() == is_pinned) {
+        return;
+    }
+    auto meta = cache.metadata();
+    if (is_pinned) {
+        cache.meta = std::make_shared<const sst::meta_handle>(std::move(meta), meta_cache);
+    } else {
+        cache.meta = std::make_shared<const sst::meta_handle>(meta_cache, std::move(meta));
+    }
+}
+
+KVStore::compaction_stats KVStore::get_compaction_stats() const {
+    std::lock_guard<std::mutex> lock{mutex};
+    return stats;
+}
+
+std::vector<KVStore::level_summary> KVStore::get_level_summary() const {
+    std::lock_guard<std::mutex> lock{mutex};
+    return summarize_levels();
+}
+
+lsm::size_type KVStore::get_pending_compaction_bytes() const {
+    std::lock_guard<std::mutex> lock{mutex};
+    return pending_compaction_bytes();
+}
+
+lsm::size_type KVStore::pending_compaction_bytes() const {
+    lsm::size_type pending = 0;
+    if (opts.style == lsm::compaction_style::UNIVERSAL) {
+        // The runs the next compaction merges
+        auto runs = collect_sorted_runs();
+        std::size_t first, last;
+        if (pick_sorted_runs(runs, first, last)) {
+            for (std::size_t i = first; i < last; ++i) {
+                pending += runs[i].bytes;
+            }
+        }
+        return pending;
+    }
+    // Level-0 is rewritten as a whole. The excess of a deeper level is merged with about
+    // `multiplier` times its bytes in the next level.
+    auto summary = summarize_levels();
+    if (summary[0].score > 1) {
+        pending += summary[0].bytes;
+    }
+    for (std::size_t level = 1; level < summary.size(); ++level) {
+        if (summary[level].score > 1) {
+            pending += (summary[level].bytes - summary[level].target) *
+                       (opts.max_bytes_for_level_multiplier + 1);
+        }
+    }
+    return pending;
+}
+
+std::vector<KVStore::level_summary> KVStore::summarize_levels() const {
+    const int N = strategy.size();
+    std::vector<level_summary> summary(N);
+    for (int level = 0; level < N; ++level) {
+        summary[level].level = level;
+    }
+    for (const auto &cache : caches) {
+        ++summary[cache->level].files;
+        summary[cache->level].bytes += cache->file_size;
+    }
+
+    // Level-0 is scored by its file count, since its files overlap each other
+    summary[0].target = strategy[0].max_file;
+    summary[0].score = static_cast<double>(summary[0].files) / strategy[0].max_file;
+
+    // Targets in bytes, see rocksdb's `VersionStorageInfo::CalculateBaseBytes`
+    const double multiplier = opts.max_bytes_for_level_multiplier;
+    const lsm::size_type base_bytes_max = opts.max_bytes_for_level_base;
+    int base_level = 1;
+    lsm::size_type base_level_size = base_bytes_max;
+    if (opts.level_compaction_dynamic_level_bytes) {
+        int first_non_empty = -1;
+        lsm::size_type max_level_size = 0;
+        for (int level = 1; level < N; ++level) {
+            if (summary[level].bytes > 0 && first_non_empty == -1) {
+                first_non_empty = level;
+            }
+            max_level_size = std::max(max_level_size, summary[level].bytes);
+        }
+        if (first_non_empty == -1) {
+            // Level-0 goes straight to the last level of an empty tree
+            base_level = N - 1;
+        } else {
+            // The size the first non-empty level would have, given the size of the last level
+            double cur_level_size = max_level_size;
+            for (int level = N - 2; level >= first_non_empty; --level) {
+                cur_level_size /= multiplier;
+            }
+            base_level = first_non_empty;
+            if (cur_level_size <= base_bytes_max / multiplier) {
+                base_level_size = base_bytes_max / multiplier + 1;
+            } else {
+                while (base_level > 1 && cur_level_size > base_bytes_max) {
+                    --base_level;
+                    cur_level_size /= multiplier;
+                }
+                base_level_size = std::min<lsm::size_type>(cur_level_size, base_bytes_max);
+            }
+        }
+    }
+    double level_size = base_level_size;
+    for (int level = base_level; level < N; ++level) {
+        if (level > base_level) {
+            level_size *= multiplier;
+        }
+        summary[level].target = opts.level_compaction_dynamic_level_bytes
+                                    ? std::max<lsm::size_type>(level_size, base_bytes_max)
+                                    : static_cast<lsm::size_type>(level_size);
+        summary[level].score = static_cast<double>(summary[level].bytes) / summary[level].target;
+        summary[level].is_base = level == base_level;
+    }
+    // Nothing lies below the last level
+    summary[N - 1].score = 0;
+    return summary;
+}
+
+void KVStore::check_level() {
+    if (opts.style == lsm::compaction_style::UNIVERSAL) {
+        std::vector<sorted_run> runs = collect_sorted_runs();
+        std::size_t first, last;
+        while (!is_closing && pick_sorted_runs(runs, first, last)) {
+            compact_sorted_runs(runs, first, last);
+            update_write_pressure();
+            stall_cv.notify_all();
+            runs = collect_sorted_runs();
+        }
         return;
     }
-    compact(level, level + 1);
-    check_level(level + 1);
+    while (!is_closing) {
+        auto summary = summarize_levels();
+        auto it = std::max_element(summary.begin(), summary.end(),
+                                   [](const level_summary &s1, const level_summary &s2) -> bool {
+                                       return s1.score < s2.score;
+                                   });
+        if (it->score <= 1) {
+            return;
+        }
+        int l1 = it->level, l2 = l1 + 1;
+        if (l1 == 0) {
+            // Level-0 compacts into the base level, levels above which are empty
+            l2 = std::find_if(summary.begin(), summary.end(),
+                              [](const level_summary &s) -> bool { return s.is_base; })
+                     ->level;
+        }
+        compact(l1, l2);
+        update_write_pressure();
+        stall_cv.notify_all();
+    }
+}
+
+std::vector<sst::cache_ptr>::iterator KVStore::pick_file(int l1, int l2) {
+    auto overlap = [](const sst::sst_cache &c1, const sst::sst_cache &c2) -> bool {
+        return !(c1.header.lower > c2.header.upper || c1.header.upper < c2.header.lower);
+    };
+    auto picked = caches.end();
+    if (opts.pri == lsm::compaction_pri::MIN_OVERLAPPING_RATIO) {
+        // Prefer the file which drags the fewest bytes of l2 into the compaction.
+        double min_ratio = std::numeric_limits<double>::max();
+        for (auto it = caches.begin(); it != caches.end(); ++it) {
+            if ((*it)->level != l1) {
+                continue;
+            }
+            lsm::size_type overlapped = 0;
+            for (const auto &cache : caches) {
+                if (cache->level == l2 && overlap(**it, *cache)) {
+                    overlapped += cache->file_size;
+                }
+            }
+            double ratio = static_cast<double>(overlapped) /
+                           std::max<lsm::size_type>((*it)->file_size, 1);
+            if (ratio < min_ratio) {
+                min_ratio = ratio;
+                picked = it;
+            }
+        }
+        return picked;
+    }
+    // Round-robin: the first file at or after the cursor, wrapping to the smallest one.
+    auto first = caches.end();
+    for (auto it = caches.begin(); it != caches.end(); ++it) {
+        if ((*it)->level != l1) {
+            continue;
+        }
+        if (first == caches.end() || (*it)->header.lower < (*first)->header.lower) {
+            first = it;
+        }
+        if ((*it)->header.lower >= compact_cursor[l1] &&
+            (picked == caches.end() || (*it)->header.lower < (*picked)->header.lower)) {
+            picked = it;
+        }
+    }
+    if (picked == caches.end()) {
+        picked = first;
+    }
+    if (picked != caches.end()) {
+        // Wraps to 0 after the largest key.
+        compact_cursor[l1] = (*picked)->header.upper + 1;
+    }
+    return picked;
+}
+
+bool KVStore::is_trivial_move(std::vector<sst::cache_ptr> &selected,
+                              const std::vector<sst::file_boundary> &grandparents) const {
+    if (selected.empty()) {
+        return false;
+    }
+    // The moved files have to be disjoint to live in a leveled level.
+    std::sort(selected.begin(), selected.end(),
+              [](const sst::cache_ptr &c1, const sst::cache_ptr &c2) -> bool {
+                  return c1->header.lower < c2->header.lower;
+              });
+    for (std::size_t i = 1; i < selected.size(); ++i) {
+        if (selected[i]->header.lower <= selected[i - 1]->header.upper) {
+            return false;
+        }
+    }
+    // Do not move a file that would make a later compaction of l2 too large.
+    lsm::size_type overlapped = 0;
+    for (const auto &boundary : grandparents) {
+        for (const auto &cache : selected) {
+            if (!(boundary.lower > cache->header.upper || boundary.upper < cache->header.lower)) {
+                overlapped += boundary.size;
+                break;
+            }
+        }
+    }
+    return overlapped <= opts.max_grandparent_overlap_bytes;
 }
 
 void KVStore::compact(int l1, int l2) {
     // Step 1: SSTable select
 
     // 1.1 select from level l1
-    std::vector<sst::sst_cache> selected_cache{};
-    // Tiering: select all
-    uint32_t lhs_selected_cnt =
-        std::count_if(caches.begin(), caches.end(),
-                      [=](const sst::sst_cache &cache) -> bool { return cache.level == l1; });
-    // Leveling: truncate
-    if (strategy[l1].type == level_type::LEVELING) {
-        lhs_selected_cnt -= strategy[l1].max_file;
-    }
-
-    selected_cache.reserve(lhs_selected_cnt);
-    for (auto it = caches.begin();
-         it != caches.end() && selected_cache.size() < lhs_selected_cnt && it->level >= l1;) {
-        if (it->level == l1) {
-            selected_cache.push_back(std::move(*it));
-            it = caches.erase(it);
-        } else {
-            ++it;
+    // The selected caches stay in `caches` until the compaction replaces them.
+    std::vector<sst::cache_ptr> selected_cache{};
+    if (strategy[l1].type == level_type::TIERING) {
+        // Tiering: select all
+        for (const auto &cache : caches) {
+            if (cache->level == l1) {
+                selected_cache.push_back(cache);
+            }
         }
+    } else {
+        // Leveling: a single file, so that each compaction rewrites a bounded number of bytes
+        auto it = pick_file(l1, l2);
+        assert(it != caches.end());
+        selected_cache.push_back(*it);
+    }
+
+    key_type min_key = std::numeric_limits<key_type>::max();
+    key_type max_key = std::numeric_limits<key_type>::min();
+    for (const auto &cache : selected_cache) {
+        min_key = std::min(min_key, cache->header.lower);
+        max_key = std::max(max_key, cache->header.upper);
     }
-    assert(selected_cache.size() == lhs_selected_cnt);
+    auto overlap = [&](const sst::sst_cache &cache) -> bool {
+        return !(cache.header.lower > max_key || cache.header.upper < min_key);
+    };
 
     // 1.2 select from level l2
+    // The files of a leveled level are disjoint, so the range of l1 inputs is not widened.
+    const std::size_t l1_selected_cnt = selected_cache.size();
     if (strategy[l2].type == level_type::LEVELING) {
-        key_type min_key = std::numeric_limits<key_type>::max();
-        key_type max_key = std::numeric_limits<key_type>::min();
-        for (const auto &cache : selected_cache) {
-            min_key = std::min(min_key, cache.header.lower);
-            max_key = std::max(max_key, cache.header.upper);
-        }
-        auto if_select = [&, l2](const sst::sst_cache &cache) -> bool {
-            return cache.level == l2 &&
-                   !(cache.header.lower > max_key || cache.header.upper < min_key);
-        };
-        for (auto it = caches.begin(); it != caches.end() && it->level >= l2;) {
-            if (if_select(*it)) {
-                max_key = std::max(max_key, it->header.upper);
-                min_key = std::min(min_key, it->header.lower);
-                selected_cache.push_back(std::move(*it));
-                it = caches.erase(it);
-            } else {
-                ++it;
+        for (const auto &cache : caches) {
+            if (cache->level == l2 && overlap(*cache)) {
+                selected_cache.push_back(cache);
             }
         }
     }
+
+    // 1.3 the files of level l2 + 1 decide where outputs are cut
+    std::vector<sst::file_boundary> grandparents{};
+    for (const auto &cache : caches) {
+        if (cache->level == l2 + 1) {
+            grandparents.push_back({cache->header.lower, cache->header.upper, cache->file_size});
+        }
+    }
+    std::sort(grandparents.begin(), grandparents.end(),
+              [](const sst::file_boundary &b1, const sst::file_boundary &b2) -> bool {
+                  return b1.lower < b2.lower;
+              });
     static auto is_valid = [](const sst::sst_cache &cache) -> bool {
-        return cache.header.count > 0 && cache.level >= 0;
+        return (cache.header.count > 0 || !cache.range_dels.empty()) && cache.level >= 0;
     };
+    std::vector<sst::cache_ptr> retired{};
     for (auto it = selected_cache.begin(); it != selected_cache.end();) {
-        if (!is_valid(*it)) {
-            utils::rmfile(it->sst_path.c_str());
+        if (!is_valid(**it)) {
+            caches.erase(std::find(caches.begin(), caches.end(), *it));
+            retired.push_back(std::move(*it));
             it = selected_cache.erase(it);
         } else {
             ++it;
         }
     }
+    remove_files(retired);
+    std::string target_dir = this->data_dir + "/level-" + std::to_string(l2);
+
+    // Step 2: trivial move
+    // Nothing in l2 overlaps the l1 inputs, so they can be linked into l2 without a rewrite.
+    if (selected_cache.size() == l1_selected_cnt && strategy[l2].type == level_type::LEVELING &&
+        is_trivial_move(selected_cache, grandparents)) {
+        if (utils::mkdir(target_dir.c_str()) != 0) {
+            throw std::runtime_error{"Cannot create directory " + target_dir};
+        }
+        for (auto &cache : selected_cache) {
+            std::string new_path =
+                target_dir + cache->sst_path.substr(cache->sst_path.find_last_of('/'));
+            // Linking fails on a taken name, so it reserves the name like `generate_path`
+            while (utils::lnfile(cache->sst_path.c_str(), new_path.c_str()) != 0) {
+                if (!std::ifstream{new_path}) {
+                    throw std::runtime_error{"Cannot move sst " + cache->sst_path + " to " +
+                                             new_path};
+                }
+                new_path = target_dir + '/' + sst::generate_hash() + ".sst";
+            }
+            // A cache never changes once shared. The iterators reading the old one keep its
+            // path until they are done, and then it is unlinked like a compacted sst.
+            auto moved = std::make_shared<sst::sst_cache>(*cache);
+            moved->level = l2;
+            moved->sst_path = std::move(new_path);
+            place_metadata(*moved);
+            *std::find(caches.begin(), caches.end(), cache) = moved;
+            retired.push_back(std::move(cache));
+            ++stats.trivial_moves;
+            stats.trivial_move_bytes += moved->file_size;
+        }
+        selected_cache.clear();
+        remove_files(retired);
+        sort_caches();
+        return;
+    }
+
+    // Step 3: merge sort
+    // Tombstones are dropped once no deeper file overlaps them
+    merge(selected_cache, l2,
+          overlaps_older([=](const sst::sst_cache &cache) -> bool { return cache.level >= l2; },
+                         selected_cache),
+          grandparents);
+}
+
+sst::overlap_predicate KVStore::overlaps_older(
+    std::function<bool(const sst::sst_cache &)> is_older,
+    const std::vector<sst::cache_ptr> &inputs) const {
+    // The merge runs unlocked, so it must not read `caches`
+    std::vector<sst::cache_ptr> older{};
+    for (const auto &cache : caches) {
+        if (is_older(*cache) && std::find(inputs.begin(), inputs.end(), cache) == inputs.end()) {
+            older.push_back(cache);
+        }
+    }
+    return [older](key_type begin, key_type end) -> bool {
+        for (const auto &cache : older) {
+            if (begin == end ? cache->search(begin).second || cache->covers(begin)
+                             : !(cache->header.lower > end || cache->header.upper < begin)) {
+                return true;
+            }
+        }
+        return false;
+    };
+}
+
+void KVStore::merge(std::vector<sst::cache_ptr> &selected, int level,
+                    const sst::overlap_predicate &overlaps_older,
+                    const std::vector<sst::file_boundary> &grandparents) {
     // Precede the cache with bigger timestamp
-    std::sort(selected_cache.begin(), selected_cache.end(), std::greater<sst::sst_cache>{});
+    std::sort(selected.begin(), selected.end(),
+              [](const sst::cache_ptr &c1, const sst::cache_ptr &c2) -> bool {
+                  return *c1 > *c2;
+              });
 
-    // Step 2: merge sort
-    std::string target_dir = this->data_dir + "/level-" + std::to_string(l2);
-    std::vector<sst::sst_cache> merged_cache =
-        sst::sort_and_merge(selected_cache, target_dir, l2 == strategy.size());
-    this->caches.insert(caches.end(), std::make_move_iterator(merged_cache.begin()),
-                        std::make_move_iterator(merged_cache.end()));
-    std::sort(caches.begin(), caches.end());
+    ++stats.compactions;
+    lsm::size_type input_bytes = 0;
+    for (const auto &cache : selected) {
+        input_bytes += cache->file_size;
+        if (statistics) {
+            statistics->add(lsm::COMPACTION_BYTES_READ, cache->file_size);
+        }
+    }
+    stats.bytes_read += input_bytes;
+    std::size_t subcompactions = std::max<lsm::size_type>(
+        std::min(opts.max_subcompactions, opts.min_subcompaction_bytes == 0
+                                              ? opts.max_subcompactions
+                                              : input_bytes / opts.min_subcompaction_bytes),
+        1);
+    std::string target_dir = this->data_dir + "/level-" + std::to_string(level);
+    std::vector<lsm::seq_type> live_snapshots{};
+    {
+        std::lock_guard<std::mutex> list_lock{*snapshots_mutex};
+        live_snapshots.assign(snapshots->begin(), snapshots->end());
+    }
+    // A snapshot taken while unlocked sees no version older than the newest of the inputs,
+    // and the newest versions are always kept.
+    std::vector<sst::sst_cache> merged_cache{};
+    {
+        mutex.unlock();
+        struct relock {
+            std::mutex &mutex;
+            ~relock() {
+                mutex.lock();
+            }
+        } guard{mutex};
+        merged_cache =
+            sst::sort_and_merge(selected, target_dir, overlaps_older, live_snapshots,
+                                grandparents, opts.max_grandparent_overlap_bytes, limiter.get(),
+                                opts.sst_index, subcompactions);
+    }
+    stats.split_compactions += subcompactions > 1;
+    caches.erase(std::remove_if(caches.begin(), caches.end(),
+                                [&](const sst::cache_ptr &cache) -> bool {
+                                    return std::find(selected.begin(), selected.end(), cache) !=
+                                           selected.end();
+                                }),
+                 caches.end());
+    // The pointers to the value log the merge dropped
+    lsm::value_refs input_refs{}, output_refs{};
+    for (const auto &cache : selected) {
+        for (const auto &ref : cache->value_refs) {
+            input_refs[ref.first] += ref.second;
+        }
+    }
+    for (const auto &cache : merged_cache) {
+        for (const auto &ref : cache.value_refs) {
+            output_refs[ref.first] += ref.second;
+        }
+    }
+    value_log->add_garbage(input_refs, output_refs);
+    remove_files(selected);
+    for (auto &cache : merged_cache) {
+        place_metadata(cache);
+        stats.bytes_written += cache.file_size;
+        if (statistics) {
+            statistics->add(lsm::COMPACTION_BYTES_WRITTEN, cache.file_size);
+        }
+        this->caches.push_back(std::make_shared<sst::sst_cache>(std::move(cache)));
+    }
+    sort_caches();
 }
 
-const typename KVStore::value_type KVStore::DeleteNote{"~DELETED~"};
\ No newline at end of file
+std::vector<KVStore::sorted_run> KVStore::get_sorted_runs() const {
+    std::lock_guard<std::mutex> lock{mutex};
+    return collect_sorted_runs();
+}
+
+std::vector<KVStore::sorted_run> KVStore::collect_sorted_runs() const {
+    std::vector<sorted_run> runs{};
+    // Level-0 caches are ordered by ascending time stamp
+    for (auto it = caches.rbegin(); it != caches.rend() && (*it)->level == 0; ++it) {
+        if (runs.empty() || runs.back().time_stamp != (*it)->header.time_stamp) {
+            runs.push_back({(*it)->header.time_stamp, 0, 0});
+        }
+        ++runs.back().files;
+        runs.back().bytes += (*it)->file_size;
+    }
+    return runs;
+}
+
+bool KVStore::pick_sorted_runs(const std::vector<sorted_run> &runs, std::size_t &first,
+                               std::size_t &last) const {
+    const std::size_t N = runs.size();
+    if (N < opts.universal_max_sorted_runs || N < 2) {
+        return false;
+    }
+
+    // 1. Space amplification: everything but the oldest run is garbage in the worst case
+    lsm::size_type candidate_size = 0;
+    for (std::size_t i = 0; i + 1 < N; ++i) {
+        candidate_size += runs[i].bytes;
+    }
+    if (candidate_size * 100 >=
+        opts.universal_max_size_amplification_percent * runs[N - 1].bytes) {
+        first = 0;
+        last = N;
+        return true;
+    }
+
+    // 2. Size ratio: the newest runs of similar size, growing from the youngest
+    for (std::size_t i = 0; i < N; ++i) {
+        candidate_size = runs[i].bytes;
+        std::size_t j = i + 1;
+        for (; j < N && j - i < opts.universal_max_merge_width; ++j) {
+            if (candidate_size * (100 + opts.universal_size_ratio) < runs[j].bytes * 100) {
+                break;
+            }
+            candidate_size += runs[j].bytes;
+        }
+        if (j - i >= opts.universal_min_merge_width) {
+            first = i;
+            last = j;
+            return true;
+        }
+    }
+
+    // 3. Bound the number of runs: merge the newest ones regardless of their sizes
+    first = 0;
+    last = std::min(N, N - opts.universal_max_sorted_runs + 2);
+    return true;
+}
+
+void KVStore::compact_sorted_runs(const std::vector<sorted_run> &runs, std::size_t first,
+                                  std::size_t last) {
+    std::vector<sst::cache_ptr> selected_cache{};
+    for (const auto &cache : caches) {
+        bool is_selected =
+            cache->level == 0 &&
+            std::any_of(runs.begin() + first, runs.begin() + last, [&](const sorted_run &run) {
+                return run.time_stamp == cache->header.time_stamp;
+            });
+        if (is_selected) {
+            selected_cache.push_back(cache);
+        }
+    }
+    // Tombstones are dropped once no older run overlaps them
+    uint64_t oldest = runs[last - 1].time_stamp;
+    merge(selected_cache, 0,
+          overlaps_older(
+              [=](const sst::sst_cache &cache) -> bool {
+                  return cache.level > 0 || cache.header.time_stamp < oldest;
+              },
+              selected_cache));
+}
@@ -0,0 +1,115 @@
+#include <string>
+#include <chrono>
+#include <random>
+#include "../include/io.hpp"
+#include "../include/read_engine.hpp"
+#include "../include/utils.h"
+
+#define TestEqual(expect, real) \
+    if ((expect) != (real))     \
+    return 1
+
+static const std::string path = "./test_io.bin";
+
+int main() {
+    // Small buffers, so that every call crosses a buffer boundary
+    const std::size_t buffer_size = io::ALIGNMENT;
+    std::string expected{};
+    {
+        io::sequential_writer out{path, buffer_size};
+        TestEqual(true, static_cast<bool>(out));
+        for (int i = 0; i < 1000; ++i) {
+            std::string value(i * 7 % 5000, 'a' + i % 26);
+            out.put(static_cast<char>(i % 128)).write(value.c_str(), value.length() + 1);
+            expected += static_cast<char>(i % 128);
+            expected += value;
+            expected += '\0';
+        }
+        TestEqual(expected.length(), out.tell());
+        TestEqual(true, out.close());
+    }
+
+    io::sequential_reader in{path, buffer_size};
+    TestEqual(true, static_cast<bool>(in));
+    std::string value;
+    for (int i = 0; i < 1000; ++i) {
+        TestEqual(i % 128, in.get());
+        TestEqual(true, getline(in, value, '\0'));
+        TestEqual(std::string(i * 7 % 5000, 'a' + i % 26), value);
+    }
+    TestEqual(expected.length(), in.tell());
+    TestEqual(-1, in.get());
+
+    // Seek backwards and forwards
+    std::string buf(100, ' ');
+    for (uint64_t offset : {expected.length() - 100, 0ul, 5000ul, 4090ul, 12345ul, 3ul}) {
+        in.seek(offset);
+        TestEqual(offset, in.tell());
+        TestEqual(true, in.read(&buf[0], buf.length()));
+        TestEqual(expected.substr(offset, buf.length()), buf);
+    }
+    in.seek(expected.length() - 10);
+    TestEqual(false, in.read(&buf[0], buf.length()));
+
+    TestEqual(false, static_cast<bool>(io::sequential_reader{"./no/such/file"}));
+
+    // Random reads through both engines, one of them past the end of the file
+    io::file file{path};
+    TestEqual(true, static_cast<bool>(file));
+    std::mt19937 engine{725};
+    std::uniform_int_distribution<uint64_t> dist(0, expected.length() - 1);
+    for (auto kind : {io::engine_kind::AUTO, io::engine_kind::THREAD_POOL}) {
+        auto reader = io::make_read_engine(8, kind);
+        for (int round = 0; round < 3; ++round) {
+            std::vector<io::read_request> requests{};
+            for (int i = 0; i < 100; ++i) {
+                uint64_t offset = dist(engine);
+                std::size_t length = std::min<uint64_t>(i * 97 % 9000, expected.length() - offset);
+                requests.push_back({file.descriptor(), offset, std::string(length, ' '), false});
+            }
+            requests.push_back({file.descriptor(), expected.length() - 10, std::string(20, ' '),
+                                false});
+            reader->read_all(requests);
+            for (std::size_t i = 0; i + 1 < requests.size(); ++i) {
+                TestEqual(true, requests[i].ok);
+                TestEqual(expected.substr(requests[i].offset, requests[i].data.length()),
+                          requests[i].data);
+            }
+            TestEqual(false, requests.back().ok);
+        }
+    }
+    utils::rmfile(path.c_str());
+
+    // 1 MB per second lets 100 KB through per 100 ms
+    io::rate_limiter limiter{1024 * 1024};
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 5; ++i) {
+        limiter.request(64 * 1024);
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    TestEqual(true, elapsed >= std::chrono::milliseconds{200});
+    auto stats = limiter.get_stats();
+    TestEqual(5 * 64 * 1024, stats.bytes);
+    TestEqual(5, stats.requests);
+    TestEqual(true, stats.waits > 0 && stats.wait_us > 0);
+
+    // Tuned at every report: halved while the latency is elevated, then back step by step
+    const uint64_t rate = 20 * 1024 * 1024;
+    io::rate_limiter tuned{rate, true, std::chrono::microseconds{0}};
+    for (int i = 0; i < 10; ++i) {
+        tuned.record_latency(100);
+    }
+    TestEqual(rate, tuned.get_stats().bytes_per_second);
+    tuned.record_latency(1000);
+    TestEqual(rate / 2, tuned.get_stats().bytes_per_second);
+    for (int i = 0; i < 10; ++i) {
+        tuned.record_latency(10000);
+    }
+    TestEqual(rate / io::MIN_RATE_DIVISOR, tuned.get_stats().bytes_per_second);
+    TestEqual(true, tuned.get_stats().decreases > 1);
+    for (uint64_t i = 0; i < io::MIN_RATE_DIVISOR && tuned.get_stats().bytes_per_second < rate;
+         ++i) {
+        tuned.record_latency(10);
+    }
+    TestEqual(rate, tuned.get_stats().bytes_per_second);
+}
@@ -0,0 +1,833 @@
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <thread>
+#include "../include/kvstore.h"
+
+#define TestEqual(expect, real) \
+    if ((expect) != (real))     \
+    return 1
+
+static const std::string dir = "./kvstore_data";
+
+static std::size_t count_sst(int level) {
+    std::vector<std::string> sst_list;
+    std::string level_dir = dir + "/level-" + std::to_string(level);
+    if (!utils::dirExists(level_dir)) {
+        return 0;
+    }
+    return utils::scanDir(level_dir, sst_list);
+}
+
+using mirror = std::map<uint64_t, std::string>;
+
+// Random operations against a store, mirrored in a std::map.
+struct workload {
+    int ops = 20000;
+    uint64_t max_key = 8191;  // Keys are uniform in [0, max_key], unless `next_key` is set
+    std::function<uint64_t(int, std::mt19937 &)> next_key;
+    // Every `del_every`th operation deletes its key. Of the others, every `range_every`th
+    // deletes the `range_width` keys after it as well, and every `put_every`th writes it, while
+    // the rest get it. 0 for none.
+    int del_every = 10, range_every = 101, put_every = 1;
+    uint64_t range_width = 64;
+    std::function<std::string(int)> value = [](int i) {
+        return std::string(1000 + i % 1000, 'a' + i % 26);
+    };
+    std::function<void(int, KVStore &)> before;  // Called ahead of each operation, if set
+};
+
+// Run the workload against an empty store opened with `opts`, checking the deletes and the
+// gets against `mp`, then `check` the store while it is still open. `mp` is left holding the
+// expected contents.
+static int run_workload(const lsm::options &opts, const workload &load, mirror &mp,
+                        const std::function<int(KVStore &)> &check) {
+    std::mt19937 engine{725};
+    std::uniform_int_distribution<uint64_t> dist(0, load.max_key);
+    KVStore store{dir, opts};
+    store.reset();
+    mp.clear();
+    for (int i = 0; i < load.ops; ++i) {
+        if (load.before) {
+            load.before(i, store);
+        }
+        uint64_t key = load.next_key ? load.next_key(i, engine) : dist(engine);
+        if (load.del_every > 0 && i % load.del_every == 0) {
+            TestEqual(mp.count(key) == 1, store.del(key));
+            mp.erase(key);
+        } else if (load.range_every > 0 && i % load.range_every == 0) {
+            store.del_range(key, key + load.range_width);
+            mp.erase(mp.lower_bound(key), mp.upper_bound(key + load.range_width));
+        } else if (load.put_every > 0 && i % load.put_every == 0) {
+            std::string value = load.value(i);
+            store.put(key, value);
+            mp[key] = value;
+        } else {
+            auto found = mp.find(key);
+            TestEqual(found == mp.end() ? std::string{} : found->second, store.get(key));
+        }
+    }
+    return check(store);
+}
+
+// The store holds what the mirror does, for every key up to `max_key`.
+static int check_gets(KVStore &store, const mirror &mp, uint64_t max_key) {
+    for (uint64_t key = 0; key <= max_key; ++key) {
+        auto found = mp.find(key);
+        TestEqual(found == mp.end() ? std::string{} : found->second, store.get(key));
+    }
+    return 0;
+}
+
+// The iterator walks the pairs of the mirror in order.
+static int check_iterator(lsm::iterator &it, const mirror &mp) {
+    auto expected = mp.begin();
+    for (it.seek_to_first(); it.valid(); it.next(), ++expected) {
+        TestEqual(true, expected != mp.end());
+        TestEqual(expected->first, it.key());
+        TestEqual(expected->second, it.value());
+    }
+    TestEqual(true, expected == mp.end());
+    return 0;
+}
+
+// Random writes with overwrites, checked against std::map before and after a restart.
+static int run(const lsm::options &opts) {
+    workload load;
+    load.del_every = load.range_every = 0;
+    mirror mp;
+    TestEqual(0, run_workload(opts, load, mp, [&](KVStore &store) {
+        TestEqual(0, check_gets(store, mp, load.max_key));
+        store.wait_for_compaction();
+        std::size_t files = 0;
+        bool is_universal = opts.style == lsm::compaction_style::UNIVERSAL;
+        if (is_universal) {
+            TestEqual(true, store.get_sorted_runs().size() < opts.universal_max_sorted_runs);
+        }
+        for (const auto &summary : store.get_level_summary()) {
+            TestEqual(true, is_universal || summary.score <= 1);
+            TestEqual(summary.files, count_sst(summary.level));
+            files += summary.files;
+        }
+        TestEqual(true, files > 0);
+        if (opts.max_subcompactions > 1) {
+            TestEqual(true, store.get_compaction_stats().split_compactions > 0);
+        }
+        return 0;
+    }));
+    KVStore store{dir, opts};
+    TestEqual(0, check_gets(store, mp, load.max_key + 1));
+    store.reset();
+    return 0;
+}
+
+// Sequential keys never overlap the next level, so every compaction is a trivial move.
+static int run_sequential() {
+    KVStore store{dir};
+    store.reset();
+    for (int i = 0; i < 10000; ++i) {
+        store.put(i, std::string(1000, 'a' + i % 26));
+    }
+    const auto &stats = store.get_compaction_stats();
+    TestEqual(true, stats.trivial_moves > 0);
+    TestEqual(true, stats.trivial_move_bytes > 0);
+    TestEqual(0, stats.compactions);
+    for (int i = 0; i < 10000; ++i) {
+        TestEqual(std::string(1000, 'a' + i % 26), store.get(i));
+    }
+    store.reset();
+    return 0;
+}
+
+// A level-0 sst whose name is taken in the next level is moved there under a fresh name.
+static int run_trivial_move_collision() {
+    auto value = [](int i) { return std::string(1000, 'a' + i % 26); };
+    {
+        KVStore store{dir};
+        store.reset();
+        for (int i = 0; i < 10000; ++i) {
+            store.put(i, value(i));
+        }
+    }
+    // Level-0 is moved into the base level, the first one holding files
+    int base = 1;
+    while (base < 8 && count_sst(base) == 0) {
+        ++base;
+    }
+    std::vector<std::string> level0, base_level;
+    utils::scanDir(dir + "/level-0", level0);
+    utils::scanDir(dir + "/level-" + std::to_string(base), base_level);
+    TestEqual(true, !level0.empty() && !base_level.empty());
+    const std::string taken = dir + "/level-0/" + base_level.front();
+    TestEqual(0, std::rename((dir + "/level-0/" + level0.front()).c_str(), taken.c_str()));
+
+    KVStore store{dir};
+    int i = 10000;
+    for (; i < 30000 && std::ifstream{taken}; ++i) {
+        store.put(i, value(i));
+    }
+    TestEqual(false, static_cast<bool>(std::ifstream{taken}));
+    for (const auto &summary : store.get_level_summary()) {
+        TestEqual(summary.files, count_sst(summary.level));
+    }
+    for (int key = 0; key < i; ++key) {
+        TestEqual(value(key), store.get(key));
+    }
+    store.reset();
+    return 0;
+}
+
+// Two writers share a store that compacts inline. One flushes while the merge of the other has
+// released the lock, and must not start a second compaction over the same files.
+static int run_concurrent_writers() {
+    KVStore store{dir};
+    store.reset();
+    mirror mps[2];
+    auto write = [&store, &mps](int id) {
+        std::mt19937 engine(725 + id);
+        std::uniform_int_distribution<uint64_t> dist(0, 4095);
+        for (int i = 0; i < 10000; ++i) {
+            // The writers own the even and the odd keys
+            uint64_t key = dist(engine) * 2 + id;
+            std::string value(1000 + i % 1000, 'a' + i % 26);
+            store.put(key, value);
+            mps[id][key] = value;
+        }
+    };
+    std::thread other{write, 1};
+    write(0);
+    other.join();
+    TestEqual(true, store.get_compaction_stats().compactions > 0);
+    for (const auto &summary : store.get_level_summary()) {
+        TestEqual(summary.files, count_sst(summary.level));
+    }
+    mps[0].insert(mps[1].begin(), mps[1].end());
+    TestEqual(0, check_gets(store, mps[0], 8191));
+    store.reset();
+    return 0;
+}
+
+// Point and range deletes against std::map, before and after a restart.
+static int run_deletes(const lsm::options &opts) {
+    workload load;
+    mirror mp;
+    load.before = [&mp](int i, KVStore &store) {
+        if (i == 0) {
+            // Any value can be stored, including the former deletion mark.
+            store.put(8192, "~DELETED~");
+            mp[8192] = "~DELETED~";
+        }
+    };
+    TestEqual(0, run_workload(opts, load, mp, [&](KVStore &store) {
+        return check_gets(store, mp, 8192);
+    }));
+    KVStore store{dir, opts};
+    TestEqual(0, check_gets(store, mp, 8192));
+    // Deleting everything leaves no live key behind.
+    store.del_range(0, 8192);
+    TestEqual(false, store.del(8192));
+    TestEqual(std::string{}, store.get(8192));
+    store.put(100, "alive");
+    TestEqual("alive", store.get(100));
+    store.reset();
+    return 0;
+}
+
+// Snapshots see the store as it was when they were taken, across flushes and compactions.
+static int run_snapshots(const lsm::options &opts) {
+    workload load;
+    load.max_key = 4095;
+    mirror mp;
+    std::vector<std::pair<KVStore::snapshot_type, mirror>> views;
+    load.before = [&](int i, KVStore &store) {
+        if (i % 5000 == 0) {
+            views.emplace_back(store.snapshot(), mp);
+        }
+    };
+    return run_workload(opts, load, mp, [&](KVStore &store) {
+        store.wait_for_compaction();
+        TestEqual(true, store.get_compaction_stats().compactions > 0);
+        std::vector<uint64_t> keys(4096);
+        std::iota(keys.begin(), keys.end(), 0);
+        for (const auto &view : views) {
+            auto values = store.multi_get(keys, view.first);
+            for (uint64_t key = 0; key < 4096; ++key) {
+                auto it = view.second.find(key);
+                TestEqual(it == view.second.end() ? std::string{} : it->second,
+                          store.get(key, view.first));
+                TestEqual(store.get(key, view.first), values[key]);
+            }
+        }
+        std::list<std::pair<uint64_t, std::string>> list;
+        store.scan(0, 9, list, views.back().first);
+        TestEqual(10, list.size());
+        for (const auto &kv : list) {
+            auto it = views.back().second.find(kv.first);
+            TestEqual(it == views.back().second.end() ? std::string{} : it->second, kv.second);
+        }
+        views.clear();
+        std::mt19937 engine{726};
+        std::uniform_int_distribution<uint64_t> dist(0, 4095);
+        for (int i = 0; i < 10000; ++i) {
+            uint64_t key = dist(engine);
+            std::string value(1000 + i % 1000, 'A' + i % 26);
+            store.put(key, value);
+            mp[key] = value;
+        }
+        std::shuffle(keys.begin(), keys.end(), engine);
+        auto values = store.multi_get(keys);
+        for (std::size_t i = 0; i < keys.size(); ++i) {
+            auto it = mp.find(keys[i]);
+            TestEqual(it == mp.end() ? std::string{} : it->second, store.get(keys[i]));
+            TestEqual(store.get(keys[i]), values[i]);
+        }
+        store.reset();
+        return 0;
+    });
+}
+
+// Iterates the store like a std::map, and keeps its view while the store changes.
+static int run_iterator(const lsm::options &opts) {
+    workload load;
+    load.max_key = 4095;
+    mirror mp;
+    return run_workload(opts, load, mp, [&](KVStore &store) {
+        auto it = store.new_iterator();
+        TestEqual(false, it.valid());
+        TestEqual(0, check_iterator(it, mp));
+        auto r_expected = mp.rbegin();
+        for (it.seek_to_last(); it.valid(); it.prev(), ++r_expected) {
+            TestEqual(true, r_expected != mp.rend());
+            TestEqual(r_expected->first, it.key());
+        }
+        TestEqual(true, r_expected == mp.rend());
+
+        // Seek, then change directions
+        std::mt19937 engine{726};
+        std::uniform_int_distribution<uint64_t> dist(0, 4095);
+        for (int i = 0; i < 200; ++i) {
+            uint64_t key = dist(engine);
+            it.seek(key);
+            auto lower = mp.lower_bound(key);
+            TestEqual(lower != mp.end(), it.valid());
+            if (!it.valid()) {
+                continue;
+            }
+            TestEqual(lower->first, it.key());
+            it.next();
+            it.prev();
+            TestEqual(lower->first, it.key());
+            it.prev();
+            TestEqual(lower != mp.begin(), it.valid());
+            if (it.valid()) {
+                TestEqual(std::prev(lower)->first, it.key());
+                it.next();
+                TestEqual(lower->first, it.key());
+            }
+            it.seek_for_prev(key);
+            auto upper = mp.upper_bound(key);
+            TestEqual(upper != mp.begin(), it.valid());
+            if (it.valid()) {
+                TestEqual(std::prev(upper)->first, it.key());
+            }
+        }
+
+        std::list<std::pair<uint64_t, std::string>> list;
+        store.scan(1000, 1999, list);
+        TestEqual(decltype(list)(mp.lower_bound(1000), mp.upper_bound(1999)), list);
+
+        // Flushes and compactions do not disturb an iterator
+        it = store.new_iterator();
+        it.seek(0);
+        for (int i = 0; i < 10000; ++i) {
+            store.put(dist(engine), std::string(1000, 'A' + i % 26));
+        }
+        store.del_range(0, 4095);
+        TestEqual(false, store.new_iterator().valid());
+        TestEqual(0, check_iterator(it, mp));
+        store.reset();
+        return 0;
+    });
+}
+
+// Flushes and compactions pass through the rate limiter.
+static int run_rate_limited() {
+    lsm::options opts;
+    opts.rate_limit_bytes_per_sec = 512 * 1024 * 1024;
+    opts.rate_limit_auto_tune = true;
+    KVStore store{dir, opts};
+    store.reset();
+    std::mt19937 engine{725};
+    std::uniform_int_distribution<uint64_t> dist(0, 8191);
+    for (int i = 0; i < 20000; ++i) {
+        store.put(dist(engine), std::string(1000, 'a' + i % 26));
+        store.get(dist(engine));
+    }
+    const auto &stats = store.get_compaction_stats();
+    auto limited = store.get_rate_limiter_stats();
+    TestEqual(true, stats.compactions > 0);
+    TestEqual(true, limited.bytes >= stats.bytes_flushed + stats.bytes_written);
+    TestEqual(true, limited.bytes <= stats.bytes_flushed + stats.bytes_written + stats.bytes_read);
+    store.reset();
+    return 0;
+}
+
+// Writes slow down and stop while the paused background compaction lets level-0 grow.
+static int run_stalls() {
+    lsm::options opts;
+    opts.background_compaction = true;
+    opts.level0_slowdown_writes_trigger = 3;
+    opts.level0_stop_writes_trigger = 5;
+    std::map<uint64_t, std::string> mp;
+    std::mt19937 engine{725};
+    std::uniform_int_distribution<uint64_t> dist(0, 8191);
+    KVStore store{dir, opts};
+    store.reset();
+    store.pause_background_work();
+    auto level0 = [&store] { return store.get_level_summary()[0].files; };
+    auto write = [&](int i) {
+        uint64_t key = dist(engine);
+        std::string value(1000, 'a' + i % 26);
+        store.put(key, value);
+        mp[key] = value;
+    };
+    int i = 0;
+    for (; level0() < opts.level0_slowdown_writes_trigger; ++i) {
+        write(i);
+    }
+    TestEqual(0, store.get_compaction_stats().write_slowdowns);
+    for (; level0() < opts.level0_stop_writes_trigger; ++i) {
+        write(i);
+    }
+    auto stats = store.get_compaction_stats();
+    TestEqual(true, stats.write_slowdowns > 0);
+    TestEqual(0, stats.write_stops);
+
+    // The next writes stop until the compaction continues
+    std::thread writer{[&] {
+        for (int j = 0; j < 4000; ++j) {
+            write(i + j);
+        }
+    }};
+    while (store.get_compaction_stats().write_stops == 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds{1});
+    }
+    auto stopped_at = level0();
+    store.continue_background_work();
+    writer.join();
+    TestEqual(opts.level0_stop_writes_trigger, stopped_at);
+    TestEqual(true, store.get_compaction_stats().write_stall_us > 0);
+    store.wait_for_compaction();
+    TestEqual(true, store.get_level_summary()[0].score <= 1);
+    for (const auto &kv : mp) {
+        TestEqual(kv.second, store.get(kv.first));
+    }
+    store.reset();
+    return 0;
+}
+
+// The statistics agree with the operations and the compaction counters.
+static int run_statistics() {
+    lsm::options opts;
+    opts.statistics = std::make_shared<lsm::statistics>();
+    const lsm::statistics &statistics = *opts.statistics;
+    KVStore store{dir, opts};
+    store.reset();
+    std::mt19937 engine{725};
+    std::uniform_int_distribution<uint64_t> dist(0, 8191);
+    uint64_t user_bytes = 0;
+    for (int i = 0; i < 20000; ++i) {
+        std::string value(1000, 'a' + i % 26);
+        store.put(dist(engine), value);
+        user_bytes += sizeof(uint64_t) + value.size();
+    }
+    for (uint64_t key = 0; key < 10000; ++key) {
+        store.get(key);
+    }
+    std::vector<uint64_t> keys(1000);
+    std::iota(keys.begin(), keys.end(), 0);
+    store.multi_get(keys);
+    std::list<std::pair<uint64_t, std::string>> list;
+    store.scan(100, 199, list);
+    store.del(1);
+
+    auto stats = store.get_compaction_stats();
+    TestEqual(20000, statistics.get(lsm::PUT_NANOS).count);
+    TestEqual(10000, statistics.get(lsm::GET_NANOS).count);
+    TestEqual(1, statistics.get(lsm::MULTI_GET_NANOS).count);
+    TestEqual(1, statistics.get(lsm::SCAN_NANOS).count);
+    TestEqual(1, statistics.get(lsm::DEL_NANOS).count);
+    TestEqual(list.size(), statistics.get(lsm::KEYS_SCANNED));
+    // `del` looks the key up as well
+    TestEqual(11001, statistics.get(lsm::MEMTABLE_HIT) + statistics.get(lsm::MEMTABLE_MISS));
+    TestEqual(statistics.get(lsm::MEMTABLE_MISS), statistics.get(lsm::SST_PROBES_PER_GET).count);
+    TestEqual(user_bytes + sizeof(uint64_t), statistics.get(lsm::USER_BYTES_WRITTEN));
+    TestEqual(stats.bytes_flushed, statistics.get(lsm::FLUSH_BYTES_WRITTEN));
+    TestEqual(stats.bytes_read, statistics.get(lsm::COMPACTION_BYTES_READ));
+    TestEqual(stats.bytes_written, statistics.get(lsm::COMPACTION_BYTES_WRITTEN));
+    TestEqual(true, statistics.write_amplification() > 1);
+    // Keys 8192 and up were never written, so only the filters and the indices see them
+    TestEqual(true, statistics.get(lsm::BLOOM_POSITIVE) > 0);
+    TestEqual(true, statistics.get(lsm::BLOOM_NEGATIVE) > 0);
+    TestEqual(statistics.get(lsm::BLOOM_POSITIVE), statistics.get(lsm::SST_BLOCK_READS));
+    TestEqual(true, statistics.to_json().find("\"lsm.put.nanos\":{\"count\":20000,") !=
+                        std::string::npos);
+    store.reset();
+    return 0;
+}
+
+// The metadata past the budget is evicted and read again, and the pinned levels stay resident.
+static int run_metadata_cache() {
+    lsm::options opts;
+    opts.metadata_cache_bytes = 128 * 1024;
+    opts.pinned_metadata_levels = 1;
+    opts.statistics = std::make_shared<lsm::statistics>();
+    workload load;
+    load.ops = 30000;
+    load.max_key = 16383;
+    load.del_every = load.range_every = 0;
+    mirror mp;
+    TestEqual(0, run_workload(opts, load, mp, [&](KVStore &store) {
+        TestEqual(0, check_gets(store, mp, load.max_key));
+        auto usage = store.get_metadata_usage();
+        TestEqual(true, usage.pinned_bytes > opts.metadata_cache_bytes ||
+                            usage.bytes <= opts.metadata_cache_bytes);
+        TestEqual(true, usage.cache.misses > 0 && usage.cache.evictions > 0);
+        TestEqual(usage.cache.misses, opts.statistics->get(lsm::METADATA_CACHE_MISS));
+        TestEqual(usage.cache.hits, opts.statistics->get(lsm::METADATA_CACHE_HIT));
+        auto it = store.new_iterator();
+        return check_iterator(it, mp);
+    }));
+
+    // Placed again when the store is opened
+    KVStore reopened{dir, opts};
+    TestEqual(0, check_gets(reopened, mp, 999));
+    reopened.reset();
+    return 0;
+}
+
+// The row cache answers the repeated gets, and stays in step with the writes.
+static int run_row_cache() {
+    lsm::options opts;
+    opts.row_cache_bytes = 256 * 1024;
+    opts.statistics = std::make_shared<lsm::statistics>();
+    workload load;
+    load.ops = 40000;
+    // Most of the gets are of a few hot keys
+    load.next_key = [](int i, std::mt19937 &engine) -> uint64_t {
+        std::uniform_int_distribution<uint64_t> dist(0, 4095);
+        return i % 4 == 0 ? dist(engine) : dist(engine) % 32;
+    };
+    load.del_every = 13;
+    load.range_width = 16;
+    load.put_every = 5;
+    load.value = [](int i) { return std::string(500 + i % 1000, 'a' + i % 26); };
+    mirror mp;
+    return run_workload(opts, load, mp, [&](KVStore &store) {
+        auto stats = store.get_row_cache_stats();
+        TestEqual(true, stats.hits > stats.misses);
+        TestEqual(true, stats.bytes <= opts.row_cache_bytes);
+        TestEqual(stats.hits, opts.statistics->get(lsm::ROW_CACHE_HIT));
+        TestEqual(stats.misses, opts.statistics->get(lsm::ROW_CACHE_MISS));
+        store.reset();
+        TestEqual("", store.get(1));
+        return 0;
+    });
+}
+
+// Scans skip the ssts whose range filter rules out their range, and still find every key.
+static int run_range_filter() {
+    lsm::options opts;
+    opts.range_filter_bits_per_prefix = 10;
+    opts.statistics = std::make_shared<lsm::statistics>();
+    // Keys in narrow clusters far apart, so that every sst spans gaps
+    auto random_key = [](std::mt19937 &engine) -> uint64_t {
+        return engine() % 64 * 65536 + engine() % 256;
+    };
+    workload load;
+    load.next_key = [&](int, std::mt19937 &engine) { return random_key(engine); };
+    load.range_width = 16;
+    mirror mp;
+    return run_workload(opts, load, mp, [&](KVStore &store) {
+        std::mt19937 engine{726};
+        for (int i = 0; i < 200; ++i) {
+            // Within a cluster, or in a gap between clusters
+            uint64_t key1 = i % 2 == 0 ? random_key(engine) : engine() % 64 * 65536 + 1024;
+            uint64_t key2 = key1 + engine() % 512;
+            std::list<std::pair<uint64_t, std::string>> list;
+            store.scan(key1, key2, list);
+            TestEqual(decltype(list)(mp.lower_bound(key1), mp.upper_bound(key2)), list);
+        }
+        TestEqual(true, opts.statistics->get(lsm::RANGE_FILTER_NEGATIVE) > 0);
+        TestEqual(true, store.get_metadata_usage().range_filter_bytes > 0);
+        store.reset();
+        return 0;
+    });
+}
+
+// Large values live in the value log: compactions rewrite the keys only, and the garbage
+// collection keeps the log near the live values, while snapshots, iterators and restarts read
+// them as before.
+static int run_value_log(lsm::options opts) {
+    opts.value_log_min_size = 512;
+    opts.statistics = std::make_shared<lsm::statistics>();
+    workload load;
+    load.ops = 40000;
+    load.range_every = 1001;
+    load.range_width = 16;
+    load.value = [](int i) { return std::string(100 + i % 2000, 'a' + i % 26); };
+    mirror mp, view;
+    KVStore::snapshot_type snap;
+    std::unique_ptr<lsm::iterator> it;
+    load.before = [&](int i, KVStore &store) {
+        if (i == 10000) {
+            snap = store.snapshot();
+            view = mp;
+            it = std::make_unique<lsm::iterator>(store.new_iterator());
+        }
+    };
+    TestEqual(0, run_workload(opts, load, mp, [&](KVStore &store) {
+        store.wait_for_compaction();
+        auto stats = store.get_value_log_stats();
+        TestEqual(true, stats.collections > 0);
+        TestEqual(true, stats.gc_bytes_written < stats.gc_bytes_read);
+        TestEqual(true, store.get_compaction_stats().bytes_written * 4 <
+                            opts.statistics->get(lsm::USER_BYTES_WRITTEN));
+
+        // The snapshot and the iterator still read the collected segments
+        std::vector<uint64_t> keys(8192);
+        std::iota(keys.begin(), keys.end(), 0);
+        auto values = store.multi_get(keys, snap);
+        for (uint64_t key = 0; key < 8192; ++key) {
+            auto found = view.find(key);
+            TestEqual(found == view.end() ? std::string{} : found->second, values[key]);
+            TestEqual(values[key], store.get(key, snap));
+        }
+        TestEqual(0, check_iterator(*it, view));
+        it.reset();
+        snap.reset();
+
+        values = store.multi_get(keys);
+        for (uint64_t key = 0; key < 8192; ++key) {
+            auto found = mp.find(key);
+            TestEqual(found == mp.end() ? std::string{} : found->second, values[key]);
+            TestEqual(values[key], store.get(key));
+        }
+        std::list<std::pair<uint64_t, std::string>> list;
+        store.scan(100, 299, list);
+        TestEqual(decltype(list)(mp.lower_bound(100), mp.upper_bound(299)), list);
+        return 0;
+    }));
+    KVStore store{dir, opts};
+    TestEqual(0, check_gets(store, mp, 8191));
+    // Overwritten, the values become garbage, and are collected
+    auto before = store.get_value_log_stats();
+    for (uint64_t key = 0; key < 8192; ++key) {
+        store.put(key, std::string(1000, 'z'));
+    }
+    for (uint64_t key = 0; key < 8192; ++key) {
+        store.put(key, std::string(1000, 'y'));
+    }
+    store.wait_for_compaction();
+    auto after = store.get_value_log_stats();
+    TestEqual(true, after.collections > before.collections);
+    TestEqual(std::string(1000, 'y'), store.get(512));
+    store.reset();
+    TestEqual(0, store.get_value_log_stats().files);
+    TestEqual("", store.get(512));
+    return 0;
+}
+
+// Copy the files of the store as they are on the disk, as if it crashed.
+static void copy_store(const std::string &from, const std::string &to) {
+    utils::mkdir(to.c_str());
+    std::vector<std::string> names;
+    utils::scanDir(from, names);
+    for (const auto &name : names) {
+        std::string path = from + '/' + name;
+        if (utils::dirExists(path)) {
+            copy_store(path, to + '/' + name);
+        } else {
+            std::ofstream{to + '/' + name, std::ios::binary}
+                << std::ifstream{path, std::ios::binary}.rdbuf();
+        }
+    }
+}
+
+// A collection of the value log keeps the collected segment until the moved pointers are in
+// the ssts, so that a crash right after it loses no value.
+static int run_value_log_crash() {
+    const std::string crashed = dir + "_crashed";
+    lsm::options opts;
+    opts.value_log_min_size = 512;
+    std::map<uint64_t, std::string> mp;
+    KVStore store{dir, opts};
+    store.reset();
+    std::mt19937 engine{725};
+    std::uniform_int_distribution<uint64_t> dist(0, 8191);
+    uint64_t key = 0;
+    std::string overwritten;
+    for (int i = 0; store.get_value_log_stats().collections == 0; ++i) {
+        key = dist(engine);
+        std::string value(1000 + i % 1000, 'a' + i % 26);
+        store.put(key, value);
+        overwritten = std::move(mp[key]);
+        mp[key] = value;
+    }
+    // The collection follows the flush of the write that fills the memory table, and without
+    // a write-ahead log a crash loses that write
+    mp[key] = overwritten;
+    copy_store(dir, crashed);
+    {
+        KVStore reopened{crashed, opts};
+        for (const auto &kv : mp) {
+            TestEqual(kv.second, reopened.get(kv.first));
+        }
+        reopened.reset();
+    }
+    utils::rmdir(crashed.c_str());
+    store.reset();
+    return 0;
+}
+
+// The perf context of a get breaks it down into its steps, and slow operations are logged.
+static int run_perf_context() {
+    std::vector<std::string> log;
+    lsm::options opts;
+    opts.slow_op_logger = [&log](const std::string &line) { log.push_back(line); };
+    {
+        KVStore store{dir, opts};
+        store.reset();
+        for (int i = 0; i < 10000; ++i) {
+            store.put(i, std::string(1000, 'a' + i % 26));
+        }
+    }
+    KVStore store{dir, opts};  // Everything is in the ssts
+    lsm::perf_context &context = lsm::get_perf_context();
+
+    lsm::set_perf_level(lsm::perf_level::DISABLE);
+    context.reset();
+    store.get(10);
+    TestEqual(0, context.memtable_lookups);
+
+    lsm::set_perf_level(lsm::perf_level::ENABLE_COUNT);
+    store.get(10);
+    TestEqual(1, context.memtable_lookups);
+    TestEqual(0, context.memtable_nanos);
+    TestEqual(1, context.index_searches);
+    TestEqual(1, context.block_reads);
+    TestEqual(true, context.bytes_read > 1000);
+    TestEqual(true, context.sst_searches >= context.filter_probes);
+    TestEqual(true, context.filter_probes >= context.filter_passes);
+    TestEqual(true, context.filter_passes >= context.index_searches);
+
+    lsm::set_perf_level(lsm::perf_level::ENABLE_TIME);
+    context.reset();
+    store.multi_get({10, 20, 20000});
+    TestEqual(3, context.memtable_lookups);
+    TestEqual(2, context.block_reads);
+    TestEqual(true, context.read_nanos > 0);
+    TestEqual(true, context.to_string().find("block_reads = 2") != std::string::npos);
+
+    // A threshold no operation stays under
+    lsm::set_perf_level(lsm::perf_level::DISABLE);
+    context.reset();
+    opts.slow_op_threshold_us = 1;
+    {
+        KVStore slow{dir, opts};
+        log.clear();
+        for (uint64_t key = 0; key < 100; ++key) {
+            slow.get(key);
+        }
+    }
+    TestEqual(0, context.memtable_lookups);
+    TestEqual(true, !log.empty() && log.size() <= 100);
+    TestEqual(0, log.front().find("slow get key "));
+    TestEqual(true, log.front().find("block_reads = 1") != std::string::npos);
+    KVStore{dir}.reset();
+    return 0;
+}
+
+int main() {
+    TestEqual(0, run_sequential());
+    TestEqual(0, run_trivial_move_collision());
+    TestEqual(0, run_concurrent_writers());
+    TestEqual(0, run_deletes(lsm::options{}));
+    lsm::options universal;
+    universal.style = lsm::compaction_style::UNIVERSAL;
+    universal.universal_max_sorted_runs = 4;
+    TestEqual(0, run_deletes(universal));
+    TestEqual(0, run_snapshots(lsm::options{}));
+    TestEqual(0, run_snapshots(universal));
+    lsm::options thread_pool;
+    thread_pool.use_io_uring = false;
+    thread_pool.read_queue_depth = 4;
+    TestEqual(0, run_snapshots(thread_pool));
+    TestEqual(0, run_rate_limited());
+    lsm::options background;
+    background.background_compaction = true;
+    TestEqual(0, run_deletes(background));
+    TestEqual(0, run_snapshots(background));
+    TestEqual(0, run_iterator(background));
+    TestEqual(0, run(background));
+    background.style = lsm::compaction_style::UNIVERSAL;
+    background.universal_max_sorted_runs = 4;
+    TestEqual(0, run_iterator(background));
+    TestEqual(0, run(background));
+    TestEqual(0, run_stalls());
+    TestEqual(0, run_statistics());
+    TestEqual(0, run_perf_context());
+    TestEqual(0, run_metadata_cache());
+    TestEqual(0, run_row_cache());
+    TestEqual(0, run_range_filter());
+    TestEqual(0, run_value_log(lsm::options{}));
+    lsm::options separated;
+    separated.background_compaction = true;
+    TestEqual(0, run_value_log(separated));
+    TestEqual(0, run_value_log_crash());
+    separated.value_log_min_size = 512;
+    TestEqual(0, run_snapshots(separated));
+    TestEqual(0, run_iterator(separated));
+    TestEqual(0, run_iterator(lsm::options{}));
+    TestEqual(0, run_iterator(universal));
+    lsm::options learned;
+    learned.sst_index.layout = lsm::index_layout::LEARNED;
+    learned.sst_index.max_error = 4;
+    TestEqual(0, run_snapshots(learned));
+    TestEqual(0, run_iterator(learned));
+    lsm::options delta;
+    delta.sst_index.encoding = lsm::index_encoding::DELTA;
+    delta.sst_index.layout = lsm::index_layout::DELTA;
+    TestEqual(0, run_snapshots(delta));
+    TestEqual(0, run_iterator(delta));
+    delta.sst_index.layout = lsm::index_layout::BTREE;
+    TestEqual(0, run(delta));
+    lsm::options split;
+    split.max_subcompactions = 4;
+    split.min_subcompaction_bytes = lsm::MTB_MAXSIZE;
+    TestEqual(0, run(split));
+    TestEqual(0, run_deletes(split));
+    TestEqual(0, run_snapshots(split));
+    split.background_compaction = true;
+    TestEqual(0, run(split));
+    split.min_subcompaction_bytes = 0;
+    TestEqual(0, run(split));
+    lsm::options opts;
+    TestEqual(0, run(opts));
+    opts.pri = lsm::compaction_pri::MIN_OVERLAPPING_RATIO;
+    opts.max_grandparent_overlap_bytes = 2 * lsm::MTB_MAXSIZE;
+    TestEqual(0, run(opts));
+    opts.level_compaction_dynamic_level_bytes = false;
+    opts.max_bytes_for_level_base = 2 * lsm::MTB_MAXSIZE;
+    opts.max_bytes_for_level_multiplier = 2;
+    TestEqual(0, run(opts));
+    opts = lsm::options{};
+    opts.style = lsm::compaction_style::UNIVERSAL;
+    opts.universal_max_sorted_runs = 4;
+    TestEqual(0, run(opts));
+}
@@ -11,12 +11,12 @@ int main() {
     mtb::MemTable mtb;
     std::map<decltype(mtb)::key_type, decltype(mtb)::val_type> mp;
 
-    TestEqual(10240 + 32, mtb.byte_size());
+    TestEqual(10240 + 32 + 40, mtb.byte_size());
     for (int i = 0; i < 100; i += 2) {
         mp.insert(std::make_pair(i, std::to_string(i % 10)));
         mtb.put(i, std::to_string(i % 10));
     }
-    std::size_t expect_size = 32 + 10240 + 12 * 50 + 2 * 50;
+    std::size_t expect_size = 32 + 10240 + 40 + 21 * 50 + 2 * 50;
     TestEqual(expect_size, mtb.byte_size());
     for (int i = 0; i < 100; ++i) {
         const auto it = mp.find(i);
@@ -24,7 +24,7 @@ int main() {
         if (!p.second && it == mp.cend()) {
             continue;
         }
-        if (p.second && it != mp.cend() && p.first == it->second) {
+        if (p.second && it != mp.cend() && p.first.value == it->second) {
             continue;
         }
         return 1;
@@ -41,8 +41,70 @@ int main() {
     TestEqual(expect_size, mtb.byte_size());
     mtb.put(3, "~DELETED~"s);
     TestEqual(51, mtb.size());
+    // Any value can be stored, including the former deletion mark.
+    TestEqual("~DELETED~"s, mtb.get(3).first.value);
+    TestEqual(false, mtb.get(3).first.is_deleted());
+
+    expect_size += 21 + 10;
+    TestEqual(expect_size, mtb.byte_size());
+
+    // Tombstones
+    mtb.del(5);
+    TestEqual(true, mtb.get(5).second && mtb.get(5).first.is_deleted());
+    TestEqual(52, mtb.size());
+    expect_size += 21 + 1;
+    TestEqual(expect_size, mtb.byte_size());
+    mtb.del_range(90, 95);  // 90, 92, 94 are replaced
+    expect_size += 24 - 3 * (21 + 2);
+    TestEqual(expect_size, mtb.byte_size());
+    TestEqual(49, mtb.size());
+    TestEqual(true, mtb.get(92).first.is_deleted());
+    TestEqual(true, mtb.get(93).second);
+    TestEqual(false, mtb.get(97).second);
+    mtb.put(93, "3"s);
+    TestEqual("3"s, mtb.get(93).first.value);
+    expect_size += 21 + 2;
 
     auto cache = mtb.to_binary("test_read.sst", 0);
-    TestEqual(51, cache.header.count);
+    TestEqual(50, cache.header.count);
     TestEqual(0, cache.header.lower);
+    TestEqual(98, cache.header.upper);
+    TestEqual(expect_size, cache.file_size);
+    TestEqual(true, cache.covers(95) && !cache.covers(96));
+    TestEqual(false, cache.search(92).second);
+    TestEqual("3"s, cache.from_offset(cache.search(93).first).value);
+    TestEqual(true, cache.from_offset(cache.search(5).first).is_deleted());
+
+    auto read = sst::read_sst("test_read.sst", 0);
+    TestEqual(cache.file_size, read.file_size);
+    TestEqual(1, read.range_dels.size());
+    TestEqual(95, read.range_dels[0].end);
+
+    // Versions seen by snapshots are kept
+    mtb::MemTable::snapshot_list snapshots{};
+    mtb::MemTable versioned{1, &snapshots};
+    versioned.put(1, "a"s, 1);
+    versioned.put(2, "b"s, 2);
+    snapshots.insert(2);
+    versioned.put(1, "c"s, 3);
+    versioned.put(1, "d"s, 4);  // "c" is seen by no snapshot
+    TestEqual(3, versioned.size());
+    TestEqual("d"s, versioned.get(1).first.value);
+    versioned.del_range(0, 9, 5);
+    TestEqual(2, versioned.size());  // (1, "a"), (2, "b")
+    TestEqual("a"s, versioned.get(1, 2).first.value);
+    TestEqual(true, versioned.get(1).first.is_deleted());
+    TestEqual("b"s, versioned.get(2, 2).first.value);
+    TestEqual(false, versioned.get(2, 1).second);
+    snapshots.clear();
+    versioned.put(1, "e"s, 6);
+    TestEqual(2, versioned.size());  // (1, "e"), (2, "b")
+    TestEqual("e"s, versioned.get(1).first.value);
+
+    cache = versioned.to_binary("test_read.sst", 0);
+    TestEqual(6, cache.max_seq);
+    TestEqual("b"s, cache.get(2, 4).first.value);
+    TestEqual(true, cache.get(2).first.is_deleted());
+    TestEqual("e"s, cache.get(1).first.value);
+    TestEqual(true, cache.get(1, 5).first.is_deleted());
 }
\ No newline at end of file
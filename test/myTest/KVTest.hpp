@@ -62,6 +62,11 @@ public:
         std::cout << "PUT: \t" << latency[0].first << '\t' << latency[0].second << '\n';
         std::cout << "GET: \t" << latency[1].first << '\t' << latency[1].second << '\n';
         std::cout << "DEL: \t" << latency[2].first << '\t' << latency[2].second << '\n';
+        const auto &stats = kv->get_compaction_stats();
+        std::cout << "COMPACTION: \t" << stats.compactions << '\t' << stats.bytes_read << '\t'
+                  << stats.bytes_written << '\n';
+        std::cout << "TRIVIAL MOVE: \t" << stats.trivial_moves << '\t' << stats.trivial_move_bytes
+                  << '\n';
         std::cout << std::endl;
     }
 
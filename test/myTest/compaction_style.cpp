@@ -0,0 +1,65 @@
+// Compare leveled and universal compaction on the same random-overwrite workload.
+#include <iostream>
+#include <random>
+#include "kvstore.h"
+#include "time.hpp"
+using namespace std::string_literals;
+
+struct Report {
+    unsigned long long put_us, get_us;
+    double write_amp, space_amp;
+    std::size_t files;
+};
+
+Report run(const lsm::options &opts, int N, uint64_t key_space, std::size_t value_size) {
+    utils::mkdir("./data");
+    KVStore kv{"./data"s, opts};
+    kv.reset();
+
+    std::mt19937_64 engine{725};
+    std::uniform_int_distribution<uint64_t> dist(0, key_space - 1);
+    test::TimeRecorder put_recorder;
+    for (int i = 0; i < N; ++i) {
+        kv.put(dist(engine), std::string(value_size, 'a' + i % 26));
+    }
+    auto put_us = put_recorder.duration();
+
+    test::TimeRecorder get_recorder;
+    for (int i = 0; i < N; ++i) {
+        kv.get(dist(engine));
+    }
+    auto get_us = get_recorder.duration();
+
+    const auto &stats = kv.get_compaction_stats();
+    std::size_t files = 0;
+    lsm::size_type bytes = 0;
+    for (const auto &summary : kv.get_level_summary()) {
+        files += summary.files;
+        bytes += summary.bytes;
+    }
+    double live_bytes = std::min<double>(N, key_space) * (value_size + 14);
+    double write_amp =
+        1 + static_cast<double>(stats.bytes_written) / std::max<uint64_t>(stats.bytes_flushed, 1);
+    Report report{put_us, get_us, write_amp, bytes / live_bytes, files};
+    kv.reset();
+    return report;
+}
+
+int main(int argc, char **argv) {
+    int N = argc > 1 ? std::stoi(argv[1]) : 100'000;
+    uint64_t key_space = argc > 2 ? std::stoull(argv[2]) : 20'000;
+    std::size_t value_size = argc > 3 ? std::stoul(argv[3]) : 1000;
+
+    lsm::options leveled{};
+    lsm::options universal{};
+    universal.style = lsm::compaction_style::UNIVERSAL;
+
+    std::cout << "style\tput(us)\tget(us)\twrite-amp\tspace-amp\tfiles\n";
+    for (const auto &style :
+         {std::make_pair("level", leveled), std::make_pair("universal", universal)}) {
+        auto report = run(style.second, N, key_space, value_size);
+        std::cout << style.first << '\t' << report.put_us << '\t' << report.get_us << '\t'
+                  << report.write_amp << '\t' << report.space_amp << '\t' << report.files
+                  << '\n';
+    }
+}
@@ -0,0 +1,410 @@
+// Standard workloads against a `KVStore`, in the manner of rocksdb's db_bench:
+//
+//   lsm_bench --benchmarks=fillrandom,readrandom,ycsba --num=100000 --value_size=100 --threads=4
+//
+// Each benchmark reports its throughput, the percentiles of the latency of an operation, and
+// the write amplification of the writes it made. Benchmarks whose name starts with "fill" start
+// from an empty store; the others use what the previous ones left.
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <random>
+#include <thread>
+#include "kvstore.h"
+
+namespace {
+
+struct flags {
+    std::string benchmarks = "fillseq,fillrandom,readrandom,readseq,readwhilewriting,"
+                             "seekrandom,deleterandom,ycsba,ycsbb,ycsbc,ycsbd,ycsbe,ycsbf";
+    std::string db = "./bench_data";
+    uint64_t num = 100'000;  // Keys written by a fill, and the key space of the others
+    int64_t reads = -1;      // Operations of the other benchmarks, `num` if negative
+    std::size_t value_size = 100;
+    int threads = 1;
+    double zipf_theta = 0.99;  // Skew of the YCSB keys
+    uint64_t seed = 725;
+    std::string compaction_style = "level";
+    bool background_compaction = false;
+    std::size_t subcompactions = 1;      // `options::max_subcompactions`
+    std::size_t value_log_min_size = 0;  // `options::value_log_min_size`, 0 keeps values inline
+    bool statistics = false;  // Dump the statistics of the store after each benchmark
+};
+
+// Zipfian ranks in [0, n), the most popular first. See Gray et al., "Quickly generating
+// billion-record synthetic databases", as used by YCSB.
+class zipfian {
+public:
+    zipfian(uint64_t n, double theta) : n(n), theta(theta) {
+        double zeta_n = zeta(n), zeta_2 = zeta(2);
+        alpha = 1 / (1 - theta);
+        eta = (1 - std::pow(2.0 / n, 1 - theta)) / (1 - zeta_2 / zeta_n);
+        half_pow_theta = 1 + std::pow(0.5, theta);
+        this->zeta_n = zeta_n;
+    }
+
+    template <typename Engine>
+    uint64_t operator()(Engine &engine) const {
+        double u = std::uniform_real_distribution<>(0, 1)(engine);
+        double uz = u * zeta_n;
+        if (uz < 1) {
+            return 0;
+        }
+        if (uz < half_pow_theta) {
+            return 1;
+        }
+        return std::min<uint64_t>(n * std::pow(eta * u - eta + 1, alpha), n - 1);
+    }
+
+private:
+    uint64_t n;
+    double theta, alpha, eta, zeta_n, half_pow_theta;
+
+    double zeta(uint64_t count) const {
+        double sum = 0;
+        for (uint64_t i = 1; i <= count; ++i) {
+            sum += 1 / std::pow(i, theta);
+        }
+        return sum;
+    }
+};
+
+// Spread the popular ranks over the key space, so that they do not share ssts.
+uint64_t scramble(uint64_t rank, uint64_t n) {
+    uint64_t hash = 14695981039346656037ull;  // FNV-1a
+    for (int i = 0; i < 8; ++i) {
+        hash = (hash ^ (rank & 0xFF)) * 1099511628211ull;
+        rank >>= 8;
+    }
+    return hash % n;
+}
+
+struct thread_result {
+    uint64_t ops = 0;
+    uint64_t found = 0;  // Reads which found a value
+    std::vector<uint64_t> latencies_ns;
+};
+
+struct context {
+    const flags &f;
+    KVStore &store;
+    uint64_t ops;                        // Per thread
+    std::atomic<uint64_t> next_key;      // Next key inserted by YCSB D and E
+    std::atomic<int> running_readers;    // Readers of readwhilewriting not done yet
+};
+
+using rng = std::mt19937_64;
+
+std::string make_value(const flags &f, uint64_t key) {
+    return std::string(f.value_size, 'a' + key % 26);
+}
+
+template <typename Op>
+void timed(thread_result &res, Op &&op) {
+    auto start = std::chrono::steady_clock::now();
+    op();
+    res.latencies_ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                   std::chrono::steady_clock::now() - start)
+                                   .count());
+    ++res.ops;
+}
+
+void fill_seq(context &ctx, int tid, rng &, thread_result &res) {
+    // Each thread writes a contiguous slice of the keys
+    uint64_t per_thread = (ctx.f.num + ctx.f.threads - 1) / ctx.f.threads;
+    uint64_t end = std::min(ctx.f.num, (tid + 1) * per_thread);
+    for (uint64_t key = tid * per_thread; key < end; ++key) {
+        timed(res, [&] { ctx.store.put(key, make_value(ctx.f, key)); });
+    }
+}
+
+void fill_random(context &ctx, int tid, rng &engine, thread_result &res) {
+    std::uniform_int_distribution<uint64_t> dist(0, ctx.f.num - 1);
+    // The writes are split evenly, and the last thread takes the remainder as well
+    uint64_t writes = ctx.f.num / ctx.f.threads;
+    if (tid == ctx.f.threads - 1) {
+        writes += ctx.f.num % ctx.f.threads;
+    }
+    for (uint64_t i = 0; i < writes; ++i) {
+        uint64_t key = dist(engine);
+        timed(res, [&] { ctx.store.put(key, make_value(ctx.f, key)); });
+    }
+}
+
+void read_random(context &ctx, int, rng &engine, thread_result &res) {
+    std::uniform_int_distribution<uint64_t> dist(0, ctx.f.num - 1);
+    for (uint64_t i = 0; i < ctx.ops; ++i) {
+        uint64_t key = dist(engine);
+        timed(res, [&] { res.found += !ctx.store.get(key).empty(); });
+    }
+}
+
+void read_seq(context &ctx, int, rng &, thread_result &res) {
+    auto it = ctx.store.new_iterator();
+    it.seek_to_first();
+    for (uint64_t i = 0; i < ctx.ops && it.valid(); ++i) {
+        timed(res, [&] {
+            res.found += !it.value().empty();
+            it.next();
+        });
+    }
+}
+
+void seek_random(context &ctx, int, rng &engine, thread_result &res) {
+    std::uniform_int_distribution<uint64_t> dist(0, ctx.f.num - 1);
+    for (uint64_t i = 0; i < ctx.ops; ++i) {
+        uint64_t key = dist(engine);
+        timed(res, [&] {
+            auto it = ctx.store.new_iterator();
+            it.seek(key);
+            if (it.valid()) {
+                res.found += it.key() == key;
+                it.value();
+            }
+        });
+    }
+}
+
+void delete_random(context &ctx, int, rng &engine, thread_result &res) {
+    std::uniform_int_distribution<uint64_t> dist(0, ctx.f.num - 1);
+    for (uint64_t i = 0; i < ctx.ops; ++i) {
+        uint64_t key = dist(engine);
+        timed(res, [&] { res.found += ctx.store.del(key); });
+    }
+}
+
+// Thread 0 writes until the other threads are done reading. Only the reads are reported.
+void read_while_writing(context &ctx, int tid, rng &engine, thread_result &res) {
+    if (tid > 0) {
+        read_random(ctx, tid, engine, res);
+        --ctx.running_readers;
+        return;
+    }
+    std::uniform_int_distribution<uint64_t> dist(0, ctx.f.num - 1);
+    while (ctx.running_readers > 0) {
+        uint64_t key = dist(engine);
+        ctx.store.put(key, make_value(ctx.f, key));
+    }
+}
+
+// The YCSB core workloads, over the keys loaded by a fill.
+struct ycsb_mix {
+    double read, update, insert, scan, read_modify_write;
+    bool is_latest;  // Reads favor the recent inserts, or else the popular keys
+};
+
+void run_ycsb(const ycsb_mix &mix, context &ctx, int, rng &engine, thread_result &res) {
+    zipfian popular{ctx.f.num, ctx.f.zipf_theta};
+    std::uniform_real_distribution<> coin(0, 1);
+    std::uniform_int_distribution<uint64_t> scan_length(1, 100);
+    auto next_existing = [&]() -> uint64_t {
+        if (mix.is_latest) {
+            uint64_t latest = ctx.next_key - 1;
+            return latest - std::min(popular(engine), latest);
+        }
+        return scramble(popular(engine), ctx.f.num);
+    };
+    for (uint64_t i = 0; i < ctx.ops; ++i) {
+        double op = coin(engine);
+        if ((op -= mix.read) < 0) {
+            uint64_t key = next_existing();
+            timed(res, [&] { res.found += !ctx.store.get(key).empty(); });
+        } else if ((op -= mix.update) < 0) {
+            uint64_t key = next_existing();
+            timed(res, [&] { ctx.store.put(key, make_value(ctx.f, key + 1)); });
+        } else if ((op -= mix.insert) < 0) {
+            uint64_t key = ctx.next_key++;
+            timed(res, [&] { ctx.store.put(key, make_value(ctx.f, key)); });
+        } else if ((op -= mix.scan) < 0) {
+            uint64_t key = next_existing(), length = scan_length(engine);
+            timed(res, [&] {
+                std::list<std::pair<uint64_t, std::string>> list;
+                ctx.store.scan(key, key + length - 1, list);
+                res.found += !list.empty();
+            });
+        } else {
+            uint64_t key = next_existing();
+            timed(res, [&] {
+                std::string value = ctx.store.get(key);
+                res.found += !value.empty();
+                ctx.store.put(key, make_value(ctx.f, key + value.size()));
+            });
+        }
+    }
+}
+
+using workload = std::function<void(context &, int, rng &, thread_result &)>;
+
+workload ycsb(ycsb_mix mix) {
+    return [mix](context &ctx, int tid, rng &engine, thread_result &res) {
+        run_ycsb(mix, ctx, tid, engine, res);
+    };
+}
+
+const std::map<std::string, workload> &workloads() {
+    static const std::map<std::string, workload> all{
+        {"fillseq", fill_seq},
+        {"fillrandom", fill_random},
+        {"readrandom", read_random},
+        {"readseq", read_seq},
+        {"readwhilewriting", read_while_writing},
+        {"seekrandom", seek_random},
+        {"deleterandom", delete_random},
+        {"ycsba", ycsb({0.5, 0.5, 0, 0, 0, false})},
+        {"ycsbb", ycsb({0.95, 0.05, 0, 0, 0, false})},
+        {"ycsbc", ycsb({1, 0, 0, 0, 0, false})},
+        {"ycsbd", ycsb({0.95, 0, 0.05, 0, 0, true})},
+        {"ycsbe", ycsb({0, 0, 0.05, 0.95, 0, false})},
+        {"ycsbf", ycsb({0.5, 0, 0, 0, 0.5, false})},
+    };
+    return all;
+}
+
+double percentile(const std::vector<uint64_t> &sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    std::size_t rank = std::min<std::size_t>(sorted.size() * p / 100, sorted.size() - 1);
+    return sorted[rank] / 1e3;
+}
+
+// `index` is the position of the benchmark in the list, so that each draws other keys.
+void run(const flags &f, const std::string &name, int index, KVStore &store,
+         lsm::statistics &stats) {
+    auto found = workloads().find(name);
+    if (found == workloads().end()) {
+        std::cerr << "Unknown benchmark " << name << '\n';
+        return;
+    }
+    bool is_fill = name.compare(0, 4, "fill") == 0;
+    if (is_fill) {
+        store.reset();
+    }
+    // readwhilewriting spends one more thread on its writer
+    int threads = name == "readwhilewriting" ? f.threads + 1 : f.threads;
+    context ctx{f, store, (f.reads < 0 ? f.num : f.reads) / f.threads, {f.num}, {f.threads}};
+    stats.reset();
+
+    std::vector<thread_result> results(threads);
+    std::vector<std::thread> workers;
+    auto start = std::chrono::steady_clock::now();
+    for (int tid = 0; tid < threads; ++tid) {
+        workers.emplace_back([&, tid] {
+            rng engine{f.seed + index * 1000 + tid};
+            found->second(ctx, tid, engine, results[tid]);
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+                         .count();
+
+    thread_result total{};
+    for (auto &res : results) {
+        total.ops += res.ops;
+        total.found += res.found;
+        total.latencies_ns.insert(total.latencies_ns.end(), res.latencies_ns.begin(),
+                                  res.latencies_ns.end());
+    }
+    std::sort(total.latencies_ns.begin(), total.latencies_ns.end());
+    double ops_per_sec = total.ops / std::max(seconds, 1e-9);
+    std::cout << std::left << std::setw(17) << name << ": " << std::right << std::fixed
+              << std::setprecision(3) << std::setw(11) << 1e6 / std::max(ops_per_sec, 1e-9)
+              << " micros/op " << std::setw(10) << std::setprecision(0) << ops_per_sec
+              << " ops/sec; p50 " << std::setprecision(2) << percentile(total.latencies_ns, 50)
+              << " p99 " << percentile(total.latencies_ns, 99) << " p99.9 "
+              << percentile(total.latencies_ns, 99.9) << " us";
+    if (!is_fill && total.ops > 0) {
+        std::cout << "; (" << total.found << " of " << total.ops << " found)";
+    }
+    if (stats.get(lsm::USER_BYTES_WRITTEN) > 0) {
+        store.wait_for_compaction();
+        std::cout << "; write-amp " << stats.write_amplification();
+    }
+    std::cout << '\n';
+    if (f.statistics) {
+        std::cout << stats.to_string();
+    }
+}
+
+bool parse(int argc, char **argv, flags &f) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto eq = arg.find('=');
+        if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos) {
+            std::cerr << "Expected --name=value, got " << arg << '\n';
+            return false;
+        }
+        std::string name = arg.substr(2, eq - 2), value = arg.substr(eq + 1);
+        if (name == "benchmarks") {
+            f.benchmarks = value;
+        } else if (name == "db") {
+            f.db = value;
+        } else if (name == "num") {
+            f.num = std::max<uint64_t>(std::stoull(value), 1);
+        } else if (name == "reads") {
+            f.reads = std::stoll(value);
+        } else if (name == "value_size") {
+            f.value_size = std::stoul(value);
+        } else if (name == "threads") {
+            f.threads = std::max(std::stoi(value), 1);
+        } else if (name == "zipf_theta") {
+            f.zipf_theta = std::stod(value);
+        } else if (name == "seed") {
+            f.seed = std::stoull(value);
+        } else if (name == "compaction_style") {
+            f.compaction_style = value;
+        } else if (name == "background_compaction") {
+            f.background_compaction = value == "1" || value == "true";
+        } else if (name == "subcompactions") {
+            f.subcompactions = std::max<std::size_t>(std::stoul(value), 1);
+        } else if (name == "value_log_min_size") {
+            f.value_log_min_size = std::stoul(value);
+        } else if (name == "statistics") {
+            f.statistics = value == "1" || value == "true";
+        } else {
+            std::cerr << "Unknown flag --" << name << '\n';
+            return false;
+        }
+    }
+    return true;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    flags f;
+    if (!parse(argc, argv, f)) {
+        return 1;
+    }
+    lsm::options opts;
+    opts.statistics = std::make_shared<lsm::statistics>();
+    opts.background_compaction = f.background_compaction;
+    opts.max_subcompactions = f.subcompactions;
+    opts.value_log_min_size = f.value_log_min_size;
+    if (f.compaction_style == "universal") {
+        opts.style = lsm::compaction_style::UNIVERSAL;
+    }
+    std::cout << "Keys: " << f.num << ", values: " << f.value_size << " bytes, threads: "
+              << f.threads << ", compaction: " << f.compaction_style
+              << (f.background_compaction ? " (background)" : "")
+              << ", subcompactions: " << f.subcompactions
+              << ", value log from: " << f.value_log_min_size << " bytes\n";
+
+    KVStore store{f.db, opts};
+    std::size_t begin = 0;
+    int index = 0;
+    while (begin <= f.benchmarks.size()) {
+        std::size_t end = std::min(f.benchmarks.find(',', begin), f.benchmarks.size());
+        std::string name = f.benchmarks.substr(begin, end - begin);
+        if (!name.empty()) {
+            run(f, name, index++, store, *opts.statistics);
+        }
+        begin = end + 1;
+    }
+}
@@ -0,0 +1,459 @@
+// Throughput of the core data structures, written to a JSON file for comparison across commits:
+//
+//   micro_bench --out=micro_bench.json --min_time=0.5 --filter=bloom
+//
+// Each benchmark repeats its body until it has run for `min_time` seconds. The JSON follows the
+// layout of Google Benchmark, so that its compare tools can read it.
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <random>
+#include <thread>
+#include "BloomFilter.hpp"
+#include "MemTable.hpp"
+#include "MurmurHash3.h"
+#include "SkipList.hpp"
+#include "row_cache.hpp"
+#include "sst.hpp"
+#include "sst_index.hpp"
+#include "utils.h"
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+// Times the parts of a run between `start` and `stop`, so that set-up is left out.
+class stopwatch {
+public:
+    void start() {
+        begin = clock_type::now();
+    }
+    void stop() {
+        elapsed += clock_type::now() - begin;
+    }
+    double seconds() const {
+        return std::chrono::duration<double>(elapsed).count();
+    }
+
+private:
+    clock_type::time_point begin;
+    clock_type::duration elapsed{};
+};
+
+// Keeps `value`, and so the loop that computed it, from being optimized away: the compiler
+// must assume the empty asm reads it.
+template <typename T>
+void do_not_optimize(const T &value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct result {
+    std::string name;
+    uint64_t runs;
+    double ns_per_item;
+    double items_per_second;
+    double bytes_per_second;  // 0 if the benchmark does not process bytes
+    std::map<std::string, double> counters;
+};
+
+struct harness {
+    double min_time = 0.2;
+    std::string filter;
+    std::vector<result> results;
+
+    /**
+     * @param items_per_run operations done by one call of `body`.
+     * @param bytes_per_run bytes processed by one call of `body`.
+     */
+    void run(const std::string &name, uint64_t items_per_run, uint64_t bytes_per_run,
+             const std::function<void(stopwatch &)> &body,
+             std::map<std::string, double> counters = {}) {
+        if (name.find(filter) == std::string::npos) {
+            return;
+        }
+        stopwatch sw;
+        uint64_t runs = 0;
+        do {
+            body(sw);
+            ++runs;
+        } while (sw.seconds() < min_time);
+        double items = static_cast<double>(runs) * items_per_run;
+        double seconds = std::max(sw.seconds(), 1e-12);
+        results.push_back({name, runs, seconds * 1e9 / items, items / seconds,
+                           runs * bytes_per_run / seconds, std::move(counters)});
+        const result &r = results.back();
+        std::cout << std::left << std::setw(36) << r.name << std::right << std::fixed
+                  << std::setprecision(2) << std::setw(12) << r.ns_per_item << " ns/item"
+                  << std::setw(14) << std::setprecision(0) << r.items_per_second << " items/s";
+        if (r.bytes_per_second > 0) {
+            std::cout << std::setw(10) << std::setprecision(1) << r.bytes_per_second / (1 << 20)
+                      << " MB/s";
+        }
+        for (const auto &counter : r.counters) {
+            std::cout << "  " << counter.first << '=' << std::setprecision(6) << counter.second;
+        }
+        std::cout << '\n';
+    }
+
+    void write_json(const std::string &path) const {
+        std::ofstream out{path};
+        std::time_t now = std::time(nullptr);
+        char date[32];
+        std::strftime(date, sizeof date, "%FT%T%z", std::localtime(&now));
+        out << "{\n  \"context\": {\n    \"date\": \"" << date << "\",\n    \"num_cpus\": "
+            << std::thread::hardware_concurrency() << ",\n    \"library_build_type\": \""
+#ifdef NDEBUG
+            << "release"
+#else
+            << "debug"
+#endif
+            << "\"\n  },\n  \"benchmarks\": [";
+        for (std::size_t i = 0; i < results.size(); ++i) {
+            const result &r = results[i];
+            out << (i > 0 ? "," : "") << "\n    {\"name\": \"" << r.name
+                << "\", \"run_type\": \"iteration\", \"iterations\": " << r.runs
+                << ", \"real_time\": " << std::setprecision(10) << r.ns_per_item
+                << ", \"cpu_time\": " << r.ns_per_item
+                << ", \"time_unit\": \"ns\", \"items_per_second\": " << r.items_per_second;
+            if (r.bytes_per_second > 0) {
+                out << ", \"bytes_per_second\": " << r.bytes_per_second;
+            }
+            for (const auto &counter : r.counters) {
+                out << ", \"" << counter.first << "\": " << counter.second;
+            }
+            out << '}';
+        }
+        out << "\n  ]\n}\n";
+    }
+};
+
+std::vector<uint64_t> random_keys(std::size_t n, uint64_t seed) {
+    std::mt19937_64 engine{seed};
+    std::vector<uint64_t> keys(n);
+    for (auto &key : keys) {
+        key = engine() >> 1;  // Clear of the sentinel keys of the skip list
+    }
+    return keys;
+}
+
+void bench_skip_list(harness &h) {
+    using list_type = basic_ds::SkipList<uint64_t, uint64_t>;
+    for (std::size_t n : {1'000, 100'000, 1'000'000}) {
+        auto keys = random_keys(n, 725);
+        std::string suffix = '/' + std::to_string(n);
+        h.run("skip_list/insert" + suffix, n, 0, [&](stopwatch &sw) {
+            list_type list;
+            sw.start();
+            for (auto key : keys) {
+                list.insert(key, key);
+            }
+            sw.stop();
+        });
+
+        list_type list;
+        for (auto key : keys) {
+            list.insert(key, key);
+        }
+        auto probes = keys;
+        std::shuffle(probes.begin(), probes.end(), std::mt19937_64{1});
+        uint64_t sink = 0;
+        h.run("skip_list/find" + suffix, n, 0, [&](stopwatch &sw) {
+            sw.start();
+            for (auto key : probes) {
+                sink += list.find(key)->val;
+            }
+            sw.stop();
+        });
+        h.run("skip_list/iterate" + suffix, n, 0, [&](stopwatch &sw) {
+            sw.start();
+            for (auto p = list.begin(); p != list.end(); p = p->next()) {
+                sink += p->val;
+            }
+            sw.stop();
+        });
+        do_not_optimize(sink);
+    }
+}
+
+void bench_bloom_filter(harness &h) {
+    using filter_type = basic_ds::BloomFilter<lsm::BLF_SIZE>;
+    const std::size_t n = 10'000;
+    auto keys = random_keys(n, 725);
+    h.run("bloom_filter/insert", n, 0, [&](stopwatch &sw) {
+        filter_type filter;
+        sw.start();
+        for (auto key : keys) {
+            filter.insert(key);
+        }
+        sw.stop();
+    });
+
+    filter_type filter;
+    for (auto key : keys) {
+        filter.insert(key);
+    }
+    uint64_t sink = 0;
+    h.run("bloom_filter/contains", n, 0, [&](stopwatch &sw) {
+        sw.start();
+        for (auto key : keys) {
+            sink += filter.contains(key);
+        }
+        sw.stop();
+    });
+
+    // The false positive rate as the filter of an sst fills up
+    const double bits = lsm::BLF_SIZE * 8.0;
+    auto absent = random_keys(100'000, 1);
+    for (std::size_t fill : {1'000, 2'500, 5'000, 10'000, 20'000, 50'000}) {
+        auto inserted = random_keys(fill, 725);
+        filter_type filled;
+        for (auto key : inserted) {
+            filled.insert(key);
+        }
+        std::sort(inserted.begin(), inserted.end());
+        uint64_t positives = 0, probes = 0;
+        for (auto key : absent) {
+            if (!std::binary_search(inserted.begin(), inserted.end(), key)) {
+                positives += filled.contains(key);
+                ++probes;
+            }
+        }
+        h.run("bloom_filter/contains_absent/" + std::to_string(fill), absent.size(), 0,
+              [&](stopwatch &sw) {
+                  sw.start();
+                  for (auto key : absent) {
+                      sink += filled.contains(key);
+                  }
+                  sw.stop();
+              },
+              {{"false_positive_rate", static_cast<double>(positives) / probes},
+               {"bits_per_key", bits / fill}});
+    }
+    do_not_optimize(sink);
+}
+
+void bench_murmur_hash(harness &h) {
+    uint32_t out[4];
+    uint64_t sink = 0;
+    for (std::size_t len : {8, 64, 1024, 4096}) {
+        std::string data(len, 'x');
+        const std::size_t calls = 1 << 16;
+        h.run("murmur3_x64_128/" + std::to_string(len), calls, calls * len, [&](stopwatch &sw) {
+            sw.start();
+            for (std::size_t i = 0; i < calls; ++i) {
+                data[0] = static_cast<char>(i);
+                MurmurHash3_x64_128(data.data(), len, 1, out);
+                sink += out[0];
+            }
+            sw.stop();
+        });
+    }
+    do_not_optimize(sink);
+}
+
+// The index of an sst against the sorted pairs it replaced. Many indices are searched at once,
+// as the ssts of a store are, so that they do not all stay in the cache.
+void bench_sst_index(harness &h) {
+    using pair_type = std::pair<uint64_t, uint32_t>;
+    const std::size_t n = 100'000, probes_count = 1 << 16;
+    for (std::size_t tables : {1, 64}) {
+        std::vector<std::vector<pair_type>> pairs(tables);
+        std::vector<sst::key_index> indices, learned;
+        std::size_t pair_bytes = 0, index_bytes = 0, learned_bytes = 0, segments = 0;
+        for (std::size_t t = 0; t < tables; ++t) {
+            auto keys = random_keys(n, 725 + t);
+            std::sort(keys.begin(), keys.end());
+            std::vector<uint32_t> offsets(n);
+            pairs[t].reserve(n);
+            for (std::size_t i = 0; i < n; ++i) {
+                offsets[i] = i;
+                pairs[t].emplace_back(keys[i], i);
+            }
+            indices.emplace_back(keys, offsets);
+            learned.emplace_back(keys, offsets,
+                                 lsm::index_options{lsm::index_layout::LEARNED, 16});
+            pair_bytes += pairs[t].capacity() * sizeof(pair_type);
+            index_bytes += indices.back().memory_usage();
+            learned_bytes += learned.back().memory_usage();
+            segments += learned.back().model_size();
+        }
+        auto probes = random_keys(probes_count, 1);
+        std::string suffix = '/' + std::to_string(tables) + 'x' + std::to_string(n);
+        uint64_t sink = 0;
+        h.run("sst_index/pairs_lower_bound" + suffix, probes_count, 0, [&](stopwatch &sw) {
+            sw.start();
+            for (std::size_t i = 0; i < probes_count; ++i) {
+                const auto &run = pairs[i % tables];
+                auto it = std::lower_bound(run.begin(), run.end(), pair_type{probes[i], 0});
+                sink += it == run.end() ? 0 : it->second;
+            }
+            sw.stop();
+        }, {{"bytes_per_key", static_cast<double>(pair_bytes) / (tables * n)}});
+        h.run("sst_index/lower_bound" + suffix, probes_count, 0, [&](stopwatch &sw) {
+            sw.start();
+            for (std::size_t i = 0; i < probes_count; ++i) {
+                const auto &index = indices[i % tables];
+                auto pos = index.lower_bound(probes[i]);
+                sink += pos == sst::key_index::npos ? 0 : index.offset(pos);
+            }
+            sw.stop();
+        }, {{"bytes_per_key", static_cast<double>(index_bytes) / (tables * n)}});
+        h.run("sst_index/learned_lower_bound" + suffix, probes_count, 0, [&](stopwatch &sw) {
+            sw.start();
+            for (std::size_t i = 0; i < probes_count; ++i) {
+                const auto &index = learned[i % tables];
+                auto pos = index.lower_bound(probes[i]);
+                sink += pos == sst::key_index::npos ? 0 : index.offset(pos);
+            }
+            sw.stop();
+        }, {{"bytes_per_key", static_cast<double>(learned_bytes) / (tables * n)},
+            {"segments", static_cast<double>(segments) / tables}});
+        do_not_optimize(sink);
+    }
+}
+
+// Gets of the keys a row cache holds, with the copy of the value, and of the keys it does not.
+void bench_row_cache(harness &h) {
+    const std::size_t n = 10'000, lookups = 1 << 16;
+    for (std::size_t value_size : {100, 1000}) {
+        lsm::row_cache cache{n * (value_size + lsm::row_cache::ENTRY_OVERHEAD)};
+        auto keys = random_keys(n, 725);
+        std::string value(value_size, 'v');
+        for (auto key : keys) {
+            cache.insert(key, value);
+        }
+        auto absent = random_keys(lookups, 1);
+        std::mt19937_64 engine{1};
+        std::vector<uint64_t> hits(lookups);
+        for (auto &key : hits) {
+            key = keys[engine() % n];
+        }
+        std::string out;
+        uint64_t sink = 0;
+        std::string suffix = '/' + std::to_string(value_size);
+        h.run("row_cache/lookup_hit" + suffix, lookups, 0, [&](stopwatch &sw) {
+            sw.start();
+            for (auto key : hits) {
+                sink += cache.lookup(key, out);
+            }
+            sw.stop();
+        });
+        h.run("row_cache/lookup_miss" + suffix, lookups, 0, [&](stopwatch &sw) {
+            sw.start();
+            for (auto key : absent) {
+                sink += cache.lookup(key, out);
+            }
+            sw.stop();
+        });
+        do_not_optimize(sink);
+    }
+}
+
+void bench_memtable_flush(harness &h) {
+    const std::string path = "./micro_bench.sst";
+    for (std::size_t value_size : {100, 1000, 10000}) {
+        // A full memory table, as a flush finds it
+        mtb::MemTable table{1};
+        std::mt19937_64 engine{725};
+        std::string value(value_size, 'v');
+        lsm::seq_type seq = 0;
+        while (true) {
+            uint64_t key = engine() >> 1;
+            if (table.predict_byte_size(key, value) >= lsm::MTB_MAXSIZE) {
+                break;
+            }
+            table.put(key, value, ++seq);
+        }
+        lsm::size_type file_size = table.to_binary(path, 0).file_size;
+        h.run("memtable/to_binary/" + std::to_string(value_size), seq, file_size,
+              [&](stopwatch &sw) {
+                  sw.start();
+                  table.to_binary(path, 0);
+                  sw.stop();
+              });
+    }
+    utils::rmfile(path.c_str());
+}
+
+void bench_compaction(harness &h) {
+    const std::string dir = "./micro_bench_compaction", target = dir + "/level-1";
+    utils::mkdir(dir.c_str());
+    for (std::size_t value_size : {100, 1000, 10000}) {
+        // Four full memory tables over the same keys, a quarter of them rewritten by each
+        std::vector<sst::cache_ptr> inputs;
+        std::mt19937_64 engine{725};
+        std::string value(value_size, 'v');
+        lsm::seq_type seq = 0;
+        uint64_t records = 0;
+        for (int i = 0; i < 4; ++i) {
+            mtb::MemTable table{1};
+            while (true) {
+                uint64_t key = engine() % (lsm::MTB_MAXSIZE / value_size * 2);
+                if (table.predict_byte_size(key, value) >= lsm::MTB_MAXSIZE) {
+                    break;
+                }
+                table.put(key, value, ++seq);
+            }
+            records += table.size();
+            std::string path = dir + "/input-" + std::to_string(i) + ".sst";
+            inputs.insert(inputs.begin(),
+                          std::make_shared<sst::sst_cache>(table.to_binary(path, 0)));
+        }
+        lsm::size_type bytes = 0;
+        for (const auto &input : inputs) {
+            bytes += input->file_size;
+        }
+        h.run("compaction/sort_and_merge/" + std::to_string(value_size), records, bytes,
+              [&](stopwatch &sw) {
+                  sw.start();
+                  auto outputs = sst::sort_and_merge(inputs, target);
+                  sw.stop();
+                  for (const auto &output : outputs) {
+                      utils::rmfile(output.sst_path.c_str());
+                  }
+              });
+        for (const auto &input : inputs) {
+            utils::rmfile(input->sst_path.c_str());
+        }
+    }
+    utils::rmdir(target.c_str());
+    utils::rmdir(dir.c_str());
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    harness h;
+    std::string out = "micro_bench.json";
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto eq = arg.find('=');
+        std::string name = arg.substr(0, eq);
+        std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+        if (name == "--out") {
+            out = value;
+        } else if (name == "--min_time") {
+            h.min_time = std::stod(value);
+        } else if (name == "--filter") {
+            h.filter = value;
+        } else {
+            std::cerr << "Usage: micro_bench [--out=file.json] [--min_time=seconds] "
+                         "[--filter=substring]\n";
+            return 1;
+        }
+    }
+    bench_skip_list(h);
+    bench_bloom_filter(h);
+    bench_murmur_hash(h);
+    bench_sst_index(h);
+    bench_row_cache(h);
+    bench_memtable_flush(h);
+    bench_compaction(h);
+    h.write_json(out);
+    std::cout << "Results written to " << out << '\n';
+}
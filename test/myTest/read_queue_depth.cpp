@@ -0,0 +1,87 @@
+// Throughput of batched point lookups by the number of sst reads kept in flight.
+// With `cold`, the ssts are dropped from the page cache before each run, so that the reads
+// reach the device.
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <numeric>
+#include <random>
+#include "kvstore.h"
+#include "time.hpp"
+using namespace std::string_literals;
+
+static const std::string dir = "./data";
+
+// Ask the kernel to drop the cached pages of every sst.
+static void drop_caches() {
+    std::vector<std::string> levels;
+    utils::scanDir(dir, levels);
+    for (const auto &level : levels) {
+        std::vector<std::string> ssts;
+        utils::scanDir(dir + '/' + level, ssts);
+        for (const auto &sst : ssts) {
+            int fd = ::open((dir + '/' + level + '/' + sst).c_str(), O_RDONLY);
+            ::fdatasync(fd);
+            ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            ::close(fd);
+        }
+    }
+}
+
+// Returns: keys per second.
+double run(const lsm::options &opts, int lookups, std::size_t batch, uint64_t key_space,
+           bool cold) {
+    KVStore kv{dir, opts};
+    std::mt19937_64 engine{725};
+    std::uniform_int_distribution<uint64_t> dist(0, key_space - 1);
+    if (cold) {
+        drop_caches();
+    }
+    test::TimeRecorder recorder;
+    std::vector<uint64_t> keys(batch);
+    for (int done = 0; done < lookups; done += batch) {
+        for (auto &key : keys) {
+            key = dist(engine);
+        }
+        if (batch == 1) {
+            kv.get(keys[0]);
+        } else {
+            kv.multi_get(keys);
+        }
+    }
+    return lookups * 1e6 / std::max<unsigned long long>(recorder.duration(), 1);
+}
+
+int main(int argc, char **argv) {
+    uint64_t key_space = argc > 1 ? std::stoull(argv[1]) : 100'000;
+    std::size_t value_size = argc > 2 ? std::stoul(argv[2]) : 4096;
+    int lookups = argc > 3 ? std::stoi(argv[3]) : 20'000;
+    bool cold = argc > 4 && argv[4] == "cold"s;
+
+    utils::mkdir(dir.c_str());
+    {
+        KVStore kv{dir};
+        kv.reset();
+        std::mt19937_64 engine{725};
+        std::vector<uint64_t> keys(key_space);
+        std::iota(keys.begin(), keys.end(), 0);
+        std::shuffle(keys.begin(), keys.end(), engine);
+        for (auto key : keys) {
+            kv.put(key, std::string(value_size, 'a' + key % 26));
+        }
+    }
+
+    std::cout << "engine\tdepth\tkeys/s\n";
+    std::cout << "get\t1\t" << run(lsm::options{}, lookups, 1, key_space, cold) << '\n';
+    for (bool use_io_uring : {true, false}) {
+        for (std::size_t depth : {1, 2, 4, 8, 16, 32, 64}) {
+            lsm::options opts{};
+            opts.use_io_uring = use_io_uring;
+            opts.read_queue_depth = depth;
+            std::cout << (use_io_uring ? "io_uring" : "thread-pool") << '\t' << depth << '\t'
+                      << run(opts, lookups, 256, key_space, cold) << '\n';
+        }
+    }
+    KVStore{dir}.reset();
+}
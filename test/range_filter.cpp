@@ -0,0 +1,74 @@
+#include <algorithm>
+#include <random>
+#include <vector>
+#include "../include/range_filter.hpp"
+
+#define TestEqual(expect, real) \
+    if ((expect) != (real))     \
+    return 1
+
+using sst::range_filter;
+
+// Checks ranges of `width` keys over the filter of `keys`: none holding a key is ruled out, and
+// at most `max_fpr` of the empty ones pass.
+static int check(const std::vector<uint64_t> &keys, uint64_t width, double max_fpr,
+                 std::mt19937_64 &engine) {
+    range_filter filter{keys, 10};
+    uint64_t empty = 0, passed = 0;
+    for (int i = 0; i < 4000; ++i) {
+        uint64_t first = i % 2 == 0 ? keys[engine() % keys.size()] - engine() % width
+                                    : engine() % (keys.back() + width);
+        uint64_t last = first + width - 1;
+        auto it = std::lower_bound(keys.begin(), keys.end(), first);
+        bool holds = it != keys.end() && *it <= last;
+        bool may_contain = filter.may_contain(first, last);
+        if (holds) {
+            TestEqual(true, may_contain);
+        } else {
+            ++empty;
+            passed += may_contain;
+        }
+    }
+    TestEqual(true, passed <= max_fpr * empty);
+    return 0;
+}
+
+int main() {
+    std::mt19937_64 engine{725};
+
+    // Keys spread over 2^40
+    std::vector<uint64_t> sparse(1000);
+    for (auto &key : sparse) {
+        key = engine() >> 24;
+    }
+    std::sort(sparse.begin(), sparse.end());
+    TestEqual(0, check(sparse, 1, 0.05, engine));
+    TestEqual(0, check(sparse, 100, 0.05, engine));
+    TestEqual(0, check(sparse, 100000, 0.1, engine));
+    TestEqual(0, check(sparse, uint64_t{1} << 30, 1, engine));
+
+    // Dense keys, a few versions each, with a hole of four whole prefixes
+    std::vector<uint64_t> dense;
+    for (uint64_t key = 0; key < 16384; ++key) {
+        if (key < 5120 || key >= 6144) {
+            dense.insert(dense.end(), key % 3 == 0 ? 2 : 1, key);
+        }
+    }
+    TestEqual(0, check(dense, 7, 0.15, engine));
+    range_filter filter{dense, 10};
+    TestEqual(false, filter.may_contain(5200, 6000));
+    TestEqual(true, filter.may_contain(5119, 5200));
+    TestEqual(true, filter.may_contain(0, UINT64_MAX));
+    // The prefixes of a dense run mostly share their levels
+    TestEqual(true, filter.byte_size() * 8 < 16384 * 10 * 5 / 4);
+
+    // No keys rule out the ranges, and a default filter none
+    TestEqual(false, range_filter(std::vector<uint64_t>{}, 10).may_contain(1000, 2000));
+    TestEqual(true, range_filter{}.may_contain(5100, 5900));
+    std::vector<uint64_t> extremes{0, UINT64_MAX};
+    range_filter ends{extremes, 10};
+    TestEqual(true, ends.may_contain(UINT64_MAX, UINT64_MAX));
+    TestEqual(true, ends.may_contain(0, 0));
+    TestEqual(false, ends.may_contain(1000, 2000));
+    return 0;
+}
@@ -0,0 +1,74 @@
+#include <string>
+#include "../include/row_cache.hpp"
+
+#define TestEqual(expect, real) \
+    if ((expect) != (real))     \
+    return 1
+
+using lsm::row_cache;
+
+int main() {
+    std::string value;
+    const std::string hundred(100, 'h');
+    const lsm::size_type entry = hundred.size() + row_cache::ENTRY_OVERHEAD;
+
+    // Admitted freely while there is room, and dropped by the writes
+    row_cache cache{100 * entry};
+    TestEqual(false, cache.lookup(1, value));
+    TestEqual(true, cache.insert(1, hundred));
+    TestEqual(true, cache.lookup(1, value));
+    TestEqual(hundred, value);
+    TestEqual(true, cache.insert(2, ""));
+    TestEqual(true, cache.lookup(2, value));
+    TestEqual("", value);
+    cache.erase(1);
+    TestEqual(false, cache.lookup(1, value));
+    for (uint64_t key = 10; key < 60; ++key) {
+        cache.insert(key, hundred);
+    }
+    cache.erase_range(20, 29);  // Key by key
+    TestEqual(false, cache.lookup(25, value));
+    TestEqual(true, cache.lookup(30, value));
+    cache.erase_range(0, UINT64_MAX);  // Entry by entry
+    TestEqual(0, cache.get_stats().entries);
+    TestEqual(0, cache.get_stats().bytes);
+
+    // Within the capacity, and the hot keys outlast a scan through the cold ones
+    row_cache scanned{100 * entry};
+    for (int round = 0; round < 4; ++round) {
+        for (uint64_t key = 0; key < 50; ++key) {
+            if (!scanned.lookup(key, value)) {
+                scanned.insert(key, hundred);
+            }
+        }
+    }
+    for (uint64_t key = 1000; key < 11000; ++key) {
+        if (!scanned.lookup(key, value)) {
+            scanned.insert(key, hundred);
+        }
+        TestEqual(true, scanned.get_stats().bytes <= 100 * entry);
+    }
+    for (uint64_t key = 0; key < 50; ++key) {
+        TestEqual(true, scanned.lookup(key, value));
+    }
+    auto stats = scanned.get_stats();
+    TestEqual(true, stats.rejections > 9000);
+    TestEqual(true, stats.evictions <= 50);
+    TestEqual(stats.admissions - stats.evictions, stats.entries);
+
+    // A key used more often than the victim takes its place
+    row_cache small{2 * entry};
+    small.insert(1, hundred);
+    small.insert(2, hundred);
+    TestEqual(false, small.insert(3, hundred));
+    for (int i = 0; i < 3; ++i) {
+        small.lookup(3, value);
+    }
+    TestEqual(true, small.insert(3, hundred));
+    TestEqual(1, small.get_stats().evictions);
+    TestEqual(false, small.insert(4, std::string(2 * entry, 'x')));  // Larger than the cache
+    small.clear();
+    TestEqual(false, small.lookup(3, value));
+    TestEqual(0, small.get_stats().bytes);
+    return 0;
+}
@@ -44,6 +44,21 @@ int main() {
         }
     }
 
+    // Test erase.
+    for (int i = 0; i < 100; i += 3) {
+        if (!sl.erase(i) || sl.find(i) || sl.erase(i)) {
+            return 1;
+        }
+    }
+    kv_list = sl.get_kv(12, 20);
+    TestEqual(6, kv_list.size());  // 13, 14, 16, 17, 19, 20
+    TestEqual(13, kv_list.front().first);
+    TestEqual(20, kv_list.back().first);
+    for (int i = 0; i < 100; i += 3) {
+        sl.insert(i, i);
+    }
+    TestEqual(100, sl.get_kv().size());
+
     // Test edge cases.
     auto val1 = sl.find(1)->val;
     for (int k = 0; k < 100; ++k) {
@@ -55,4 +70,24 @@ int main() {
             return 1;
         }
     }
-}
\ No newline at end of file
+
+    // Test bottom-level traversal.
+    sl.erase(50);
+    TestEqual(51, sl.lower_bound(50)->key);
+    TestEqual(49, sl.floor(50)->key);
+    TestEqual(0, sl.begin()->key);
+    TestEqual(sl.rend(), sl.begin()->prev());
+    TestEqual(sl.end(), sl.rbegin()->next());
+    TestEqual(sl.end(), sl.lower_bound(100));
+    std::size_t count = 0;
+    for (auto p = sl.rbegin(); p != sl.rend(); p = p->prev()) {
+        ++count;
+    }
+    TestEqual(99, count);
+
+    // Test copy.
+    auto copy = sl;
+    copy.insert_or_assign(1, 0);
+    TestEqual(val1, sl.find(1)->val);
+    TestEqual(99, copy.get_kv().size());
+}
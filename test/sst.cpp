@@ -0,0 +1,216 @@
+#include <map>
+#include "../include/MemTable.hpp"
+
+using namespace std::string_literals;
+
+#define TestEqual(expect, real) \
+    if ((expect) != (real))     \
+    return 1
+
+static const std::string dir = "./sst_data/level-1";
+
+int main() {
+    utils::mkdir(dir.c_str());
+
+    // The older table
+    mtb::MemTable old_mtb{1};
+    for (int i = 0; i < 100; ++i) {
+        old_mtb.put(i, std::to_string(i), i + 1);
+    }
+    // The newer table deletes [10, 19] by a range, 20 by a point, and overwrites 30
+    mtb::MemTable new_mtb{2};
+    new_mtb.del_range(10, 19, 101);
+    new_mtb.del(20, 102);
+    new_mtb.put(30, "thirty"s, 103);
+    new_mtb.del(200, 104);
+
+    std::vector<sst::cache_ptr> caches;
+    caches.push_back(std::make_shared<sst::sst_cache>(new_mtb.to_binary(dir + "/new.sst", 1)));
+    caches.push_back(std::make_shared<sst::sst_cache>(old_mtb.to_binary(dir + "/old.sst", 1)));
+    TestEqual(10, caches[0]->header.lower);
+    TestEqual(200, caches[0]->header.upper);
+    // The caller removes the inputs
+    auto remove_inputs = [&caches]() {
+        for (const auto &cache : caches) {
+            utils::rmfile(cache->sst_path.c_str());
+        }
+    };
+
+    // Nothing older: every tombstone is dropped with the records it covers
+    auto merged = sst::sort_and_merge(caches, dir, [](lsm::key_type, lsm::key_type) {
+        return false;
+    });
+    remove_inputs();
+    TestEqual(1, merged.size());
+    auto kv_list = merged[0].get_kv();
+    TestEqual(89, kv_list.size());
+    TestEqual(true, merged[0].range_dels.empty());
+    std::map<lsm::key_type, std::string> mp;
+    for (const auto &kv : kv_list) {
+        TestEqual(false, kv.second.is_deleted());
+        mp[kv.first] = kv.second.value;
+    }
+    TestEqual(0, mp.count(15) + mp.count(20) + mp.count(200));
+    TestEqual("thirty"s, mp[30]);
+    TestEqual("9"s, mp[9]);
+
+    // Older tables overlap: the tombstones are kept, the covered records are still dropped
+    mtb::MemTable del_mtb{3};
+    del_mtb.del_range(0, 49, 105);
+    del_mtb.del(60, 106);
+    caches.clear();
+    caches.push_back(std::make_shared<sst::sst_cache>(del_mtb.to_binary(dir + "/del.sst", 1)));
+    caches.push_back(std::make_shared<sst::sst_cache>(std::move(merged[0])));
+    merged = sst::sort_and_merge(caches, dir, [](lsm::key_type, lsm::key_type) {
+        return true;
+    });
+    remove_inputs();
+    TestEqual(1, merged.size());
+    TestEqual(1, merged[0].range_dels.size());
+    TestEqual(true, merged[0].covers(49) && !merged[0].covers(50));
+    kv_list = merged[0].get_kv();
+    TestEqual(50, kv_list.front().first);
+    TestEqual(true, merged[0].from_offset(merged[0].search(60).first).is_deleted());
+
+    // Reload from the file
+    auto read = sst::read_sst(merged[0].sst_path, 1);
+    TestEqual(0, read.header.lower);
+    TestEqual(99, read.header.upper);
+    TestEqual(true, read.covers(0));
+    TestEqual(106, read.max_seq);
+    utils::rmfile(merged[0].sst_path.c_str());
+
+    // A snapshot at 115 keeps the versions it sees
+    mtb::MemTable older{4}, newer{5};
+    older.put(1, "x"s, 110);
+    older.put(2, "p"s, 111);
+    newer.put(1, "y"s, 120);
+    newer.del_range(2, 2, 121);
+    caches.clear();
+    caches.push_back(std::make_shared<sst::sst_cache>(newer.to_binary(dir + "/newer.sst", 1)));
+    caches.push_back(std::make_shared<sst::sst_cache>(older.to_binary(dir + "/older.sst", 1)));
+    auto nothing_older = [](lsm::key_type, lsm::key_type) { return false; };
+    merged = sst::sort_and_merge(caches, dir, nothing_older, {115});
+    remove_inputs();
+    TestEqual(1, merged.size());
+    TestEqual(3, merged[0].header.count);
+    TestEqual(1, merged[0].range_dels.size());
+    TestEqual("y"s, merged[0].get(1).first.value);
+    TestEqual("x"s, merged[0].get(1, 115).first.value);
+    TestEqual(true, merged[0].get(2).first.is_deleted());
+    TestEqual("p"s, merged[0].get(2, 115).first.value);
+
+    // Released: only the newest versions are left
+    caches = {std::make_shared<sst::sst_cache>(std::move(merged[0]))};
+    merged = sst::sort_and_merge(caches, dir, nothing_older);
+    remove_inputs();
+    TestEqual(1, merged.size());
+    TestEqual(1, merged[0].header.count);
+    TestEqual(true, merged[0].range_dels.empty());
+    TestEqual("y"s, merged[0].get(1).first.value);
+    TestEqual(false, merged[0].get(1, 115).second);
+    utils::rmfile(merged[0].sst_path.c_str());
+
+    // Subcompactions split the keys into disjoint ranges, and merge them as a whole would
+    mtb::MemTable wide_old{7}, wide_new{8};
+    for (int i = 0; i < 4000; ++i) {
+        wide_old.put(i, std::to_string(i), 300 + i);
+    }
+    for (int i = 0; i < 4000; i += 3) {
+        wide_new.put(i, "new"s, 5000 + i);
+    }
+    wide_new.del_range(1000, 2999, 9000);
+    caches = {std::make_shared<sst::sst_cache>(wide_new.to_binary(dir + "/wide_new.sst", 1)),
+              std::make_shared<sst::sst_cache>(wide_old.to_binary(dir + "/wide_old.sst", 1))};
+    auto ranges = sst::split_key_range(caches, 4);
+    TestEqual(4, ranges.size());
+    TestEqual(0, ranges.front().first);
+    TestEqual(UINT64_MAX, ranges.back().second);
+    for (std::size_t i = 1; i < ranges.size(); ++i) {
+        TestEqual(ranges[i - 1].second + 1, ranges[i].first);
+    }
+    auto whole = sst::sort_and_merge(caches, dir, nothing_older);
+    auto split = sst::sort_and_merge(caches, dir, nothing_older, {}, {},
+                                     std::numeric_limits<lsm::size_type>::max(), nullptr, {}, 4);
+    remove_inputs();
+    TestEqual(true, split.size() >= 4);
+    // Part of the records of an sst
+    TestEqual(1, whole.size());
+    TestEqual(5, whole[0].get_kv(nullptr, 995, 1004).size());
+    TestEqual(3000, whole[0].get_kv(nullptr, 3000, 3004).front().first);
+    // The same records as slices of one block
+    std::string block;
+    auto slices = whole[0].get_slices(block, nullptr, 995, 1004);
+    auto records = whole[0].get_kv(nullptr, 995, 1004);
+    TestEqual(records.size(), slices.size());
+    for (std::size_t i = 0; i < records.size(); ++i) {
+        TestEqual(records[i].first, slices[i].first);
+        TestEqual(records[i].second.seq, slices[i].second.seq);
+        TestEqual(records[i].second.value,
+                  std::string(slices[i].second.value, slices[i].second.length));
+    }
+    TestEqual(0, whole[0].get_slices(block, nullptr, 5000, 6000).size());
+    std::vector<std::pair<lsm::key_type, lsm::record>> whole_kv, split_kv;
+    for (auto *outputs : {&whole, &split}) {
+        auto &kv = outputs == &whole ? whole_kv : split_kv;
+        for (const auto &cache : *outputs) {
+            TestEqual(true, kv.empty() || kv.back().first < cache.header.lower);
+            for (auto &pair : cache.get_kv()) {
+                kv.push_back(std::move(pair));
+            }
+            utils::rmfile(cache.sst_path.c_str());
+        }
+    }
+    TestEqual(2000, whole_kv.size());
+    TestEqual(whole_kv.size(), split_kv.size());
+    for (std::size_t i = 0; i < whole_kv.size(); ++i) {
+        TestEqual(whole_kv[i].first, split_kv[i].first);
+        TestEqual(whole_kv[i].second.value, split_kv[i].second.value);
+    }
+
+    // A large table has its index laid out alongside the writes
+    mtb::MemTable large{9};
+    for (int i = 0; i < 2 * static_cast<int>(sst::PARALLEL_INDEX_MIN_KEYS); ++i) {
+        large.put(i * 7, std::to_string(i), 10000 + i);
+    }
+    auto large_sst = large.to_binary(dir + "/large.sst", 1);
+    auto large_read = sst::read_sst(large_sst.sst_path, 1);
+    TestEqual(large_read.header.count, large_sst.metadata()->indices.size());
+    TestEqual(large_read.file_size, large_sst.file_size);
+    TestEqual("4000"s, large_sst.get(28000).first.value);
+    TestEqual("4000"s, large_read.get(28000).first.value);
+    TestEqual(false, large_sst.get(28001).second);
+    utils::rmfile(large_sst.sst_path.c_str());
+
+    // A delta encoded index is smaller, and reads back in every layout
+    mtb::MemTable dense{6};
+    for (int i = 0; i < 1000; ++i) {
+        dense.put(1000 + i, std::to_string(i), 200 + i);
+    }
+    dense.del(1500, 1200);
+    lsm::index_options delta;
+    delta.encoding = lsm::index_encoding::DELTA;
+    auto fixed_sst = dense.to_binary(dir + "/fixed.sst", 1);
+    auto delta_sst = dense.to_binary(dir + "/delta.sst", 1, nullptr, delta);
+    // 12 bytes an entry, against 2 bytes and a share of the restart points
+    TestEqual(true, delta_sst.file_size + 1000 * 12 / 2 < fixed_sst.file_size);
+    for (auto layout :
+         {lsm::index_layout::BTREE, lsm::index_layout::LEARNED, lsm::index_layout::DELTA}) {
+        delta.layout = layout;
+        auto reread = sst::read_sst(delta_sst.sst_path, 1, delta);
+        TestEqual(1, reread.level);
+        TestEqual(1000, reread.metadata()->indices.size());
+        TestEqual(layout, reread.metadata()->indices.layout());
+        TestEqual("999"s, reread.get(1999).first.value);
+        TestEqual(true, reread.get(1500).first.is_deleted());
+        TestEqual(false, reread.get(2000).second);
+        TestEqual(reread.get_kv().size(), fixed_sst.get_kv().size());
+    }
+    // A truncated index is not read
+    std::fstream{delta_sst.sst_path, std::ios::binary | std::ios::in | std::ios::out}
+        .seekp(sst::HEADER_SIZE + lsm::BLF_SIZE)
+        .write("\x10\0\0\0", 4);
+    TestEqual(-1, sst::read_sst(delta_sst.sst_path, 1).level);
+    utils::rmfile(fixed_sst.sst_path.c_str());
+    utils::rmfile(delta_sst.sst_path.c_str());
+}
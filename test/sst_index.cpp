@@ -0,0 +1,133 @@
+#include <algorithm>
+#include <random>
+#include <vector>
+#include "../include/sst_index.hpp"
+
+#define TestEqual(expect, real) \
+    if ((expect) != (real))     \
+    return 1
+
+using index_type = sst::key_index;
+
+// Searches and walks an index of `n` keys drawn from [0, range), with repeats.
+static int check(std::size_t n, uint64_t range, std::mt19937_64 &engine,
+                 const lsm::index_options &opts) {
+    std::vector<uint64_t> keys(n);
+    for (auto &key : keys) {
+        key = engine() % range;
+    }
+    std::sort(keys.begin(), keys.end());
+    // The offset of an entry is its rank
+    std::vector<uint32_t> offsets(n);
+    for (std::size_t i = 0; i < n; ++i) {
+        offsets[i] = i;
+    }
+    index_type index{keys, offsets, opts};
+    TestEqual(n, index.size());
+    TestEqual(n == 0, index.empty());
+
+    std::size_t rank = 0;
+    for (auto pos = index.first(); pos != index_type::npos; pos = index.next(pos), ++rank) {
+        TestEqual(keys[rank], index.key(pos));
+        TestEqual(rank, index.offset(pos));
+    }
+    TestEqual(n, rank);
+    for (auto pos = index.last(); pos != index_type::npos; pos = index.prev(pos)) {
+        --rank;
+        TestEqual(rank, index.offset(pos));
+    }
+    TestEqual(0, rank);
+
+    auto expect_offset = [&](std::vector<uint64_t>::iterator it) -> uint64_t {
+        return it == keys.end() ? UINT64_MAX : it - keys.begin();
+    };
+    auto offset_at = [&](index_type::position pos) -> uint64_t {
+        return pos == index_type::npos ? UINT64_MAX : index.offset(pos);
+    };
+    for (int i = 0; i < 2000; ++i) {
+        uint64_t key = i % 2 == 0 && n > 0 ? keys[engine() % n] : engine() % (range + 2);
+        TestEqual(expect_offset(std::lower_bound(keys.begin(), keys.end(), key)),
+                  offset_at(index.lower_bound(key)));
+        TestEqual(expect_offset(std::upper_bound(keys.begin(), keys.end(), key)),
+                  offset_at(index.upper_bound(key)));
+    }
+    return 0;
+}
+
+int main() {
+    std::mt19937_64 engine{725};
+    index_type empty;
+    TestEqual(index_type::npos, empty.first());
+    TestEqual(index_type::npos, empty.lower_bound(0));
+
+    lsm::index_options learned{lsm::index_layout::LEARNED, 8};
+    lsm::index_options delta{lsm::index_layout::DELTA, 0, lsm::index_encoding::DELTA, 4};
+    for (const auto &opts : {lsm::index_options{}, learned, delta}) {
+        for (std::size_t n : {1, 7, 8, 9, 72, 80, 81, 100, 730, 6561, 100000}) {
+            TestEqual(0, check(n, 4 * n, engine, opts));  // Sparse keys
+            TestEqual(0, check(n, n / 4 + 1, engine, opts));  // Many versions of a key
+            TestEqual(0, check(n, UINT64_MAX, engine, opts));  // Anywhere in the key space
+        }
+        TestEqual(0, check(0, 1, engine, opts));
+
+        // The extremes of the key range
+        std::vector<uint64_t> keys{0, 0, 5, UINT64_MAX - 1, UINT64_MAX, UINT64_MAX};
+        std::vector<uint32_t> offsets{10, 11, 12, 13, 14, 15};
+        index_type index{keys, offsets, opts};
+        TestEqual(10, index.offset(index.lower_bound(0)));
+        TestEqual(12, index.offset(index.upper_bound(0)));
+        TestEqual(13, index.offset(index.lower_bound(6)));
+        TestEqual(14, index.offset(index.lower_bound(UINT64_MAX)));
+        TestEqual(index_type::npos, index.upper_bound(UINT64_MAX));
+        TestEqual(15, index.offset(index.last()));
+    }
+
+    // A model of dense keys is a single segment, however many versions a key has
+    std::vector<uint64_t> dense;
+    for (uint64_t key = 1000; key < 21000; ++key) {
+        dense.insert(dense.end(), key % 3 == 0 ? 2 : 1, key);
+    }
+    std::vector<uint32_t> zeros(dense.size(), 0);
+    index_type dense_index{dense, zeros, learned};
+    TestEqual(1, dense_index.model_size());
+    TestEqual(dense.size() - 2, dense_index.lower_bound(20998));
+    TestEqual(0, index_type(dense, zeros).model_size());
+
+    // The delta encoding round-trips, and a few bytes a key are left of dense keys
+    std::vector<uint32_t> dense_offsets(dense.size());
+    for (std::size_t i = 0; i < dense.size(); ++i) {
+        dense_offsets[i] = 4096 + 20 * i + i % 7;
+    }
+    std::string block = index_type::encode(dense, dense_offsets, 16);
+    std::size_t decoded = 0;
+    bool is_equal = true;
+    bool is_valid = index_type::decode(block, [&](uint64_t key, uint32_t offset) {
+        is_equal = is_equal && key == dense[decoded] && offset == dense_offsets[decoded];
+        ++decoded;
+    });
+    TestEqual(true, is_valid && is_equal);
+    TestEqual(dense.size(), decoded);
+    // The size is known before the offsets are moved to where the records start
+    std::vector<uint32_t> moved_offsets(dense_offsets);
+    for (auto &offset : moved_offsets) {
+        offset -= 4096;
+    }
+    TestEqual(block.size(), index_type::encoded_size(dense, moved_offsets, 16));
+    lsm::index_options sparse_restarts = delta;
+    sparse_restarts.restart_interval = 16;
+    index_type delta_index{dense, dense_offsets, sparse_restarts};
+    TestEqual(true, delta_index.memory_usage() < dense.size() * 4);
+    TestEqual(dense_offsets[100], delta_index.offset(delta_index.lower_bound(dense[100])));
+    auto ignore = [](uint64_t, uint32_t) {};
+    TestEqual(false, index_type::decode(block.substr(0, block.size() - 1), ignore));
+
+    // 12 bytes a key, and less than a node of padding
+    std::vector<uint64_t> many(100000);
+    for (std::size_t i = 0; i < many.size(); ++i) {
+        many[i] = i * 3;
+    }
+    index_type large{many, std::vector<uint32_t>(many.size(), 0)};
+    TestEqual(true, large.memory_usage() < many.size() * 12 + index_type::NODE_KEYS * 12);
+    TestEqual(true, large.memory_usage() * 4 <= many.size() * 16 * 3);
+    return 0;
+}
@@ -0,0 +1,85 @@
+#include <string>
+#include <thread>
+#include <vector>
+#include "../include/statistics.hpp"
+
+#define TestEqual(expect, real) \
+    if ((expect) != (real))     \
+    return 1
+
+int main() {
+    lsm::statistics stats;
+    TestEqual(0, stats.get(lsm::MEMTABLE_HIT));
+    TestEqual(0, stats.get(lsm::GET_NANOS).count);
+    TestEqual(0, stats.write_amplification());
+
+    // Counts from many threads add up
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 20; ++t) {
+        threads.emplace_back([&stats, t] {
+            for (int i = 0; i < 10000; ++i) {
+                stats.add(lsm::MEMTABLE_HIT);
+                stats.add(lsm::BLOOM_NEGATIVE, t % 3, 2);
+                stats.record(lsm::GET_NANOS, i + 1);
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    TestEqual(200000, stats.get(lsm::MEMTABLE_HIT));
+    TestEqual(140000, stats.get(lsm::BLOOM_NEGATIVE, 0));
+    TestEqual(140000, stats.get(lsm::BLOOM_NEGATIVE, 1));
+    TestEqual(120000, stats.get(lsm::BLOOM_NEGATIVE, 2));
+    TestEqual(400000, stats.get(lsm::BLOOM_NEGATIVE));
+    TestEqual(0, stats.get(lsm::BLOOM_POSITIVE));
+
+    auto get = stats.get(lsm::GET_NANOS);
+    TestEqual(200000, get.count);
+    TestEqual(20ull * 10000 * 10001 / 2, get.sum);
+    TestEqual(1, get.min);
+    TestEqual(10000, get.max);
+    TestEqual(true, get.average == 5000.5);
+    // A bucket spans a quarter of a power of two
+    TestEqual(true, get.p50 >= 5000 * 0.75 && get.p50 <= 5000 * 1.25);
+    TestEqual(true, get.p99 >= 9900 * 0.75 && get.p99 <= 10000);
+    TestEqual(true, get.p50 <= get.p95 && get.p95 <= get.p99);
+
+    // Small values fall into buckets of their own
+    stats.record(lsm::SST_PROBES_PER_GET, 0);
+    stats.record(lsm::SST_PROBES_PER_GET, 2);
+    stats.record(lsm::SST_PROBES_PER_GET, 2);
+    auto probes = stats.get(lsm::SST_PROBES_PER_GET);
+    TestEqual(3, probes.count);
+    TestEqual(0, probes.min);
+    TestEqual(2, probes.max);
+    TestEqual(true, probes.p99 >= 2 && probes.p99 <= 2);
+    stats.record(lsm::SST_PROBES_PER_GET, UINT64_MAX);
+    TestEqual(UINT64_MAX, stats.get(lsm::SST_PROBES_PER_GET).max);
+
+    stats.add(lsm::USER_BYTES_WRITTEN, 100);
+    stats.add(lsm::FLUSH_BYTES_WRITTEN, 120);
+    stats.add(lsm::COMPACTION_BYTES_WRITTEN, 230);
+    TestEqual(true, stats.write_amplification() == 3.5);
+
+    std::string text = stats.to_string();
+    TestEqual(true, text.find("lsm.memtable.hit COUNT : 200000\n") != std::string::npos);
+    TestEqual(true, text.find("lsm.bloom.negative COUNT : 400000 L0 : 140000") !=
+                        std::string::npos);
+    TestEqual(true, text.find("lsm.write.amplification : 3.5\n") != std::string::npos);
+    TestEqual(true, text.find("lsm.get.nanos P50 : ") != std::string::npos);
+
+    std::string json = stats.to_json();
+    TestEqual('{', json.front());
+    TestEqual('}', json.back());
+    TestEqual(true, json.find("\"lsm.memtable.hit\":200000,") != std::string::npos);
+    TestEqual(true, json.find("\"lsm.bloom.negative\":[140000,140000,120000,0,") !=
+                        std::string::npos);
+    TestEqual(true, json.find("\"lsm.get.nanos\":{\"count\":200000,") != std::string::npos);
+
+    stats.reset();
+    TestEqual(0, stats.get(lsm::MEMTABLE_HIT));
+    TestEqual(0, stats.get(lsm::GET_NANOS).count);
+    TestEqual(0, stats.get(lsm::GET_NANOS).max);
+    return 0;
+}
@@ -0,0 +1,158 @@
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "../include/MemTable.hpp"
+#include "../include/value_log.hpp"
+
+#define TestEqual(expect, real) \
+    if ((expect) != (real))     \
+    return 1
+
+using lsm::value_log;
+using lsm::value_pointer;
+
+static const std::string dir = "./value_log_data";
+
+static std::string value_of(int i) {
+    return std::string(1000 + i, 'a' + i % 26);
+}
+
+int main() {
+    // A pointer survives its encoding, which holds no '\0'
+    value_pointer ptr{0x123456789a, 4096, 70000}, decoded{0, 0, 0};
+    std::string encoded = ptr.encode();
+    TestEqual(value_pointer::ENCODED_SIZE, encoded.size());
+    TestEqual(std::string::npos, encoded.find('\0'));
+    TestEqual(true, value_pointer::decode(encoded, decoded));
+    TestEqual(ptr.number, decoded.number);
+    TestEqual(ptr.offset, decoded.offset);
+    TestEqual(ptr.size, decoded.size);
+    TestEqual(false, value_pointer::decode("a value", decoded));
+    TestEqual(false,
+              value_pointer::decode(std::string(value_pointer::ENCODED_SIZE, 'g'), decoded));
+
+    std::vector<std::string> names;
+    if (utils::dirExists(dir)) {
+        utils::scanDir(dir, names);
+    }
+    for (const auto &name : names) {
+        utils::rmfile((dir + '/' + name).c_str());
+    }
+
+    uint64_t last_number;
+    {
+        value_log log{dir};
+        TestEqual(true, log.empty());
+        auto writer = log.new_writer();
+        std::vector<value_pointer> ptrs;
+        for (int i = 0; i < 100; ++i) {
+            ptrs.push_back(writer->append(i, i + 1, value_of(i)));
+        }
+        log.install(*writer);
+        auto seg = log.current()->at(writer->segment_number());
+        TestEqual(writer->byte_size(), seg->size);
+
+        // A record resolves to its value, and only for its own key and sequence number
+        lsm::record rec{lsm::record_type::VALUE_POINTER, ptrs[7].encode(), 8};
+        log.resolve(7, rec);
+        TestEqual(true, rec.type == lsm::record_type::PUT);
+        TestEqual(value_of(7), rec.value);
+        lsm::record other{lsm::record_type::VALUE_POINTER, ptrs[7].encode(), 8};
+        bool is_thrown = false;
+        try {
+            log.resolve(8, other);
+        } catch (const std::runtime_error &) {
+            is_thrown = true;
+        }
+        TestEqual(true, is_thrown);
+
+        auto entries = value_log::read_entries(*seg);
+        TestEqual(100, entries.size());
+        TestEqual(50, entries[50].key);
+        TestEqual(51, entries[50].seq);
+        TestEqual(ptrs[50].offset, entries[50].offset);
+        TestEqual(value_of(50), entries[50].value);
+
+        // Picked once compactions drop enough of it
+        lsm::value_refs all, kept;
+        for (int i = 0; i < 100; ++i) {
+            lsm::add_value_ref(all, ptrs[i].encode());
+            if (i >= 60) {
+                lsm::add_value_ref(kept, ptrs[i].encode());
+            }
+        }
+        log.reset_garbage(all);
+        TestEqual(0, log.get_stats().garbage_bytes);
+        TestEqual(true, log.pick(0.5) == nullptr);
+        log.add_garbage(all, kept);
+        TestEqual(true, log.pick(0.5) == seg);
+        TestEqual(true, log.pick(0.7) == nullptr);
+
+        // Collected, it stays until the moved pointers are flushed, and while an older snapshot
+        // or an iterator may read it
+        auto pinned = log.current();
+        log.retire(seg, 200, 0, 5);
+        TestEqual(true, log.pick(0.5) == nullptr);
+        log.purge(lsm::MAX_SEQ, 4);
+        TestEqual(1, log.get_stats().files);
+        log.purge(150, 5);
+        TestEqual(1, log.get_stats().files);
+        log.purge(lsm::MAX_SEQ, 5);
+        TestEqual(0, log.get_stats().files);
+        TestEqual(1, log.get_stats().collections);
+        std::string path = seg->path;
+        seg.reset();
+        lsm::record old{lsm::record_type::VALUE_POINTER, ptrs[9].encode(), 10};
+        value_log::resolve(*pinned, 9, old);
+        TestEqual(value_of(9), old.value);
+        TestEqual(true, static_cast<bool>(std::ifstream{path}));
+        pinned.reset();
+        TestEqual(false, static_cast<bool>(std::ifstream{path}));
+
+        // An empty segment is not kept
+        auto empty = log.new_writer();
+        log.install(*empty);
+        auto kept_writer = log.new_writer();
+        kept_writer->append(1, 1, "kept");
+        log.install(*kept_writer);
+        last_number = kept_writer->segment_number();
+        TestEqual(1, log.get_stats().files);
+    }
+
+    // Reopened, it finds the segments, and numbers the new ones after them
+    value_log log{dir};
+    TestEqual(1, log.get_stats().files);
+    TestEqual(1, log.current()->count(last_number));
+    TestEqual(true, log.new_writer()->segment_number() > last_number);
+    lsm::value_refs none;
+    log.reset_garbage(none);
+    TestEqual(log.get_stats().bytes, log.get_stats().garbage_bytes);
+
+    // A flush installs its segment only once its sst is written
+    mtb::MemTable table{1};
+    table.put(1, value_of(1), 1);
+    table.put(2, "small", 2);
+    bool is_thrown = false;
+    try {
+        table.to_binary(dir + "/missing/table.sst", 0, nullptr, {}, &log, 512);
+    } catch (const std::runtime_error &) {
+        is_thrown = true;
+    }
+    TestEqual(true, is_thrown);
+    TestEqual(1, log.get_stats().files);
+    names.clear();
+    TestEqual(1, utils::scanDir(dir, names));
+    std::string sst_path = dir + "/table.sst";
+    auto cache = table.to_binary(sst_path, 0, nullptr, {}, &log, 512);
+    TestEqual(2, log.get_stats().files);
+    TestEqual(1, cache.value_refs.size());
+    // The sst stores what it points to, ahead of the footer
+    auto read = sst::read_sst(sst_path, 0);
+    TestEqual(true, read.value_refs == cache.value_refs);
+    TestEqual(cache.records_end(), read.records_end());
+    TestEqual(true, read.get(1).first.type == lsm::record_type::VALUE_POINTER);
+    TestEqual(std::string{"small"}, read.get(2).first.value);
+    utils::rmfile(sst_path.c_str());
+    return 0;
+}